@@ -3,15 +3,107 @@
 /* Connection delay in seconds */
 #define CONNECTDELAY 3
 
+/* Seconds the DHT connection has to stay up, respectively down, before
+ * we consider ourselves connected or disconnected */
+#define SELFUPDELAY 2
+#define SELFDOWNDELAY 10
+
+/* Seconds a friend may be offline before the online file is updated,
+ * transfers are cancelled as soon as it goes */
+#define FLAPDELAY 30
+
+/* Seconds between RTT pings to each online friend, 0 disables them */
+#define PINGDELAY 10
+
+/* Queued file sends running at once across all friends */
+#define QUEUEMAX 4
+
+/* Seconds a delta transfer waits for the other end before giving up,
+ * and the most blocks of an old copy that are signed */
+#define DELTATIMEOUT 30
+#define DELTAMAXSIGS (1 << 22)
+
+/* Milliseconds a changed file in sync/ has to stay quiet before it is
+ * sent, so that bursts of writes go out once */
+#define SYNCDELAY 500
+
+/* Swarm downloads: chunk size, chunks requested from each friend at
+ * once, seconds without data before a chunk is asked elsewhere and the
+ * largest file size a friend may announce */
+#define SWARMCHUNK    (256 * 1024)
+#define SWARMINFLIGHT 2
+#define SWARMSTALL    10
+#define SWARMMAXSIZE  (64ULL << 30)
+
+/* Size of the page aligned buffers received file data is gathered in
+ * for vmsplice(2), and how many are kept mapped ahead */
+#define RXBUFSZ (64 * 1024)
+#define RXPOOL  8
+
+/* Lifetime of resolved bootstrap hosts and failed lookups in seconds */
+#define RESOLVETTL     3600
+#define RESOLVEFAILTTL 60
+
 /* Ringing delay in seconds */
 #define RINGINGDELAY 16
 
 /* Maximum number of simultaneous calls */
 #define MAXCALLS 8
 
+/* Stats dump delay in seconds */
+#define STATSDELAY 5
+
+/* Offline time in seconds after which a friend's FIFOs are closed in
+ * fd budget mode */
+#define IDLEDELAY 3600
+
+/* Offline time in seconds after which a friend is hibernated */
+#define HIBERNATEDELAY 86400
+
+/* Events dispatched per loop iteration when replaying as fast as possible */
+#define REPLAYBATCH 64
+
+/* Number of friends listed in the top file */
+#define TOPN 10
+
+/* Seconds a single loop iteration may take before the watchdog writes
+ * a snapshot to the stall file, 0 disables the watchdog */
+#define STALLDELAY 5
+
+/* Seconds after startup at which RSS and open fds are taken as the
+ * baseline, and how far they may grow past it before a warning is
+ * logged: RSS in percent, fds in absolute numbers */
+#define DRIFTDELAY 3600
+#define DRIFTRSS 50
+#define DRIFTFDS 64
+
+/* File transfer tuning: chunk size in bytes (0 for the largest toxcore
+ * accepts), share of each iteration spent feeding chunks in percent and
+ * how many iterations to back off once the send queue is full */
+#define TXCHUNKSZ  0
+#define TXBUDGET   100
+#define TXCOOLDOWN 3
+
 static char *savefile        = ".ratox.tox";
 static int   encryptsavefile = 0;
 
+static int trace = 0; /* per-hop latency tracing of text messages */
+
+static int fdbudget   = 0; /* open friends' static files on demand, keeping at most this many */
+static int hibernate  = 0; /* close everything but text_in and remove of long offline friends */
+static int shard      = 0; /* keep friends in friends/AB/CD/<id> */
+static int shardlinks = 0; /* and link them as <id> in the base directory */
+
+/* CPUs each thread may run on, e.g. "0-1,3", or "" to leave placement
+ * to the scheduler (Linux only) */
+static char *cpumain     = "";
+static char *cpuresolver = "";
+static char *cpuwatchdog = "";
+
+static int rxsplice = 0; /* hand received file data to file_out with vmsplice(2), Linux only */
+
+static int syncfolder = 0; /* mirror sync/ to friends subscribed with sync_in */
+
 static int      ipv6        = 0;
 static int      udp         = 1;
 static int      proxy       = 0;
@@ -19,6 +111,44 @@ static int      proxytype   = 2; /* 1 = HTTP, 2 = SOCKS5 */
 static char     proxyaddr[] = "127.0.0.1";
 static uint16_t proxyport   = 9050;
 
+static int      localdiscovery = 1;
+static int      holepunching   = 1;
+static int      relay          = 0; /* serve as TCP relay for other instances */
+static uint16_t relayport      = 33445;
+
+static int      lan          = 0; /* prefer peers on the local network */
+static int      lanpublic    = 0; /* also bootstrap from nodes[] in LAN mode */
+static uint16_t lanstartport = 33445;
+static uint16_t lanendport   = 33545;
+
+/* Peers on the local network to bootstrap from in LAN mode.  The id is
+ * the peer's DHT key as logged on startup, not its Tox ID.  toxcore makes
+ * a new DHT key on every start, so an entry has to be refreshed from the
+ * peer's latest "Net > DHT key" line whenever it restarts. */
+static struct node lanpeers[] = {
+	/* {
+		.addr4 = "192.168.1.2",
+		.addr6 = NULL,
+		.port  = 33445,
+		.idstr = "0000000000000000000000000000000000000000000000000000000000000000"
+	}, */
+	{ .addr4 = NULL } /* end of table */
+};
+
+/* TCP relays to use, e.g. ratox instances running with -R.  The id is the
+ * relay's DHT key as logged on startup, not its Tox ID.  toxcore makes a
+ * new DHT key on every start, so an entry has to be refreshed from the
+ * relay's latest "Net > DHT key" line whenever it restarts. */
+static struct node relays[] = {
+	/* {
+		.addr4 = "10.0.0.1",
+		.addr6 = NULL,
+		.port  = 33445,
+		.idstr = "0000000000000000000000000000000000000000000000000000000000000000"
+	}, */
+	{ .addr4 = NULL } /* end of table */
+};
+
 static struct node nodes[] = {
 	{
 		.addr4 = "192.254.75.98",
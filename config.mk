@@ -8,4 +8,9 @@ MANPREFIX = $(PREFIX)/share/man
 CC = cc
 LD = $(CC)
 CPPFLAGS = -DVERSION=\"${VERSION}\"
-CFLAGS   = -g -I/usr/local/include -Wall -Wunused $(CPPFLAGS)
+CFLAGS   = -g -I/usr/local/include -Wall -Wunused -pthread $(CPPFLAGS)
+LDFLAGS  = -pthread
+
+# jemalloc, adds its statistics to the stats file
+#CPPFLAGS += -DJEMALLOC
+#LDFLAGS  += -ljemalloc
@@ -0,0 +1,30 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Stackless coroutines in the style of protothreads.  A coroutine is a
+ * function that returns when it suspends and continues at the same line
+ * once the event it waits on fires.  Locals don't survive a suspension
+ * and no switch statement may span one.  Needs queue.h. */
+
+struct coro {
+	int      line;	/* where to resume, 0 starts over */
+	int     *fdp;	/* resume once this fd is readable */
+	uint64_t wake;	/* resume at this monotonic time in ns */
+	int      ready;	/* resume on the next iteration */
+	int      ev;	/* the event that resumed it */
+	int    (*run)(void *);
+	void    *arg;
+	TAILQ_ENTRY(coro) rentry;	/* on the ready list */
+	TAILQ_ENTRY(coro) tentry;	/* on the timer list, by wake */
+	TAILQ_ENTRY(coro) fentry;	/* on the fd list */
+};
+
+TAILQ_HEAD(corohead, coro);
+
+enum { CRREADY = 1, CRTIMER, CRFD };
+
+#define CR_BEGIN(c)	switch ((c)->line) { case 0:
+#define CR_END(c)	} (c)->line = 0; return 0
+
+/* Return to the loop, which resumes here once the event set up in
+ * the coroutine fires */
+#define CR_SUSPEND(c)	do { (c)->line = __LINE__; return 1; case __LINE__:; } while (0)
@@ -0,0 +1,120 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdint.h>
+#include <string.h>
+
+#include <sodium.h>
+
+#include "delta.h"
+
+static uint32_t
+slot(struct dindex *x, uint32_t weak)
+{
+	return (weak ^ (weak >> 16) * 0x9e37) & x->mask;
+}
+
+/* Block size for a file of `sz' bytes, a power of two around its
+ * square root like rsync picks */
+size_t
+deltablocksz(uint64_t sz)
+{
+	uint64_t b = DELTAMINBLK;
+
+	while (b * b < sz && b < DELTAMAXBLK)
+		b *= 2;
+	return b;
+}
+
+/* The rsync checksum, a = sum(x[i]), b = sum((len - i) * x[i]), both
+ * mod 2^16.  Kept in 32 bits, which only wrap above the low half, so
+ * the loop has no carried dependency besides the sums and vectorizes. */
+uint32_t
+deltaweak(const uint8_t *p, size_t len)
+{
+	uint32_t a = 0, b = 0;
+	size_t   i;
+
+	for (i = 0; i < len; i++) {
+		a += p[i];
+		b += (uint32_t)(len - i) * p[i];
+	}
+	return (a & 0xffff) | (b << 16);
+}
+
+/* Slide the window of `weak' one byte, dropping `out' and taking `in' */
+uint32_t
+deltaroll(uint32_t weak, uint8_t out, uint8_t in, size_t len)
+{
+	uint32_t a = weak & 0xffff, b = weak >> 16;
+
+	a = (a - out + in) & 0xffff;
+	b = (b - (uint32_t)len * out + a) & 0xffff;
+	return a | (b << 16);
+}
+
+void
+deltastrong(uint8_t *h, const uint8_t *p, size_t len)
+{
+	crypto_generichash(h, DELTASTRONG, p, len, NULL, 0);
+}
+
+/* Sign `n' consecutive blocks of `blocksz' bytes */
+void
+deltasign(struct dsig *s, const uint8_t *p, size_t blocksz, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++, p += blocksz) {
+		s[i].weak = deltaweak(p, blocksz);
+		deltastrong(s[i].strong, p, blocksz);
+	}
+}
+
+/* Number of chain heads for `n' signatures, a power of two */
+uint32_t
+deltaslots(uint32_t n)
+{
+	uint32_t slots = 16;
+
+	while (slots < 2 * n && slots < (1U << 30))
+		slots *= 2;
+	return slots;
+}
+
+/* Chain the signatures, in block order so that duplicate blocks
+ * resolve to the first one */
+void
+deltaindex(struct dindex *x)
+{
+	uint32_t i, h;
+
+	memset(x->head, 0xff, (size_t)(x->mask + 1) * sizeof(*x->head));
+	for (i = x->n; i-- > 0; ) {
+		h = slot(x, x->sig[i].weak);
+		x->next[i] = x->head[h];
+		x->head[h] = i;
+	}
+}
+
+/* The block matching the window at `p', -1 for none.  The strong hash
+ * is computed once and only if a weak checksum matches. */
+int64_t
+deltafind(struct dindex *x, uint32_t weak, const uint8_t *p, size_t len)
+{
+	uint8_t  strong[DELTASTRONG];
+	uint32_t i;
+	int      hashed = 0;
+
+	if (!x->n)
+		return -1;
+	for (i = x->head[slot(x, weak)]; i != UINT32_MAX; i = x->next[i]) {
+		if (x->sig[i].weak != weak)
+			continue;
+		if (!hashed) {
+			deltastrong(strong, p, len);
+			hashed = 1;
+		}
+		if (!memcmp(x->sig[i].strong, strong, DELTASTRONG))
+			return i;
+	}
+	return -1;
+}
@@ -0,0 +1,32 @@
+/* See LICENSE file for copyright and license details. */
+
+/* rsync style delta encoding: the receiver signs each block of its old
+ * copy, the sender looks for those blocks at any offset of the new one */
+
+#define DELTASTRONG 16		/* strong hash bytes per block */
+#define DELTAMINBLK 512
+#define DELTAMAXBLK (64 * 1024)
+
+struct dsig {
+	uint32_t weak;
+	uint8_t  strong[DELTASTRONG];
+};
+
+/* Signatures chained by weak checksum, `head' has `mask' + 1 slots,
+ * `next' one per signature */
+struct dindex {
+	struct dsig *sig;
+	uint32_t     n;
+	uint32_t    *head;
+	uint32_t    *next;
+	uint32_t     mask;
+};
+
+size_t deltablocksz(uint64_t);
+uint32_t deltaweak(const uint8_t *, size_t);
+uint32_t deltaroll(uint32_t, uint8_t, uint8_t, size_t);
+void deltastrong(uint8_t *, const uint8_t *, size_t);
+void deltasign(struct dsig *, const uint8_t *, size_t, size_t);
+uint32_t deltaslots(uint32_t);
+void deltaindex(struct dindex *);
+int64_t deltafind(struct dindex *, uint32_t, const uint8_t *, size_t);
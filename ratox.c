@@ -1,19 +1,42 @@
 /* See LICENSE file for copyright and license details. */
-#include <sys/select.h>
+#ifdef __linux__
+#define _GNU_SOURCE /* CPU affinity */
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/uio.h>
+#endif
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#ifdef __GLIBC__
+#include <execinfo.h>
+#include <malloc.h>
+#if __GLIBC_PREREQ(2, 33)
+#define HAVE_MALLINFO2
+#endif
+#endif
 #include <fcntl.h>
 #include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -21,9 +44,18 @@
 #include <tox/toxav.h>
 #include <tox/toxencryptsave.h>
 
+#include <sodium.h>
+
+#ifdef JEMALLOC
+#include <jemalloc/jemalloc.h>
+#endif
+
 #include "arg.h"
 #include "queue.h"
+#include "coro.h"
+#include "delta.h"
 #include "readpassphrase.h"
+#include "utf8.h"
 #include "util.h"
 
 #define TOX_CLIENT_ID_SIZE TOX_PUBLIC_KEY_SIZE
@@ -97,8 +129,10 @@ static void setstatus(void *);
 static void setuserstate(void *);
 static void sendfriendreq(void *);
 static void setnospam(void *);
+static void setqueue(void *);
+static void setswarm(void *);
 
-enum { NAME, STATUS, STATE, REQUEST, NOSPAM };
+enum { NAME, STATUS, STATE, REQUEST, NOSPAM, QUEUE, SWARM };
 
 static struct slot gslots[] = {
 	[NAME]    = { .name = "name",	 .cb = setname,	      .outisfolder = 0, .dirfd = -1, .fd = {-1, -1, -1} },
@@ -106,6 +140,8 @@ static struct slot gslots[] = {
 	[STATE]   = { .name = "state",	 .cb = setuserstate,  .outisfolder = 0, .dirfd = -1, .fd = {-1, -1, -1} },
 	[REQUEST] = { .name = "request", .cb = sendfriendreq, .outisfolder = 1, .dirfd = -1, .fd = {-1, -1, -1} },
 	[NOSPAM]  = { .name = "nospam",	 .cb = setnospam,     .outisfolder = 0, .dirfd = -1, .fd = {-1, -1, -1} },
+	[QUEUE]   = { .name = "queue",	 .cb = setqueue,      .outisfolder = 0, .dirfd = -1, .fd = {-1, -1, -1} },
+	[SWARM]   = { .name = "swarm",	 .cb = setswarm,      .outisfolder = 1, .dirfd = -1, .fd = {-1, -1, -1} },
 };
 
 enum { FTEXT_IN,
@@ -121,6 +157,12 @@ enum { FTEXT_IN,
 	FSTATE,
 	FFILE_STATE,
 	//FCALL_STATE 
+	FLINK,
+	FQUEUE,
+	FDELTA_IN,
+	FDELTA,
+	FSYNC_IN,
+	FSYNC,
 };
 
 static struct file ffiles[] = {
@@ -137,6 +179,12 @@ static struct file ffiles[] = {
 	[FSTATE]      = { .type = STATIC, .name = "state",	  .flags = O_WRONLY | O_TRUNC  | O_CREAT },
 	[FFILE_STATE] = { .type = STATIC, .name = "file_pending", .flags = O_WRONLY | O_TRUNC  | O_CREAT },
 	//[FCALL_STATE] = { .type = STATIC, .name = "call_state",	  .flags = O_WRONLY | O_TRUNC  | O_CREAT },
+	[FLINK]       = { .type = STATIC, .name = "link",	  .flags = O_WRONLY | O_TRUNC  | O_CREAT },
+	[FQUEUE]      = { .type = STATIC, .name = "queue",	  .flags = O_WRONLY | O_CREAT		 },
+	[FDELTA_IN]   = { .type = FIFO,	  .name = "delta_in",	  .flags = O_RDONLY | O_NONBLOCK	 },
+	[FDELTA]      = { .type = FOLDER, .name = "delta",	  .flags = O_RDONLY | O_DIRECTORY	 },
+	[FSYNC_IN]    = { .type = FIFO,	  .name = "sync_in",	  .flags = O_RDONLY | O_NONBLOCK	 },
+	[FSYNC]       = { .type = STATIC, .name = "sync",	  .flags = O_WRONLY | O_TRUNC  | O_CREAT },
 };
 
 static char *ustate[] = {
@@ -148,15 +196,194 @@ static char *ustate[] = {
 
 enum { TRANSFER_NONE, TRANSFER_INITIATED, TRANSFER_PENDING, TRANSFER_INPROGRESS, TRANSFER_PAUSED };
 
+/* Each friend runs its outgoing and incoming transfer as a coroutine,
+ * the states above only tell where they are at */
+enum { CTX, CRX };
+
 struct transfer {
-	uint8_t  fnum;
+	uint32_t fnum;
 	uint8_t *buf;
 	int      chunksz;
 	ssize_t  n;
 	int      pendingbuf;
+	int      eof;	/* all data sent, completion still to be signalled */
 	int      state;
-	struct   timespec lastblock;
 	int      cooldown;
+	uint64_t start;
+	uint64_t bytes;
+	int      src;
+};
+
+/* Received file data on its way to file_out with vmsplice(), bytes
+ * before `off' have already been handed over */
+struct rxbuf {
+	uint8_t *base;
+	size_t   len;
+	size_t   off;
+};
+
+/* A file waiting to be sent, see the queue slot and delta_in */
+struct qent {
+	int    prio;
+	char  *path;
+	int    sync;	/* delta queue, path is in sync/ */
+	uint64_t at;	/* delta queue, when the change was seen */
+	TAILQ_ENTRY(qent) entry;
+};
+
+/* A file in our sync/ a friend fetches chunks of, see PKT_SQUERY.  It
+ * is hashed a budget at a time until it is known to match `want'. */
+struct share {
+	uint32_t sid;
+	int      fd;
+	uint64_t size;
+	char    *path;
+	struct   stat st;
+	uint8_t  want[crypto_generichash_BYTES];
+	int      hashed;
+	uint8_t *map;
+	uint64_t pos;
+	crypto_generichash_state *hs;
+	TAILQ_ENTRY(share) entry;
+};
+
+/* The hash of a file as of its size and mtime, see swarmquery() */
+struct hashent {
+	dev_t    dev;
+	ino_t    ino;
+	off_t    size;
+	struct   timespec mtim;
+	uint8_t  h[crypto_generichash_BYTES];
+};
+
+TAILQ_HEAD(sharehead, share);
+
+/* A chunk requested by a friend, sent from `off' up to `end' */
+struct serve {
+	struct share *sh;
+	uint32_t tag;
+	uint64_t off;
+	uint64_t end;
+	TAILQ_ENTRY(serve) entry;
+};
+
+TAILQ_HEAD(servehead, serve);
+
+enum { SNEW, SQUERIED, SHAVE, SNONE };
+
+/* A friend a swarm download may fetch from */
+struct source {
+	uint32_t frnum;
+	int      state;
+	int      inflight;
+	uint64_t bytes;
+	uint64_t busy;
+	uint64_t busyat;
+};
+
+/* Chunks are requested with a new tag each time, data carrying an old
+ * one is from an owner the chunk was taken from */
+struct chunk {
+	int64_t  owner;
+	uint32_t tag;
+	uint64_t got;
+	uint64_t last;
+	int      done;
+};
+
+/* A download from all friends holding a file, see the swarm slot */
+struct swarm {
+	uint32_t sid;
+	uint8_t  hash[crypto_generichash_BYTES];
+	char    *name;
+	char     tmp[NAME_MAX + sizeof("..part")];
+	int      fd;
+	int      sized;
+	uint64_t size;
+	struct   chunk *chunks;
+	size_t   nchunks;
+	size_t   ndone;
+	uint32_t tags;
+	struct   source *src;
+	size_t   nsrc;
+	uint64_t start;
+	time_t   seen;
+	TAILQ_ENTRY(swarm) entry;
+};
+
+/* A changed file in sync/, waiting for SYNCDELAY of quiet */
+struct syncent {
+	char    *rel;
+	uint64_t first;
+	uint64_t last;
+	int      echo;	/* our own rename of a received file */
+	TAILQ_ENTRY(syncent) entry;
+};
+
+/* A watched directory below sync/ */
+struct syncwatch {
+	int   wd;
+	char *rel;
+	TAILQ_ENTRY(syncwatch) entry;
+};
+
+TAILQ_HEAD(qhead, qent);
+
+/* A custom packet that could not be sent yet */
+struct pkt {
+	uint8_t buf[TOX_MAX_CUSTOM_PACKET_SIZE];
+	size_t  len;
+};
+
+enum { DOFFER, DSIGS, DSCAN, DWAIT };
+enum { DSIGN, DRECV };
+
+/* Outgoing delta transfer of the first file in the delta queue */
+struct dtx {
+	int      state;
+	uint32_t xid;
+	int      fd;
+	uint8_t *map;
+	uint64_t size;
+	size_t   blocksz;
+	struct   dindex idx;
+	uint32_t nsig;
+	uint64_t pos;
+	uint64_t lit;
+	uint32_t weak;
+	int      rolling;
+	uint32_t cpblock;
+	uint32_t cpcount;
+	uint64_t nlit;
+	uint64_t ncopy;
+	uint64_t start;
+	time_t   seen;
+	struct   pkt out;
+};
+
+/* Incoming delta transfer, rebuilt next to the old copy in delta/ or
+ * sync/.  `same' holds while the new copy matches the old one. */
+struct drx {
+	int      state;
+	uint32_t xid;
+	int      sync;
+	char     name[PATH_MAX];
+	char     tmp[PATH_MAX + sizeof("/..part")];
+	int      same;
+	int      dirfd;
+	int      fd;
+	struct   stat base;	/* the old copy as we found it */
+	uint8_t *map;
+	uint64_t mapsz;
+	int      wfd;
+	size_t   blocksz;
+	uint32_t nblocks;
+	uint32_t nsigned;
+	uint64_t size;
+	uint64_t written;
+	uint64_t start;
+	time_t   seen;
+	struct   pkt out;
 };
 
 enum {
@@ -166,6 +393,199 @@ enum {
 	INCOMPLETE   = 1 << 3,
 };
 
+/* Custom lossless packet ids (160-191) */
+enum {
+	PKT_TRACE   = 160,
+	PKT_DOFFER  = 161, /* xid, size, block size, sync, name */
+	PKT_DACCEPT = 162, /* xid, number of signed blocks */
+	PKT_DSIG    = 163, /* xid, first block, signatures */
+	PKT_DLIT    = 164, /* xid, literal bytes */
+	PKT_DCOPY   = 165, /* xid, first block, number of blocks */
+	PKT_DEND    = 166, /* xid, size, hash of the whole file */
+	PKT_DDONE   = 167, /* xid, status, from the receiver */
+	PKT_DCANCEL = 168, /* xid, status, from the sender */
+	PKT_SQUERY  = 169, /* sid, hash, name */
+	PKT_SHAVE   = 170, /* sid, size */
+	PKT_SNONE   = 171, /* sid */
+	PKT_SGET    = 172, /* sid, tag, chunk, chunk size */
+	PKT_SDATA   = 173, /* sid, tag, offset, data */
+	PKT_SCANCEL = 174, /* sid, tag */
+	PKT_SDONE   = 175, /* sid */
+};
+
+/* Custom lossy packet ids (200-254) */
+enum {
+	PKT_PING = 200,
+	PKT_PONG = 201,
+};
+
+/* Latency histograms, bucket i counts samples below 2^(i+1) us */
+#define HISTBUCKETS 32
+
+struct hist {
+	const char *name;
+	uint64_t    count;
+	uint64_t    sum;
+	uint64_t    bucket[HISTBUCKETS];
+};
+
+enum { HPICKUP, HQUEUE, HNET, HDISPATCH, HTOTAL };
+
+static struct hist traceh[] = {
+	[HPICKUP]   = { .name = "pickup"   }, /* text_in write to read */
+	[HQUEUE]    = { .name = "queue"    }, /* read to tox_friend_send_message() */
+	[HNET]      = { .name = "net"      }, /* send to receiver callback */
+	[HDISPATCH] = { .name = "dispatch" }, /* callback to text_out append */
+	[HTOTAL]    = { .name = "total"    }, /* text_in write to text_out append */
+};
+
+enum { HTEXTIN, HTEXTOUT, HSTATIC, HREQRECV, HREQREPLY, HFILEIN };
+
+/* Cost of each interface path, always collected */
+static struct hist pathh[] = {
+	[HTEXTIN]   = { .name = "text_in"       }, /* text_in read to tox_friend_send_message() */
+	[HTEXTOUT]  = { .name = "text_out"      }, /* text_out append */
+	[HSTATIC]   = { .name = "static"        }, /* static file rewrite */
+	[HREQRECV]  = { .name = "request_recv"  }, /* incoming request to its FIFO */
+	[HREQREPLY] = { .name = "request_reply" }, /* request FIFO read to accept/reject */
+	[HFILEIN]   = { .name = "file_in"       }, /* one file_in chunk read */
+};
+static uint64_t fileinbytes;
+
+enum { MFRIEND, MREQUEST, MXFER, MQUEUE, MSAVE, MRESOLVE, MREPLAY, MSYNC, MMISC };
+
+/* Heap usage of one subsystem */
+struct mtag {
+	const char *name;
+	size_t   cur;
+	size_t   peak;
+	uint64_t nalloc;
+	uint64_t nfree;
+	uint64_t nlast;
+};
+
+static struct mtag mtags[] = {
+	[MFRIEND]  = { .name = "friend"   },
+	[MREQUEST] = { .name = "request"  },
+	[MXFER]    = { .name = "transfer" },
+	[MQUEUE]   = { .name = "queue"    },
+	[MSAVE]    = { .name = "savedata" },
+	[MRESOLVE] = { .name = "resolve"  },
+	[MREPLAY]  = { .name = "replay"   },
+	[MSYNC]    = { .name = "sync"     },
+	[MMISC]    = { .name = "misc"     },
+};
+
+/* Prepended to tagged allocations, aligned like malloc()'s result */
+union mhdr {
+	struct {
+		size_t sz;
+		int    tag;
+	} h;
+	long double ld;
+	long long   ll;
+	void       *p;
+};
+
+static size_t savesize;
+
+/* Main loop iteration time, excluding the wait in poll() */
+static struct hist looph = { .name = "iter" };
+
+/* Resource usage now and at the end of the DRIFTDELAY warmup */
+struct usage {
+	size_t rsskb;
+	size_t nfds;
+};
+static struct usage usenow, usebase;
+static int driftwarned;
+
+/* Per friend resource usage, see the top file */
+struct acct {
+	uint64_t cpu;
+	uint64_t ncb;
+	uint64_t bytesin;
+	uint64_t bytesout;
+	uint64_t saves;
+};
+
+/* Transfer totals, one set for each direction */
+struct xferstats {
+	uint64_t    bytes;
+	uint64_t    done;
+	uint64_t    cancelled;
+	uint64_t    stalls;
+	struct hist time;
+};
+
+static struct xferstats txstats = { .time = { .name = "time" } };
+static struct xferstats rxstats = { .time = { .name = "time" } };
+
+/* Messages are counted both ways from when the friend came online, a
+ * trace follows the message it belongs to and carries its count */
+struct trace {
+	uint32_t ntx;
+	uint32_t nrx;
+	uint64_t rx;	/* when message nrx arrived and was written out */
+	uint64_t done;
+};
+
+/* Link quality of one friend, see the link file */
+#define LINKHIST 8
+
+struct link {
+	uint32_t seq;
+	int      waiting;
+	uint64_t pingat;
+	uint64_t rtt;
+	uint64_t srtt;
+	uint64_t pings;
+	uint64_t pongs;
+	double   txrate;
+	double   rxrate;
+	struct {
+		time_t t;
+		int    conn;
+	} hist[LINKHIST];
+	size_t   nhist;
+	int      dirty;
+};
+
+static struct hist rtth = { .name = "rtt" };
+static uint64_t npings, npongs;
+
+/* Recorded callback invocations, see record() */
+enum {
+	EVCONNSTATUS,
+	EVMESSAGE,
+	EVREQUEST,
+	EVNAME,
+	EVSTATUSMSG,
+	EVUSERSTATE,
+	EVFILECONTROL,
+	EVFILESENDREQ,
+	EVFILEDATA,
+	EVLOSSLESS,
+	EVSELFCONN,
+	EVLOSSY,
+};
+
+#define RECMAGIC "ratoxev1"
+
+/* time, type, friend, 2 x 32-bit and 1 x 64-bit argument, data length */
+#define EVHDRSZ (8 + 1 + 4 + 4 + 4 + 8 + 4)
+
+struct event {
+	uint64_t t;
+	int      type;
+	uint32_t frnum;
+	uint32_t a;
+	uint32_t b;
+	uint64_t c;
+	uint32_t len;
+	uint8_t *data;
+};
+
 /* struct call {
 	int      num;
 	int      state;
@@ -176,14 +596,40 @@ enum {
 }; */
 
 struct friend {
-	char    name[TOX_MAX_NAME_LENGTH + 1];
+	char    name[UTF8CLEANSZ(TOX_MAX_NAME_LENGTH)];
 	int32_t num;
 	uint8_t id[TOX_CLIENT_ID_SIZE];
 	char    idstr[2 * TOX_CLIENT_ID_SIZE + 1];
+	char    path[sizeof("friends/AB/CD/") + 2 * TOX_CLIENT_ID_SIZE];
 	int     dirfd;
 	int     fd[LEN(ffiles)];
+	uint64_t fdused[LEN(ffiles)];
+	int     idle;
+	int     dormant;
+	int     conn;
+	int     link;
+	uint64_t flaps;
+	time_t  offsince;
 	struct  transfer tx;
 	int     rxstate;
+	uint64_t rxstart;
+	uint64_t rxbytes;
+	uint64_t rxprobe;
+	uint32_t rxfnum;
+	struct  rxbuf rxb;
+	struct  coro co[2];
+	struct  trace trace;
+	struct  acct acct;
+	struct  link lnk;
+	struct  qhead queue;
+	int     qactive;
+	struct  qhead dqueue;
+	struct  dtx *dtx;
+	struct  drx *drx;
+	int     syncsub;
+	struct  sharehead shares;
+	struct  servehead serving;
+	struct  pkt sout;
 //	struct  call av;
 	TAILQ_ENTRY(friend) entry;
 };
@@ -196,8 +642,101 @@ struct request {
 	TAILQ_ENTRY(request) entry;
 };
 
+enum { RESOLVE_PENDING, RESOLVE_OK, RESOLVE_FAILED };
+
+/* Cached result of a bootstrap host lookup */
+struct resolve {
+	char    *host;
+	int      family;
+	char     addr[INET6_ADDRSTRLEN];
+	int      state;
+	time_t   expire;
+	TAILQ_ENTRY(resolve) entry;
+};
+
+/* What the main loop is busy with, for the watchdog */
+enum {
+	PCONNECT,
+	PITERATE,
+	PREPLAY,
+	PSTATS,
+	PPOLL,
+	PTRANSFER,
+	PSLOT,
+	PREQUEST,
+	PFRIEND,
+	PSAVE
+};
+
+static const char *phases[] = {
+	[PCONNECT]  = "connect",
+	[PITERATE]  = "iterate",
+	[PREPLAY]   = "replay",
+	[PSTATS]    = "stats",
+	[PPOLL]     = "poll",
+	[PTRANSFER] = "transfer",
+	[PSLOT]     = "slot",
+	[PREQUEST]  = "request",
+	[PFRIEND]   = "friend",
+	[PSAVE]     = "save"
+};
+
+/* Loop state as of the last iteration, published for the watchdog */
+struct snapshot {
+	uint64_t iter;
+	uint64_t start;
+	size_t   nfriends;
+	size_t   nonline;
+	size_t   ndormant;
+	size_t   nreqs;
+	size_t   ntx;
+	size_t   nrx;
+	size_t   npfds;
+};
+
+/* Static file fd cache slot for fd budget mode */
+struct fdent {
+	struct friend *f;
+	int    idx;
+};
+
 static TAILQ_HEAD(friendhead, friend) friendhead = TAILQ_HEAD_INITIALIZER(friendhead);
+static TAILQ_HEAD(dormanthead, friend) dormanthead = TAILQ_HEAD_INITIALIZER(dormanthead);
 static TAILQ_HEAD(reqhead, request) reqhead = TAILQ_HEAD_INITIALIZER(reqhead);
+static TAILQ_HEAD(resolvehead, resolve) resolvehead = TAILQ_HEAD_INITIALIZER(resolvehead);
+/* Coroutines to resume next, waiting on a timer and waiting on an fd */
+static struct corohead crreadyhead = TAILQ_HEAD_INITIALIZER(crreadyhead);
+static struct corohead crtimerhead = TAILQ_HEAD_INITIALIZER(crtimerhead);
+static struct corohead crfdhead = TAILQ_HEAD_INITIALIZER(crfdhead);
+
+/* Protects resolvehead, shared with the resolver thread */
+static pthread_mutex_t resolvelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  resolvecond = PTHREAD_COND_INITIALIZER;
+
+/* Protects wdsnap and nstalls, shared with the watchdog thread */
+static pthread_mutex_t wdlock = PTHREAD_MUTEX_INITIALIZER;
+static struct snapshot wdsnap;
+static uint64_t nstalls;
+static volatile sig_atomic_t phase = PPOLL;
+static volatile sig_atomic_t btfd = -1, btdone;
+
+enum { TMAIN, TRESOLVER, TWATCHDOG };
+
+/* Threads by role, for CPU placement and accounting */
+struct thread {
+	const char *name;
+	char      **cpus;
+	pthread_t   tid;
+	int         started;
+};
+
+static struct thread threads[] = {
+	[TMAIN]     = { .name = "main",     .cpus = &cpumain     },
+	[TRESOLVER] = { .name = "resolver", .cpus = &cpuresolver },
+	[TWATCHDOG] = { .name = "watchdog", .cpus = &cpuwatchdog },
+};
+
+static char *cpuprocess;
 
 static Tox *tox;
 static struct Tox_Options toxopt;
@@ -206,12 +745,88 @@ static struct Tox_Options toxopt;
 //static ToxAvCSettings toxavconfig;
 //static int    framesize;
 
+static struct fdent *fdcache;
+
+/* What the loop polls, rebuilt every iteration, and which fds were
+ * found ready indexed by fd */
+static struct pollfd *pfds;
+static size_t   npfds, pfdcap;
+static uint8_t *fdready;
+static int      fdreadycap;
+static uint64_t fdtick, fdhits, fdmisses;
+
+static char    *recfile, *replayfile;
+static char     replaysave[PATH_MAX];	/* what replay saves to instead */
+static FILE    *recfp, *replayfp;
+static int      replayfast;
+static uint64_t recstart, nreplayed;
+static struct event replayev;
+static int      replaypending;
+static uint64_t nrxmsg, ntxmsg;
+static uint64_t nsanitized;
+
+/* DHT connection as last reported by toxcore and as debounced */
+static int      selfconn = TOX_CONNECTION_NONE;
+static time_t   selfsince, bootat;
+static int      connected;
+static uint64_t nselfchanges;
+static uint64_t nflaps;
+static size_t   nqueued, nqactive;
+static int      queuedue;	/* a send ended or was queued, see queuepass() */
+static time_t   queueretry;
+
+/* Mapped, never used buffers for rxbuf, gifted pages are not reused */
+static uint8_t *rxpool[RXPOOL];
+static size_t   nrxpool;
+static uint64_t nrxsplices, nrxspliced;
+
+static uint32_t deltaxid;
+static uint64_t deltasent, deltarecv, deltafailed, deltalitbytes, deltacopybytes;
+static struct hist deltah = { .name = "time" };
+
+static TAILQ_HEAD(synchead, syncent) synchead = TAILQ_HEAD_INITIALIZER(synchead);
+static TAILQ_HEAD(watchhead, syncwatch) watchhead = TAILQ_HEAD_INITIALIZER(watchhead);
+static int      syncfd = -1;
+static time_t   syncsince;
+static size_t   nsyncpending, nsyncwatches;
+static uint64_t nsyncqueued, nsyncsent, nsyncapplied, nsyncconflicts;
+static struct hist synch = { .name = "lag" };
+
+static TAILQ_HEAD(swarmhead, swarm) swarmhead = TAILQ_HEAD_INITIALIZER(swarmhead);
+static uint32_t swarmsid;
+static struct hashent hashcache[32];
+static size_t   nhashcache;
+static uint64_t nswarmdone, nswarmfailed, nswarmbytes, nstolen, nserved;
+
 static uint8_t *passphrase;
 static uint32_t pplen;
 
 static volatile sig_atomic_t running = 1;
 
 static struct timespec timediff(struct timespec, struct timespec);
+static uint64_t realns(void);
+static uint64_t monons(void);
+static uint64_t cpuns(void);
+static void charge(struct friend *, uint64_t);
+static void topdump(void);
+static void record(int, uint32_t, uint32_t, uint32_t, uint64_t, const uint8_t *, size_t);
+static int replayread(struct event *);
+static void replaydispatch(struct event *);
+static int replaystep(void);
+static void pack32(uint8_t *, uint32_t);
+static void pack64(uint8_t *, uint64_t);
+static uint32_t unpack32(const uint8_t *);
+static uint64_t unpack64(const uint8_t *);
+static void histadd(struct hist *, uint64_t);
+static void histdump(int, const char *, struct hist *);
+static void *tmalloc(int, size_t);
+static void *tcalloc(int, size_t, size_t);
+static char *tstrdup(int, const char *);
+static void tfree(void *);
+static void memdump(int);
+static size_t rsskb(void);
+static void driftcheck(time_t);
+static void statsdump(void);
 static void printrat(void);
 static void logmsg(const char *, ...);
 static int fifoopen(int, struct file);
@@ -228,7 +843,10 @@ static void cancelcall(struct friend *, char *);
 static void sendfriendcalldata(struct friend *);*/
 /**/
 static void cbfriendrequest(Tox *, const uint8_t *, const uint8_t *, size_t,  void *);
+static void cbselfconnstatus(Tox *, enum TOX_CONNECTION, void *);
+static void selfconnstep(time_t);
 static void cbconnstatus(Tox *, uint32_t, enum TOX_CONNECTION, void *udata);
+static void friendlink(struct friend *, time_t);
 static void cbfriendmessage(Tox *, uint32_t,  enum TOX_MESSAGE_TYPE,  const uint8_t *, size_t, void *);
 static void cbnamechange(Tox *, uint32_t,  const uint8_t *, size_t,  void *);
 static void cbstatusmessage(Tox *, uint32_t,  const uint8_t *, size_t,  void *);
@@ -236,6 +854,15 @@ static void cbuserstate(Tox *, uint32_t,  enum TOX_USER_STATUS,  void *);
 static void cbfilecontrol(Tox *, uint32_t,  uint32_t,  enum TOX_FILE_CONTROL,  void *);
 static void cbfilesendreq(Tox *, uint32_t,  uint32_t,  uint64_t,  size_t,  void *);
 static void cbfiledata(Tox *, uint32_t,  uint32_t, uint32_t,  uint64_t, const uint8_t *, size_t, void *);
+static void cblosslesspacket(Tox *, uint32_t, const uint8_t *, size_t, void *);
+static void cblossypacket(Tox *, uint32_t, const uint8_t *, size_t, void *);
+static void deltapacket(struct friend *, const uint8_t *, size_t);
+static void syncecho(const char *);
+static void swarmpacket(struct friend *, const uint8_t *, size_t);
+static void sharedrop(struct friend *, struct share *);
+static void sendping(struct friend *);
+static void linkevent(struct friend *, int);
+static void linkdump(struct friend *);
 /**/
 
 /*
@@ -249,11 +876,32 @@ static void cbfilecontrol(Tox *, int32_t, uint8_t, uint8_t, uint8_t, const uint8
 static void cbfilesendreq(Tox *, int32_t, uint8_t, uint64_t, const uint8_t *, uint16_t, void *);
 static void cbfiledata(Tox *, int32_t, uint8_t, const uint8_t *, uint16_t, void *);
 */
+static void xferdone(struct friend *, struct xferstats *, uint64_t *, uint64_t, int);
 static void canceltxtransfer(struct friend *);
+static void rxclose(struct friend *);
 static void cancelrxtransfer(struct friend *);
+static uint8_t *rxbufget(void);
+static void rxbufdrop(struct friend *);
+static int rxflush(struct friend *, int);
+static void rxpoolfill(void);
 static void sendfriendfile(struct friend *);
 static void sendfriendtext(struct friend *);
+static void sendtrace(struct friend *, uint64_t, uint64_t, uint64_t);
 static void removefriend(struct friend *);
+static void queueadd(struct friend *, int, const char *);
+static void queueload(struct friend *);
+static void queuedump(struct friend *);
+static void queueout(void);
+static int queuestart(struct friend *);
+static void queuestop(struct friend *, int);
+static void queuepass(void);
+static int ffileget(struct friend *, int);
+static void ffilewrite(struct friend *, int, const char *, ...);
+static void fdcachedrop(struct friend *);
+static void friendidle(struct friend *);
+static void friendwake(struct friend *);
+static void friendhibernate(struct friend *);
+static struct friend *friendlookup(uint32_t, int);
 static int readpass(const char *, uint8_t **, uint32_t *);
 static int tox_load(Tox *, uint8_t*, off_t);
 static int tox_encrypted_load(Tox *, uint8_t*, off_t);
@@ -263,23 +911,40 @@ static void dataload(void);
 static void datasave(void);
 static int localinit(void);
 static int toxinit(void);
+static void cpupin(const char *, pthread_t, const char *, int);
+static void threadinit(void);
+static void threadstart(int, void *(*)(void *));
+static void *resolver(void *);
+static void resolverinit(void);
+static size_t countfds(void);
+static void backtracedump(int);
+static void stalldump(struct snapshot *, int, uint64_t);
+static void *watchdog(void *);
+static void watchdoginit(void);
+static int resolve(const char *, char *, size_t);
+static void nodeadd(struct node *, int);
 static int toxconnect(void);
 static void id2str(uint8_t *, char *);
 static void str2id(char *, uint8_t *);
+static void frienddir(struct friend *);
 static struct friend *friendcreate(int32_t);
 static void friendload(void);
-static void frienddestroy(struct friend *);
+static void frienddestroy(struct friend *, int);
+static void recordinit(void);
 static void loop(void);
 static void initshutdown(int);
-static void shutdown(void);
+static void cleanup(void);
 static void usage(void);
 
 #define FD_APPEND(fd) do {	\
-	FD_SET((fd), &rfds);	\
+	pfdadd(fd);		\
 	if ((fd) > fdmax)	\
 		fdmax = (fd);	\
 } while (0)
 
+/* Whether poll() found fd readable, or at its end */
+#define FD_READY(fd) ((fd) >= 0 && (fd) <= fdmax && fdready[(fd)])
+
 #undef MIN
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 
@@ -377,151 +1042,617 @@ timediff(struct timespec t1, struct timespec t2)
 	return tmp;
 }
 
+static uint64_t
+realns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t
+monons(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 static void
-printrat(void)
+crpush(struct coro *c, int ev)
 {
-	printf(	"\033[31m"
-		"                /y\\            /y\\\n"
-		"               /ver\\          /"VERSION"\\\n"
-		"               yyyyyy\\      /yyyyyy\n"
-		"               \\yyyyyyyyyyyyyyyyyy/\n"
-		"                yyyyyyyyyyyyyyyyyy\n"
-		"                yyyyyyyyyyyyyyyyyy\n"
-		"                yyy'yyyyyyyyyy'yyy\n"
-		"                \\yy  yyyyyyyy  yy/\n"
-		"                 \\yy.yyyyyyyy.yy/\n"
-		"                  \\yyyyyyyyyyyy/\n"
-		"                    \\yyyyyyyy/\n"
-		"              -------yyyyyyyy-------\n"
-		"                 ..---yyyyyy---..\n"
-		"                   ..--yyyy--..\n"
-		"\033[0m\n");
+	if (c->ready)
+		return;
+	c->ready = 1;
+	c->ev = ev;
+	TAILQ_INSERT_TAIL(&crreadyhead, c, rentry);
 }
 
+/* Resume the coroutine on the next iteration regardless of what it
+ * waits on, callbacks use this to hand it news */
 static void
-logmsg(const char *fmt, ...)
+crready(struct coro *c)
 {
-	time_t  t;
-	va_list ap;
-	char    buft[64];
+	crpush(c, CRREADY);
+}
 
-	va_start(ap, fmt);
-	t = time(NULL);
-	strftime(buft, sizeof(buft), "%F %R", localtime(&t));
-	printf("%s ", buft);
-	vfprintf(stdout, fmt, ap);
-	va_end(ap);
+/* Forget what the coroutine waits on */
+static void
+crunwait(struct coro *c)
+{
+	if (c->wake)
+		TAILQ_REMOVE(&crtimerhead, c, tentry);
+	if (c->fdp)
+		TAILQ_REMOVE(&crfdhead, c, fentry);
+	c->wake = 0;
+	c->fdp = NULL;
 }
 
-static int
-fifoopen(int dirfd, struct file f)
+/* Set up what the coroutine waits on before it suspends: `fdp' turning
+ * readable or `ns' passing, whichever is set.  The timer list stays
+ * sorted so the loop only looks at its head. */
+static void
+crwait(struct coro *c, int *fdp, uint64_t ns)
 {
-	int fd;
+	struct coro *t;
 
-	fd = openat(dirfd, f.name, f.flags, 0666);
-	if (fd < 0 && errno != ENXIO)
-		eprintf("openat %s:", f.name);
-	return fd;
+	crunwait(c);
+	if (fdp) {
+		c->fdp = fdp;
+		TAILQ_INSERT_TAIL(&crfdhead, c, fentry);
+	}
+	if (!ns)
+		return;
+	c->wake = monons() + ns;
+	TAILQ_FOREACH_REVERSE(t, &crtimerhead, corohead, tentry)
+		if (t->wake <= c->wake)
+			break;
+	if (t)
+		TAILQ_INSERT_AFTER(&crtimerhead, t, c, tentry);
+	else
+		TAILQ_INSERT_HEAD(&crtimerhead, c, tentry);
 }
 
+/* Take the coroutine off every list, before its owner goes away */
 static void
-fiforeset(int dirfd, int *fd, struct file f)
+crdrop(struct coro *c)
 {
-	ssize_t r;
+	crunwait(c);
+	if (c->ready)
+		TAILQ_REMOVE(&crreadyhead, c, rentry);
+	c->ready = 0;
+}
 
-	r = unlinkat(dirfd, f.name, 0);
-	if (r < 0 && errno != ENOENT)
-		eprintf("unlinkat %s:", f.name);
-	if (*fd != -1)
-		close(*fd);
-	r = mkfifoat(dirfd, f.name, 0666);
-	if (r < 0 && errno != EEXIST)
-		eprintf("mkfifoat %s:", f.name);
-	*fd = fifoopen(dirfd, f);
+static uint64_t
+cpuns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-static ssize_t
-fiforead(int dirfd, int *fd, struct file f, void *buf, size_t sz)
+/* Charge the CPU time used since `t0' to the friend */
+static void
+charge(struct friend *f, uint64_t t0)
 {
-	ssize_t r;
+	f->acct.cpu += cpuns() - t0;
+}
 
-again:
-	r = read(*fd, buf, sz);
-	if (r == 0) {
-		fiforeset(dirfd, fd, f);
-		return 0;
-	} else if (r < 0) {
-		if (errno == EINTR)
-			goto again;
-		if (errno == EWOULDBLOCK)
-			return -1;
-		eprintf("read %s:", f.name);
-	}
-	return r;
+static void
+pack32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
 }
 
-/*static uint32_t
-interval(Tox *m, ToxAv *av)
+static void
+pack64(uint8_t *p, uint64_t v)
 {
-	return MIN(tox_do_interval(m), toxav_do_interval(av));
-}*/
+	pack32(p, v >> 32);
+	pack32(p + 4, v);
+}
 
 static uint32_t
-interval(Tox *m)
+unpack32(const uint8_t *p)
 {
-	return tox_iteration_interval(m);
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	       (uint32_t)p[2] << 8 | p[3];
 }
 
-/*static void
-cbcallinvite(void *av, int32_t cnum, void *udata)
+static uint64_t
+unpack64(const uint8_t *p)
 {
-	struct  friend *f;
-	ToxAvCSettings avconfig;
-	int32_t fnum, r;
+	return (uint64_t)unpack32(p) << 32 | unpack32(p + 4);
+}
 
-	fnum = toxav_get_peer_id(toxav, cnum, 0);
-	if (fnum < 0) {
-		weprintf("Failed to determine peer-id from call-id\n");
-		r = toxav_reject(toxav, cnum, NULL);
-		if (r < 0)
-			weprintf("Failed to reject call\n");
-		return;
-	}
-	TAILQ_FOREACH(f, &friendhead, entry)
-		if (f->num == fnum)
-			break;
-	if (!f)
-		return;
+/* Record a sample given in nanoseconds */
+static void
+histadd(struct hist *h, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	int      i;
 
-	f->av.num = cnum;
-	r = toxav_get_peer_csettings(toxav, cnum, 0, &avconfig);
-	if (r < 0) {
-		weprintf("Failed to determine peer call type\n");
-		r = toxav_reject(toxav, f->av.num, NULL);
-		if (r < 0)
-			weprintf("Failed to reject call\n");
-		return;
+	for (i = 0; i < HISTBUCKETS - 1 && us >> (i + 1); i++)
+		;
+	h->bucket[i]++;
+	h->count++;
+	h->sum += us;
+}
+
+static void
+histdump(int fd, const char *prefix, struct hist *h)
+{
+	size_t b;
+
+	dprintf(fd, "%s.%s.count %llu\n", prefix, h->name,
+		(unsigned long long)h->count);
+	dprintf(fd, "%s.%s.sum_us %llu\n", prefix, h->name,
+		(unsigned long long)h->sum);
+	for (b = 0; b < HISTBUCKETS; b++) {
+		if (!h->bucket[b])
+			continue;
+		dprintf(fd, "%s.%s.lt_%lluus %llu\n", prefix, h->name,
+			1ULL << (b + 1), (unsigned long long)h->bucket[b]);
 	}
+}
 
-	logmsg(": %s : Audio : Rx > Inviting (%luHz/%luch)\n",
-	       f->name, avconfig.audio_sample_rate, avconfig.audio_channels);
+/* Allocate `sz' bytes accounted to `tag', NULL on failure */
+static void *
+ttrymalloc(int tag, size_t sz)
+{
+	union mhdr *h;
 
-	ftruncate(f->fd[FCALL_STATE], 0);
-	lseek(f->fd[FCALL_STATE], 0, SEEK_SET);
-	dprintf(f->fd[FCALL_STATE], "pending\n");
+	if (sz > SIZE_MAX - sizeof(*h))
+		return NULL;
+	h = malloc(sizeof(*h) + sz);
+	if (!h)
+		return NULL;
+	h->h.sz = sz;
+	h->h.tag = tag;
+	mtags[tag].nalloc++;
+	mtags[tag].cur += sz;
+	if (mtags[tag].cur > mtags[tag].peak)
+		mtags[tag].peak = mtags[tag].cur;
+	return h + 1;
 }
 
-static void
-cbcallstart(void *av, int32_t cnum, void *udata)
+/* Allocate `sz' bytes accounted to `tag', dies on failure */
+static void *
+tmalloc(int tag, size_t sz)
 {
-	struct friend *f;
-	int    r;
-
-	TAILQ_FOREACH(f, &friendhead, entry)
-		if (f->av.num == cnum)
-			break;
-	if (!f)
-		return;
+	void *p;
+
+	if (sz > SIZE_MAX - sizeof(union mhdr))
+		eprintf("malloc: Size overflow\n");
+	if (!(p = ttrymalloc(tag, sz)))
+		eprintf("malloc:");
+	return p;
+}
+
+/* For sizes a friend picked, NULL on failure */
+static void *
+ttrycalloc(int tag, size_t n, size_t sz)
+{
+	void *p;
+
+	if (sz && n > SIZE_MAX / sz)
+		return NULL;
+	if ((p = ttrymalloc(tag, n * sz)))
+		memset(p, 0, n * sz);
+	return p;
+}
+
+static void *
+tcalloc(int tag, size_t n, size_t sz)
+{
+	void *p;
+
+	if (sz && n > SIZE_MAX / sz)
+		eprintf("calloc: Size overflow\n");
+	p = tmalloc(tag, n * sz);
+	memset(p, 0, n * sz);
+	return p;
+}
+
+static char *
+tstrdup(int tag, const char *s)
+{
+	size_t n = strlen(s) + 1;
+
+	return memcpy(tmalloc(tag, n), s, n);
+}
+
+static void
+tfree(void *p)
+{
+	union mhdr *h;
+
+	if (!p)
+		return;
+	h = (union mhdr *)p - 1;
+	mtags[h->h.tag].cur -= h->h.sz;
+	mtags[h->h.tag].nfree++;
+	free(h);
+}
+
+static void
+memdump(int fd)
+{
+	size_t i;
+#ifdef JEMALLOC
+	uint64_t epoch = 1;
+	size_t   v, sz;
+#elif defined(HAVE_MALLINFO2)
+	struct mallinfo2 mi;
+#endif
+
+	for (i = 0; i < LEN(mtags); i++) {
+		dprintf(fd, "mem.%s.cur_bytes %zu\n", mtags[i].name, mtags[i].cur);
+		dprintf(fd, "mem.%s.peak_bytes %zu\n", mtags[i].name, mtags[i].peak);
+		dprintf(fd, "mem.%s.allocs %llu\n", mtags[i].name,
+			(unsigned long long)mtags[i].nalloc);
+		dprintf(fd, "mem.%s.frees %llu\n", mtags[i].name,
+			(unsigned long long)mtags[i].nfree);
+		dprintf(fd, "mem.%s.allocs_per_s %.2f\n", mtags[i].name,
+			(double)(mtags[i].nalloc - mtags[i].nlast) / STATSDELAY);
+		mtags[i].nlast = mtags[i].nalloc;
+	}
+	dprintf(fd, "tox.savedata_bytes %zu\n", savesize);
+#ifdef JEMALLOC
+	/* Refresh the cached statistics first */
+	sz = sizeof(epoch);
+	mallctl("epoch", &epoch, &sz, &epoch, sz);
+	sz = sizeof(v);
+	if (mallctl("stats.allocated", &v, &sz, NULL, 0) == 0)
+		dprintf(fd, "malloc.allocated_bytes %zu\n", v);
+	if (mallctl("stats.resident", &v, &sz, NULL, 0) == 0)
+		dprintf(fd, "malloc.resident_bytes %zu\n", v);
+#elif defined(HAVE_MALLINFO2)
+	mi = mallinfo2();
+	dprintf(fd, "malloc.allocated_bytes %zu\n", mi.uordblks + mi.hblkhd);
+	dprintf(fd, "malloc.free_bytes %zu\n", mi.fordblks);
+#endif
+}
+
+static size_t
+rsskb(void)
+{
+	FILE  *fp;
+	size_t size, rss = 0;
+
+	fp = fopen("/proc/self/statm", "r");
+	if (!fp)
+		return 0;
+	if (fscanf(fp, "%zu %zu", &size, &rss) != 2)
+		rss = 0;
+	fclose(fp);
+	return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* Sample resource usage and warn once when it has drifted too far
+ * from the baseline */
+static void
+driftcheck(time_t uptime)
+{
+	int drift;
+
+	usenow.rsskb = rsskb();
+	usenow.nfds = countfds();
+	if (!usebase.nfds) {
+		if (uptime >= DRIFTDELAY)
+			usebase = usenow;
+		return;
+	}
+	drift = usenow.nfds > usebase.nfds + DRIFTFDS ||
+		(usebase.rsskb &&
+		 usenow.rsskb > usebase.rsskb + usebase.rsskb * DRIFTRSS / 100);
+	if (drift && !driftwarned) {
+		weprintf("Resource usage drift: rss %zu kB (was %zu kB), fds %zu (was %zu)\n",
+			 usenow.rsskb, usebase.rsskb, usenow.nfds, usebase.nfds);
+		driftwarned = 1;
+	}
+}
+
+static void
+statsdump(void)
+{
+	struct friend *f;
+	struct swarm *s;
+	struct timespec ts;
+	clockid_t cid;
+	size_t i, nfds = 0, nidle = 0, ndormant = 0, ntcp = 0, nudp = 0, nswarms = 0;
+	int    fd;
+
+	fd = open("stats.tmp", O_WRONLY | O_TRUNC | O_CREAT, 0666);
+	if (fd < 0) {
+		weprintf("open %s:", "stats.tmp");
+		return;
+	}
+	TAILQ_FOREACH(f, &friendhead, entry) {
+		nfds += f->dirfd != -1;
+		for (i = 0; i < LEN(ffiles); i++)
+			nfds += f->fd[i] != -1;
+		nidle += f->idle;
+		ntcp += f->link == TOX_CONNECTION_TCP;
+		nudp += f->link == TOX_CONNECTION_UDP;
+	}
+	TAILQ_FOREACH(f, &dormanthead, entry) {
+		nfds += f->fd[FTEXT_IN] != -1;
+		nfds += f->fd[FREMOVE] != -1;
+		ndormant++;
+	}
+	dprintf(fd, "friends.dormant %zu\n", ndormant);
+	dprintf(fd, "friends.flaps %llu\n", (unsigned long long)nflaps);
+	dprintf(fd, "queue.queued %zu\n", nqueued);
+	dprintf(fd, "queue.active %zu\n", nqactive);
+	dprintf(fd, "friends.tcp %zu\n", ntcp);
+	dprintf(fd, "friends.udp %zu\n", nudp);
+	dprintf(fd, "link.pings %llu\n", (unsigned long long)npings);
+	dprintf(fd, "link.pongs %llu\n", (unsigned long long)npongs);
+	histdump(fd, "link", &rtth);
+	dprintf(fd, "fd.friends %zu\n", nfds);
+	dprintf(fd, "fd.idle %zu\n", nidle);
+	if (fdbudget) {
+		dprintf(fd, "fd.cache.size %d\n", fdbudget);
+		dprintf(fd, "fd.cache.hits %llu\n", (unsigned long long)fdhits);
+		dprintf(fd, "fd.cache.misses %llu\n", (unsigned long long)fdmisses);
+		dprintf(fd, "fd.cache.hitrate %.3f\n",
+			fdhits + fdmisses ? (double)fdhits / (fdhits + fdmisses) : 0.0);
+	}
+	pthread_mutex_lock(&wdlock);
+	dprintf(fd, "loop.stalls %llu\n", (unsigned long long)nstalls);
+	pthread_mutex_unlock(&wdlock);
+	histdump(fd, "loop", &looph);
+	dprintf(fd, "dht.connected %d\n", connected);
+	dprintf(fd, "dht.changes %llu\n", (unsigned long long)nselfchanges);
+	memdump(fd);
+	for (i = 0; i < LEN(threads); i++) {
+		if (!threads[i].started ||
+		    pthread_getcpuclockid(threads[i].tid, &cid) != 0 ||
+		    clock_gettime(cid, &ts) < 0)
+			continue;
+		dprintf(fd, "thread.%s.cpu_ms %llu\n", threads[i].name,
+			(ts.tv_sec * 1000000000ULL + ts.tv_nsec) / 1000000);
+	}
+	dprintf(fd, "mem.rss_kb %zu\n", usenow.rsskb);
+	dprintf(fd, "fd.open %zu\n", usenow.nfds);
+	if (usebase.nfds) {
+		dprintf(fd, "drift.rss_kb %zd\n", (ssize_t)(usenow.rsskb - usebase.rsskb));
+		dprintf(fd, "drift.fds %zd\n", (ssize_t)(usenow.nfds - usebase.nfds));
+	}
+	dprintf(fd, "text.rx %llu\n", (unsigned long long)nrxmsg);
+	dprintf(fd, "text.sanitized %llu\n", (unsigned long long)nsanitized);
+	dprintf(fd, "text.tx %llu\n", (unsigned long long)ntxmsg);
+	dprintf(fd, "xfer.tx.bytes %llu\n", (unsigned long long)txstats.bytes);
+	dprintf(fd, "xfer.tx.done %llu\n", (unsigned long long)txstats.done);
+	dprintf(fd, "xfer.tx.cancelled %llu\n", (unsigned long long)txstats.cancelled);
+	dprintf(fd, "xfer.tx.stalls %llu\n", (unsigned long long)txstats.stalls);
+	histdump(fd, "xfer.tx", &txstats.time);
+	dprintf(fd, "xfer.rx.bytes %llu\n", (unsigned long long)rxstats.bytes);
+	dprintf(fd, "xfer.rx.done %llu\n", (unsigned long long)rxstats.done);
+	dprintf(fd, "xfer.rx.cancelled %llu\n", (unsigned long long)rxstats.cancelled);
+	dprintf(fd, "xfer.rx.splices %llu\n", (unsigned long long)nrxsplices);
+	dprintf(fd, "xfer.rx.spliced_bytes %llu\n", (unsigned long long)nrxspliced);
+	histdump(fd, "xfer.rx", &rxstats.time);
+	dprintf(fd, "delta.sent %llu\n", (unsigned long long)deltasent);
+	dprintf(fd, "delta.received %llu\n", (unsigned long long)deltarecv);
+	dprintf(fd, "delta.failed %llu\n", (unsigned long long)deltafailed);
+	dprintf(fd, "delta.literal_bytes %llu\n", (unsigned long long)deltalitbytes);
+	dprintf(fd, "delta.copied_bytes %llu\n", (unsigned long long)deltacopybytes);
+	histdump(fd, "delta.rx", &deltah);
+	dprintf(fd, "sync.watches %zu\n", nsyncwatches);
+	dprintf(fd, "sync.pending %zu\n", nsyncpending);
+	dprintf(fd, "sync.queued %llu\n", (unsigned long long)nsyncqueued);
+	dprintf(fd, "sync.sent %llu\n", (unsigned long long)nsyncsent);
+	dprintf(fd, "sync.applied %llu\n", (unsigned long long)nsyncapplied);
+	dprintf(fd, "sync.conflicts %llu\n", (unsigned long long)nsyncconflicts);
+	histdump(fd, "sync", &synch);
+	TAILQ_FOREACH(s, &swarmhead, entry)
+		nswarms++;
+	dprintf(fd, "swarm.active %zu\n", nswarms);
+	dprintf(fd, "swarm.done %llu\n", (unsigned long long)nswarmdone);
+	dprintf(fd, "swarm.failed %llu\n", (unsigned long long)nswarmfailed);
+	dprintf(fd, "swarm.bytes %llu\n", (unsigned long long)nswarmbytes);
+	dprintf(fd, "swarm.stolen %llu\n", (unsigned long long)nstolen);
+	dprintf(fd, "swarm.served_bytes %llu\n", (unsigned long long)nserved);
+	for (i = 0; trace && i < LEN(traceh); i++)
+		histdump(fd, "trace", &traceh[i]);
+	for (i = 0; i < LEN(pathh); i++)
+		histdump(fd, "path", &pathh[i]);
+	dprintf(fd, "path.file_in.bytes %llu\n", (unsigned long long)fileinbytes);
+	close(fd);
+	if (rename("stats.tmp", "stats") < 0)
+		weprintf("rename %s:", "stats");
+}
+
+/* Rewrite the list of the TOPN friends using the most CPU time */
+static void
+topdump(void)
+{
+	struct friend *f, *top[TOPN];
+	size_t i, n = 0;
+	int    fd;
+
+	TAILQ_FOREACH(f, &friendhead, entry) {
+		if (n < TOPN)
+			n++;
+		else if (f->acct.cpu <= top[n - 1]->acct.cpu)
+			continue;
+		for (i = n - 1; i > 0 && top[i - 1]->acct.cpu < f->acct.cpu; i--)
+			top[i] = top[i - 1];
+		top[i] = f;
+	}
+
+	fd = open("top.tmp", O_WRONLY | O_TRUNC | O_CREAT, 0666);
+	if (fd < 0) {
+		weprintf("open %s:", "top.tmp");
+		return;
+	}
+	dprintf(fd, "# id cpu_ms callbacks bytes_in bytes_out saves name\n");
+	for (i = 0; i < n; i++) {
+		f = top[i];
+		dprintf(fd, "%s %llu %llu %llu %llu %llu %s\n", f->idstr,
+			(unsigned long long)f->acct.cpu / 1000000,
+			(unsigned long long)f->acct.ncb,
+			(unsigned long long)f->acct.bytesin,
+			(unsigned long long)f->acct.bytesout,
+			(unsigned long long)f->acct.saves, f->name);
+	}
+	close(fd);
+	if (rename("top.tmp", "top") < 0)
+		weprintf("rename %s:", "top");
+}
+
+static void
+printrat(void)
+{
+	printf(	"\033[31m"
+		"                /y\\            /y\\\n"
+		"               /ver\\          /"VERSION"\\\n"
+		"               yyyyyy\\      /yyyyyy\n"
+		"               \\yyyyyyyyyyyyyyyyyy/\n"
+		"                yyyyyyyyyyyyyyyyyy\n"
+		"                yyyyyyyyyyyyyyyyyy\n"
+		"                yyy'yyyyyyyyyy'yyy\n"
+		"                \\yy  yyyyyyyy  yy/\n"
+		"                 \\yy.yyyyyyyy.yy/\n"
+		"                  \\yyyyyyyyyyyy/\n"
+		"                    \\yyyyyyyy/\n"
+		"              -------yyyyyyyy-------\n"
+		"                 ..---yyyyyy---..\n"
+		"                   ..--yyyy--..\n"
+		"\033[0m\n");
+}
+
+static void
+logmsg(const char *fmt, ...)
+{
+	time_t  t;
+	va_list ap;
+	char    buft[64];
+
+	va_start(ap, fmt);
+	t = time(NULL);
+	strftime(buft, sizeof(buft), "%F %R", localtime(&t));
+	printf("%s ", buft);
+	vfprintf(stdout, fmt, ap);
+	va_end(ap);
+}
+
+static int
+fifoopen(int dirfd, struct file f)
+{
+	int fd;
+
+	fd = openat(dirfd, f.name, f.flags, 0666);
+	if (fd < 0 && errno != ENXIO)
+		eprintf("openat %s:", f.name);
+	return fd;
+}
+
+static void
+fiforeset(int dirfd, int *fd, struct file f)
+{
+	ssize_t r;
+
+	r = unlinkat(dirfd, f.name, 0);
+	if (r < 0 && errno != ENOENT)
+		eprintf("unlinkat %s:", f.name);
+	if (*fd != -1)
+		close(*fd);
+	r = mkfifoat(dirfd, f.name, 0666);
+	if (r < 0 && errno != EEXIST)
+		eprintf("mkfifoat %s:", f.name);
+	*fd = fifoopen(dirfd, f);
+}
+
+static ssize_t
+fiforead(int dirfd, int *fd, struct file f, void *buf, size_t sz)
+{
+	ssize_t r;
+
+again:
+	r = read(*fd, buf, sz);
+	if (r == 0) {
+		fiforeset(dirfd, fd, f);
+		return 0;
+	} else if (r < 0) {
+		if (errno == EINTR)
+			goto again;
+		if (errno == EWOULDBLOCK)
+			return -1;
+		eprintf("read %s:", f.name);
+	}
+	return r;
+}
+
+/*static uint32_t
+interval(Tox *m, ToxAv *av)
+{
+	return MIN(tox_do_interval(m), toxav_do_interval(av));
+}*/
+
+static uint32_t
+interval(Tox *m)
+{
+	return tox_iteration_interval(m);
+}
+
+/*static void
+cbcallinvite(void *av, int32_t cnum, void *udata)
+{
+	struct  friend *f;
+	ToxAvCSettings avconfig;
+	int32_t fnum, r;
+
+	fnum = toxav_get_peer_id(toxav, cnum, 0);
+	if (fnum < 0) {
+		weprintf("Failed to determine peer-id from call-id\n");
+		r = toxav_reject(toxav, cnum, NULL);
+		if (r < 0)
+			weprintf("Failed to reject call\n");
+		return;
+	}
+	TAILQ_FOREACH(f, &friendhead, entry)
+		if (f->num == fnum)
+			break;
+	if (!f)
+		return;
+
+	f->av.num = cnum;
+	r = toxav_get_peer_csettings(toxav, cnum, 0, &avconfig);
+	if (r < 0) {
+		weprintf("Failed to determine peer call type\n");
+		r = toxav_reject(toxav, f->av.num, NULL);
+		if (r < 0)
+			weprintf("Failed to reject call\n");
+		return;
+	}
+
+	logmsg(": %s : Audio : Rx > Inviting (%luHz/%luch)\n",
+	       f->name, avconfig.audio_sample_rate, avconfig.audio_channels);
+
+	ftruncate(f->fd[FCALL_STATE], 0);
+	lseek(f->fd[FCALL_STATE], 0, SEEK_SET);
+	dprintf(f->fd[FCALL_STATE], "pending\n");
+}
+
+static void
+cbcallstart(void *av, int32_t cnum, void *udata)
+{
+	struct friend *f;
+	int    r;
+
+	TAILQ_FOREACH(f, &friendhead, entry)
+		if (f->av.num == cnum)
+			break;
+	if (!f)
+		return;
 
 	f->av.frame = malloc(sizeof(int16_t) * framesize);
 	if (!f->av.frame)
@@ -691,76 +1822,425 @@ sendfriendcalldata(struct friend *f)
 		weprintf("Failed to send audio frame\n");
 }
 */
+/* Append a callback invocation to the event record */
 static void
-cbconnstatus(Tox *m, uint32_t frnum,  enum TOX_CONNECTION status,  void *udata)
+record(int type, uint32_t frnum, uint32_t a, uint32_t b, uint64_t c,
+       const uint8_t *data, size_t len)
 {
-	struct friend *f;
-	struct request *req, *rtmp;
-	int    r;
-	char   name[TOX_MAX_NAME_LENGTH + 1];
-	r = tox_friend_get_name_size(tox, frnum, NULL); //(uint8_t *)name);
-	if (r < 0) {
-		weprintf("Failed to get name for friend number %ld\n", (long)frnum);
-		weprintf("Failed to get name for friend number %ld\n", r);
-		return;
-	} else if (r == 0) {
-		snprintf(name, sizeof(name), "Anonymous");
-	} else {
-		name[r] = '\0';
-	}
-
-	switch(status){
-		case TOX_CONNECTION_NONE:
-			logmsg(": %s > %s\n", name, "Offline" );
-		case TOX_CONNECTION_TCP:
-			logmsg(": %s > %s\n", name, "Online using TCP" );
-		case TOX_CONNECTION_UDP:
-			logmsg(": %s > %s\n", name, "Online using UDP" );
-	}	   
-
-	TAILQ_FOREACH(f, &friendhead, entry) {
-		if (f->num == frnum) {
-			ftruncate(f->fd[FONLINE], 0);
-			lseek(f->fd[FONLINE], 0, SEEK_SET);
-			dprintf(f->fd[FONLINE], "%d\n", status);
-			break;
-		}
-	}
+	uint8_t hdr[EVHDRSZ];
+
+	pack64(&hdr[0], monons() - recstart);
+	hdr[8] = type;
+	pack32(&hdr[9], frnum);
+	pack32(&hdr[13], a);
+	pack32(&hdr[17], b);
+	pack64(&hdr[21], c);
+	pack32(&hdr[29], len);
+	if (fwrite(hdr, 1, sizeof(hdr), recfp) != sizeof(hdr) ||
+	    (len && fwrite(data, 1, len, recfp) != len))
+		eprintf("fwrite %s:", recfile);
+}
 
-	/* Remove the pending request-FIFO if it exists */
-	for (req = TAILQ_FIRST(&reqhead); req; req = rtmp) {
-		rtmp = TAILQ_NEXT(req, entry);
+static int
+replayread(struct event *ev)
+{
+	uint8_t hdr[EVHDRSZ];
 
-		if (memcmp(f->id, req->id, TOX_CLIENT_ID_SIZE))
-			continue;
-		unlinkat(gslots[REQUEST].fd[OUT], req->idstr, 0);
-		close(req->fd);
-		TAILQ_REMOVE(&reqhead, req, entry);
-		free(req->msg);
-		free(req);
-	}
+	if (fread(hdr, 1, sizeof(hdr), replayfp) != sizeof(hdr))
+		return -1;
+	ev->t = unpack64(&hdr[0]);
+	ev->type = hdr[8];
+	ev->frnum = unpack32(&hdr[9]);
+	ev->a = unpack32(&hdr[13]);
+	ev->b = unpack32(&hdr[17]);
+	ev->c = unpack64(&hdr[21]);
+	ev->len = unpack32(&hdr[29]);
+	tfree(ev->data);
+	ev->data = tmalloc(MREPLAY, ev->len + 1);
+	if (ev->len && fread(ev->data, 1, ev->len, replayfp) != ev->len)
+		return -1;
+	return 0;
 }
 
 static void
-cbfriendmessage(Tox *m, uint32_t frnum,  enum TOX_MESSAGE_TYPE type,  const uint8_t * data, size_t len,  void *udata)
+replaydispatch(struct event *ev)
 {
-	struct  friend *f;
-	time_t  t;
-	uint8_t msg[len + 1];
-	char    buft[64];
-
-	memcpy(msg, data, len);
-	msg[len] = '\0';
-
-	TAILQ_FOREACH(f, &friendhead, entry) {
-		if (f->num == frnum) {
-			t = time(NULL);
-			strftime(buft, sizeof(buft), "%F %R", localtime(&t));
-			dprintf(f->fd[FTEXT_OUT], "%s %s\n", buft, msg);
-			logmsg(": %s > %s\n", f->name, msg);
+	switch (ev->type) {
+	case EVCONNSTATUS:
+		cbconnstatus(tox, ev->frnum, ev->a, NULL);
+		break;
+	case EVMESSAGE:
+		cbfriendmessage(tox, ev->frnum, ev->a, ev->data, ev->len, NULL);
+		break;
+	case EVREQUEST:
+		if (ev->len < TOX_CLIENT_ID_SIZE)
 			break;
+		cbfriendrequest(tox, ev->data, ev->data + TOX_CLIENT_ID_SIZE,
+				ev->len - TOX_CLIENT_ID_SIZE, NULL);
+		break;
+	case EVNAME:
+		cbnamechange(tox, ev->frnum, ev->data, ev->len, NULL);
+		break;
+	case EVSTATUSMSG:
+		cbstatusmessage(tox, ev->frnum, ev->data, ev->len, NULL);
+		break;
+	case EVUSERSTATE:
+		cbuserstate(tox, ev->frnum, ev->a, NULL);
+		break;
+	case EVFILECONTROL:
+		cbfilecontrol(tox, ev->frnum, ev->a, ev->b, NULL);
+		break;
+	case EVFILESENDREQ:
+		cbfilesendreq(tox, ev->frnum, ev->a, ev->c, ev->b, NULL);
+		break;
+	case EVFILEDATA:
+		cbfiledata(tox, ev->frnum, ev->a, ev->b, ev->c, ev->data, ev->len, NULL);
+		break;
+	case EVLOSSLESS:
+		if (ev->len > 0)
+			cblosslesspacket(tox, ev->frnum, ev->data, ev->len, NULL);
+		break;
+	case EVSELFCONN:
+		cbselfconnstatus(tox, ev->a, NULL);
+		break;
+	case EVLOSSY:
+		if (ev->len > 0)
+			cblossypacket(tox, ev->frnum, ev->data, ev->len, NULL);
+		break;
+	default:
+		weprintf("Replay : Unknown event type %d\n", ev->type);
+		break;
+	}
+}
+
+/* Dispatch the recorded events that are due and return the time in ms
+ * until the next one, or -1 once the record is exhausted.  In fast mode
+ * events are dispatched back to back in batches of REPLAYBATCH. */
+static int
+replaystep(void)
+{
+	uint64_t now;
+	int      n;
+
+	for (n = 0; ; n++) {
+		if (!replaypending) {
+			if (replayread(&replayev) < 0) {
+				logmsg("Replay > Done, %llu events in %.3fs\n",
+				       (unsigned long long)nreplayed,
+				       (monons() - recstart) / 1E9);
+				return -1;
+			}
+			replaypending = 1;
+		}
+		if (replayfast) {
+			if (n == REPLAYBATCH)
+				return 0;
+		} else {
+			now = monons() - recstart;
+			if (replayev.t > now)
+				return MIN((replayev.t - now) / 1000000, interval(tox));
+		}
+		replaydispatch(&replayev);
+		replaypending = 0;
+		nreplayed++;
+	}
+}
+
+static void
+cbselfconnstatus(Tox *m, enum TOX_CONNECTION status, void *udata)
+{
+	if (recfp)
+		record(EVSELFCONN, 0, status, 0, 0, NULL, 0);
+	if ((status != TOX_CONNECTION_NONE) != (selfconn != TOX_CONNECTION_NONE)) {
+		selfsince = time(NULL);
+		nselfchanges++;
+	}
+	selfconn = status;
+}
+
+/* Only act on changes of the DHT connection once they have lasted, and
+ * keep bootstrapping while it is down.  Transfers are left alone, they
+ * are cancelled per friend when the friend goes offline. */
+static void
+selfconnstep(time_t now)
+{
+	if (selfconn != TOX_CONNECTION_NONE) {
+		if (!connected && now >= selfsince + SELFUPDELAY) {
+			logmsg("DHT > Connected\n");
+			connected = 1;
 		}
+		return;
+	}
+	if (connected && now >= selfsince + SELFDOWNDELAY) {
+		logmsg("DHT > Disconnected\n");
+		connected = 0;
+	}
+	if (!replayfp && now > bootat + CONNECTDELAY) {
+		bootat = now;
+		logmsg("DHT > Connecting\n");
+		toxconnect();
+	}
+}
+
+static void
+cbconnstatus(Tox *m, uint32_t frnum,  enum TOX_CONNECTION status,  void *udata)
+{
+	struct friend *f;
+	struct request *req, *rtmp;
+	uint64_t t0 = cpuns();
+
+	if (recfp)
+		record(EVCONNSTATUS, frnum, status, 0, 0, NULL, 0);
+
+	f = friendlookup(frnum, status != TOX_CONNECTION_NONE);
+	if (!f)
+		return;
+	if (status == TOX_CONNECTION_NONE && f->conn != TOX_CONNECTION_NONE) {
+		/* toxcore forgets the friend's file numbers right away */
+		f->offsince = time(NULL);
+		f->conn = status;
+		canceltxtransfer(f);
+		cancelrxtransfer(f);
+	} else if (status != TOX_CONNECTION_NONE && f->conn == TOX_CONNECTION_NONE &&
+		   f->link != TOX_CONNECTION_NONE) {
+		/* Back before the outage was acted upon */
+		f->flaps++;
+		nflaps++;
+	}
+	if (status != TOX_CONNECTION_NONE && f->conn == TOX_CONNECTION_NONE)
+		memset(&f->trace, 0, sizeof(f->trace));
+	if (status != TOX_CONNECTION_NONE && f->idle)
+		friendwake(f);
+	f->conn = status;
+	friendlink(f, time(NULL));
+	if (f->link != TOX_CONNECTION_NONE)
+		queuepass();
+
+	/* Remove the pending request-FIFO if it exists */
+	for (req = TAILQ_FIRST(&reqhead); req; req = rtmp) {
+		rtmp = TAILQ_NEXT(req, entry);
+
+		if (memcmp(f->id, req->id, TOX_CLIENT_ID_SIZE))
+			continue;
+		unlinkat(gslots[REQUEST].fd[OUT], req->idstr, 0);
+		close(req->fd);
+		TAILQ_REMOVE(&reqhead, req, entry);
+		tfree(req->msg);
+		tfree(req);
+	}
+	f->acct.ncb++;
+	charge(f, t0);
+}
+
+/* Going online is acted upon at once, going offline only once it has
+ * lasted FLAPDELAY seconds, so that flapping peers don't keep rewriting
+ * the online file */
+static void
+friendlink(struct friend *f, time_t now)
+{
+	if (f->conn == TOX_CONNECTION_NONE) {
+		if (f->link == TOX_CONNECTION_NONE || now < f->offsince + FLAPDELAY)
+			return;
+		logmsg(": %s > Offline\n", f->name);
+		f->link = TOX_CONNECTION_NONE;
+	} else {
+		if (f->link == f->conn)
+			return;
+		if (f->link == TOX_CONNECTION_NONE)
+			logmsg(": %s > Online using %s\n", f->name,
+			       f->conn == TOX_CONNECTION_UDP ? "UDP" : "TCP");
+		f->link = f->conn;
+	}
+	ffilewrite(f, FONLINE, "%d\n", f->link);
+	linkevent(f, f->link);
+}
+
+static void
+cbfriendmessage(Tox *m, uint32_t frnum,  enum TOX_MESSAGE_TYPE type,  const uint8_t * data, size_t len,  void *udata)
+{
+	struct   friend *f;
+	time_t   t;
+	uint64_t rx, t0 = cpuns();
+	char     msg[UTF8CLEANSZ(TOX_MAX_MESSAGE_LENGTH)];
+	char     buft[64];
+
+	if (recfp)
+		record(EVMESSAGE, frnum, type, 0, 0, data, len);
+	rx = trace ? realns() : 0;
+	/* One line per message in text_out */
+	if (utf8clean(msg, data, MIN(len, TOX_MAX_MESSAGE_LENGTH)) != len)
+		nsanitized++;
+
+	f = friendlookup(frnum, 1);
+	if (!f)
+		return;
+	t = time(NULL);
+	strftime(buft, sizeof(buft), "%F %R", localtime(&t));
+	ffilewrite(f, FTEXT_OUT, "%s %s\n", buft, msg);
+	nrxmsg++;
+	f->trace.nrx++;
+	f->trace.rx = rx;
+	f->trace.done = trace ? realns() : 0;
+	logmsg(": %s > %s\n", f->name, msg);
+	f->acct.ncb++;
+	f->acct.bytesin += len;
+	charge(f, t0);
+}
+
+static void
+cblosslesspacket(Tox *m, uint32_t frnum, const uint8_t *data, size_t len, void *udata)
+{
+	struct friend *f;
+	uint64_t t0 = cpuns();
+
+	if (recfp)
+		record(EVLOSSLESS, frnum, 0, 0, 0, data, len);
+	TAILQ_FOREACH(f, &friendhead, entry)
+		if (f->num == frnum)
+			break;
+	if (!f)
+		return;
+	f->acct.ncb++;
+	f->acct.bytesin += len;
+
+	switch (data[0]) {
+	case PKT_TRACE:
+		/* Lossless packets share the message channel, so the
+		 * stamp arrives right after the message it belongs to,
+		 * unless that one got lost or was not traced here */
+		if (!trace || len != 1 + 4 + 3 * 8 ||
+		    unpack32(&data[1]) != f->trace.nrx || !f->trace.rx)
+			break;
+		histadd(&traceh[HNET], f->trace.rx - unpack64(&data[21]));
+		histadd(&traceh[HDISPATCH], f->trace.done - f->trace.rx);
+		histadd(&traceh[HTOTAL], f->trace.done - unpack64(&data[5]));
+		f->trace.rx = 0;
+		break;
+	case PKT_DOFFER: case PKT_DACCEPT: case PKT_DSIG: case PKT_DLIT:
+	case PKT_DCOPY: case PKT_DEND: case PKT_DDONE: case PKT_DCANCEL:
+		deltapacket(f, data, len);
+		break;
+	case PKT_SQUERY: case PKT_SHAVE: case PKT_SNONE: case PKT_SGET:
+	case PKT_SDATA: case PKT_SCANCEL: case PKT_SDONE:
+		swarmpacket(f, data, len);
+		break;
+	default:
+		break;
 	}
+	charge(f, t0);
+}
+
+static void
+cblossypacket(Tox *m, uint32_t frnum, const uint8_t *data, size_t len, void *udata)
+{
+	struct friend *f;
+	uint64_t t0 = cpuns(), rtt;
+	uint8_t  pkt[1 + 4 + 8];
+
+	if (recfp)
+		record(EVLOSSY, frnum, 0, 0, 0, data, len);
+	TAILQ_FOREACH(f, &friendhead, entry)
+		if (f->num == frnum)
+			break;
+	if (!f)
+		return;
+	f->acct.ncb++;
+	f->acct.bytesin += len;
+
+	switch (data[0]) {
+	case PKT_PING:
+		/* Echo it back as is, the stamp is the sender's */
+		if (len != sizeof(pkt))
+			break;
+		memcpy(pkt, data, len);
+		pkt[0] = PKT_PONG;
+		if (tox_friend_send_lossy_packet(tox, f->num, pkt, sizeof(pkt), NULL))
+			f->acct.bytesout += sizeof(pkt);
+		break;
+	case PKT_PONG:
+		/* Late answers count as lost */
+		if (len != sizeof(pkt) || !f->lnk.waiting ||
+		    unpack32(&data[1]) != f->lnk.seq)
+			break;
+		rtt = monons() - unpack64(&data[5]);
+		f->lnk.waiting = 0;
+		f->lnk.pongs++;
+		f->lnk.rtt = rtt;
+		f->lnk.srtt = f->lnk.srtt ? (7 * f->lnk.srtt + rtt) / 8 : rtt;
+		f->lnk.dirty = 1;
+		histadd(&rtth, rtt);
+		npongs++;
+		break;
+	default:
+		break;
+	}
+	charge(f, t0);
+}
+
+static void
+sendping(struct friend *f)
+{
+	uint8_t pkt[1 + 4 + 8];
+
+	pkt[0] = PKT_PING;
+	pack32(&pkt[1], ++f->lnk.seq);
+	pack64(&pkt[5], monons());
+	if (!tox_friend_send_lossy_packet(tox, f->num, pkt, sizeof(pkt), NULL))
+		return;
+	f->acct.bytesout += sizeof(pkt);
+	f->lnk.pingat = monons();
+	f->lnk.waiting = 1;
+	f->lnk.pings++;
+	f->lnk.dirty = 1;
+	npings++;
+}
+
+/* Remember a transport change in the friend's history */
+static void
+linkevent(struct friend *f, int conn)
+{
+	size_t i = f->lnk.nhist++ % LINKHIST;
+
+	f->lnk.hist[i].t = time(NULL);
+	f->lnk.hist[i].conn = conn;
+	f->lnk.dirty = 1;
+}
+
+static void
+linkdump(struct friend *f)
+{
+	static const char *conns[] = {
+		[TOX_CONNECTION_NONE] = "none",
+		[TOX_CONNECTION_TCP]  = "tcp",
+		[TOX_CONNECTION_UDP]  = "udp",
+	};
+	uint64_t due;
+	size_t   i;
+	int      fd;
+
+	fd = ffileget(f, FLINK);
+	if (fd < 0)
+		return;
+	ftruncate(fd, 0);
+	lseek(fd, 0, SEEK_SET);
+	/* The last ping is not lost until its answer is overdue */
+	due = f->lnk.pings - (f->lnk.waiting &&
+			      monons() - f->lnk.pingat < PINGDELAY * 1000000000ULL);
+	dprintf(fd, "transport %s\n", conns[f->link]);
+	dprintf(fd, "rtt_ms %.1f\n", f->lnk.rtt / 1E6);
+	dprintf(fd, "srtt_ms %.1f\n", f->lnk.srtt / 1E6);
+	dprintf(fd, "pings %llu\n", (unsigned long long)f->lnk.pings);
+	dprintf(fd, "pongs %llu\n", (unsigned long long)f->lnk.pongs);
+	dprintf(fd, "loss %.3f\n", due ? 1 - (double)f->lnk.pongs / due : 0.0);
+	dprintf(fd, "flaps %llu\n", (unsigned long long)f->flaps);
+	dprintf(fd, "tx_goodput_kibps %.1f\n", f->lnk.txrate / 1024);
+	dprintf(fd, "rx_goodput_kibps %.1f\n", f->lnk.rxrate / 1024);
+	i = f->lnk.nhist > LINKHIST ? f->lnk.nhist - LINKHIST : 0;
+	for (; i < f->lnk.nhist; i++)
+		dprintf(fd, "history %lu %s\n",
+			(unsigned long)f->lnk.hist[i % LINKHIST].t,
+			conns[f->lnk.hist[i % LINKHIST].conn]);
+	f->lnk.dirty = 0;
 }
 
 static void
@@ -768,19 +2248,32 @@ cbfriendrequest(Tox *tox, const uint8_t *id, const uint8_t *data, size_t len, vo
 {
 	struct file reqfifo;
 	struct request *req;
+	uint64_t t0 = monons();
+	uint8_t ev[TOX_CLIENT_ID_SIZE + len];
 
-	req = calloc(1, sizeof(*req));
-	if (!req)
-		eprintf("calloc:");
-	req->fd = -1;
+	if (recfp) {
+		memcpy(ev, id, TOX_CLIENT_ID_SIZE);
+		memcpy(ev + TOX_CLIENT_ID_SIZE, data, len);
+		record(EVREQUEST, 0, 0, 0, 0, ev, sizeof(ev));
+	}
 
-	memcpy(req->id, id, TOX_CLIENT_ID_SIZE);
-	id2str(req->id, req->idstr);
+	/* A repeated request only updates the message */
+	TAILQ_FOREACH(req, &reqhead, entry)
+		if (!memcmp(req->id, id, TOX_CLIENT_ID_SIZE))
+			break;
+	if (req) {
+		tfree(req->msg);
+		req->msg = NULL;
+		TAILQ_REMOVE(&reqhead, req, entry);
+	} else {
+		req = tcalloc(MREQUEST, 1, sizeof(*req));
+		req->fd = -1;
+		memcpy(req->id, id, TOX_CLIENT_ID_SIZE);
+		id2str(req->id, req->idstr);
+	}
 
 	if (len > 0) {
-		req->msg = malloc(len + 1);
-		if (!req->msg)
-			eprintf("malloc:");
+		req->msg = tmalloc(MREQUEST, len + 1);
 		memcpy(req->msg, data, len);
 		req->msg[len] = '\0';
 	}
@@ -793,85 +2286,111 @@ cbfriendrequest(Tox *tox, const uint8_t *id, const uint8_t *data, size_t len, vo
 
 	logmsg("Request : %s > %s\n",
 	       req->idstr, req->msg);
+	histadd(&pathh[HREQRECV], monons() - t0);
 }
 
 static void
 cbnamechange(Tox *m, uint32_t frnum,  const uint8_t *data, size_t len,  void *udata)
 {
 	struct  friend *f;
-	uint8_t name[len + 1];
-
-	memcpy(name, data, len);
-	name[len] = '\0';
-
-	TAILQ_FOREACH(f, &friendhead, entry) {
-		if (f->num == frnum) {
-			if (memcmp(f->name, name, len + 1) == 0)
-				break;
-			ftruncate(f->fd[FNAME], 0);
-			lseek(f->fd[FNAME], 0, SEEK_SET);
-			dprintf(f->fd[FNAME], "%s\n", name);
-			logmsg(": %s : Name > %s\n", f->name, name);
-			memcpy(f->name, name, len + 1);
-			break;
-		}
+	char    name[sizeof(f->name)];
+	uint64_t t0 = cpuns();
+
+	if (recfp)
+		record(EVNAME, frnum, 0, 0, 0, data, len);
+	if (utf8clean(name, data, MIN(len, TOX_MAX_NAME_LENGTH)) != len)
+		nsanitized++;
+
+	f = friendlookup(frnum, 0);
+	if (f && strcmp(f->name, name) != 0) {
+		ffilewrite(f, FNAME, "%s\n", name);
+		logmsg(": %s : Name > %s\n", f->name, name);
+		memcpy(f->name, name, sizeof(name));
 	}
 	datasave();
+	if (f) {
+		f->acct.ncb++;
+		f->acct.bytesin += len;
+		f->acct.saves++;
+		charge(f, t0);
+	}
 }
 
 static void
 cbstatusmessage(Tox *m, uint32_t frnum,  const uint8_t *data, size_t len,  void *udata)
 {
 	struct friend *f;
-	uint8_t status[len + 1];
-
-	memcpy(status, data, len);
-	status[len] = '\0';
-
-	TAILQ_FOREACH(f, &friendhead, entry) {
-		if (f->num == frnum) {
-			ftruncate(f->fd[FSTATUS], 0);
-			lseek(f->fd[FSTATUS], 0, SEEK_SET);
-			dprintf(f->fd[FSTATUS], "%s\n", status);
-			logmsg(": %s : Status > %s\n", f->name, status);
-			break;
-		}
+	char    status[UTF8CLEANSZ(TOX_MAX_STATUS_MESSAGE_LENGTH)];
+	uint64_t t0 = cpuns();
+
+	if (recfp)
+		record(EVSTATUSMSG, frnum, 0, 0, 0, data, len);
+	if (utf8clean(status, data, MIN(len, TOX_MAX_STATUS_MESSAGE_LENGTH)) != len)
+		nsanitized++;
+
+	f = friendlookup(frnum, 0);
+	if (f) {
+		ffilewrite(f, FSTATUS, "%s\n", status);
+		logmsg(": %s : Status > %s\n", f->name, status);
 	}
 	datasave();
+	if (f) {
+		f->acct.ncb++;
+		f->acct.bytesin += len;
+		f->acct.saves++;
+		charge(f, t0);
+	}
 }
 
 static void
 cbuserstate(Tox *m, uint32_t frnum,  enum TOX_USER_STATUS state,  void *udata)
 {
 	struct friend *f;
+	uint64_t t0 = cpuns();
 
+	if (recfp)
+		record(EVUSERSTATE, frnum, state, 0, 0, NULL, 0);
 	if (state >= LEN(ustate)) {
 		weprintf("Received invalid user status: %d\n", state);
 		return;
 	}
 
-	TAILQ_FOREACH(f, &friendhead, entry) {
-		if (f->num == frnum) {
-			ftruncate(f->fd[FSTATE], 0);
-			lseek(f->fd[FSTATE], 0, SEEK_SET);
-			dprintf(f->fd[FSTATE], "%s\n", ustate[state]);
-			logmsg(": %s : State > %s\n", f->name, ustate[state]);
-			break;
-		}
+	f = friendlookup(frnum, 0);
+	if (f) {
+		ffilewrite(f, FSTATE, "%s\n", ustate[state]);
+		logmsg(": %s : State > %s\n", f->name, ustate[state]);
 	}
 	datasave();
+	if (f) {
+		f->acct.ncb++;
+		f->acct.saves++;
+		charge(f, t0);
+	}
 }
 
 static void
 cbfilecontrol(Tox *m, uint32_t frnum,  uint32_t fnum,  enum TOX_FILE_CONTROL ctrltype,  void *udata)
 {
 	struct friend *f;
-	int rec_sen = (fnum == 0 && ctrltype == TOX_FILE_CONTROL_RESUME) ? 1 : 0;
+	/* Our outgoing files are numbered below 1 << 16, incoming ones
+	 * from there on */
+	int rec_sen = fnum < (1 << 16);
+	uint64_t t0 = cpuns();
+
+	if (recfp)
+		record(EVFILECONTROL, frnum, fnum, ctrltype, 0, NULL, 0);
 	TAILQ_FOREACH(f, &friendhead, entry)
 		if (f->num == frnum)
 			break;
 	if (!f)
 		return;
+	f->acct.ncb++;
+	/* Late controls for a transfer that is already over */
+	if (rec_sen ? f->tx.state == TRANSFER_NONE || fnum != f->tx.fnum :
+		      f->rxstate == TRANSFER_NONE || fnum != f->rxfnum) {
+		charge(f, t0);
+		return;
+	}
 
 	switch (ctrltype) {
 	case TOX_FILE_CONTROL_RESUME:
@@ -882,11 +2401,14 @@ cbfilecontrol(Tox *m, uint32_t frnum,  uint32_t fnum,  enum TOX_FILE_CONTROL ctr
 			} else {
 				f->tx.fnum = fnum;
 				f->tx.chunksz = tox_file_data_size(tox, fnum);
-				f->tx.buf = malloc(f->tx.chunksz);
-				if (!f->tx.buf)
-					eprintf("malloc:");
+				if (TXCHUNKSZ > 0 && TXCHUNKSZ < f->tx.chunksz)
+					f->tx.chunksz = TXCHUNKSZ;
+				f->tx.buf = tmalloc(MXFER, f->tx.chunksz);
 				f->tx.n = 0;
 				f->tx.pendingbuf = 0;
+				f->tx.eof = 0;
+				f->tx.start = monons();
+				f->tx.bytes = 0;
 				f->tx.state = TRANSFER_INPROGRESS;
 				logmsg(": %s : Tx > In Progress\n", f->name);
 			}
@@ -903,22 +2425,32 @@ cbfilecontrol(Tox *m, uint32_t frnum,  uint32_t fnum,  enum TOX_FILE_CONTROL ctr
 	case TOX_FILE_CONTROL_CANCEL:
 		if (rec_sen == 1) {
 			logmsg(": %s : Tx > Rejected\n", f->name);
+			xferdone(f, &txstats, &f->tx.start, f->tx.bytes, 0);
 			f->tx.state = TRANSFER_NONE;
-			free(f->tx.buf);
+			queuedue = 1;
+			tfree(f->tx.buf);
 			f->tx.buf = NULL;
-			f->tx.lastblock.tv_sec = 0;
-			f->tx.lastblock.tv_nsec = 0;
 			f->tx.cooldown = 0;
-			fiforeset(f->dirfd, &f->fd[FFILE_IN], ffiles[FFILE_IN]);
+			if (f->qactive)
+				queuestop(f, 1);
+			else
+				fiforeset(f->dirfd, &f->fd[FFILE_IN], ffiles[FFILE_IN]);
 		} else {
+			/* This is how the sender signals completion */
 			logmsg(": %s : Rx > Cancelled by Sender\n", f->name);
-			cancelrxtransfer(f);
+			if (f->rxb.len > f->rxb.off)
+				rxflush(f, 1);
+			xferdone(f, &rxstats, &f->rxstart, f->rxbytes, 1);
+			rxclose(f);
 		}
 		break;
 	default:
 		weprintf("Unhandled file control type: %d\n", ctrltype);
 		break;
 	};
+	if (rec_sen)
+		crready(&f->co[CTX]);
+	charge(f, t0);
 }
 
 static void
@@ -926,12 +2458,16 @@ cbfilesendreq(Tox *m, uint32_t frnum,  uint32_t fnum,  uint64_t fsz,  size_t fle
 {
 	struct  friend *f;
 	uint8_t filename[flen + 1];
+	uint64_t t0 = cpuns();
 
+	if (recfp)
+		record(EVFILESENDREQ, frnum, fnum, flen, fsz, NULL, 0);
 	TAILQ_FOREACH(f, &friendhead, entry)
 		if (f->num == frnum)
 			break;
 	if (!f)
 		return;
+	f->acct.ncb++;
 
 	//memcpy(filename, fname, flen);
 	filename[flen] = '\0';
@@ -940,173 +2476,2522 @@ cbfilesendreq(Tox *m, uint32_t frnum,  uint32_t fnum,  uint64_t fsz,  size_t fle
 	if (f->rxstate == TRANSFER_INPROGRESS) {
 		logmsg(": %s : Rx > Rejected %s, already one in progress\n",
 		       f->name, filename);
-		if (tox_file_control(tox, f->num, fnum, TOX_FILE_CONTROL_CANCEL, NULL) < 0)
+		if (!tox_file_control(tox, f->num, fnum, TOX_FILE_CONTROL_CANCEL, NULL))
 			weprintf("Failed to kill new Rx transfer\n");
+		charge(f, t0);
+		return;
+	}
+
+	ffilewrite(f, FFILE_STATE, "%s\n", filename);
+	f->rxfnum = fnum;
+	f->rxstate = TRANSFER_PENDING;
+	crready(&f->co[CRX]);
+	logmsg(": %s : Rx > Pending %s\n", f->name, filename);
+	charge(f, t0);
+}
+
+static void
+cbfiledata(Tox *m, uint32_t frnum,  uint32_t fnum,  uint32_t fileid,  uint64_t fsz, 
+				const uint8_t *data, size_t len,  void *udata)
+{
+	struct   friend *f;
+	ssize_t  n;
+	size_t   wrote = 0;
+	uint64_t t0 = cpuns();
+
+	if (recfp)
+		record(EVFILEDATA, frnum, fnum, fileid, fsz, data, len);
+	TAILQ_FOREACH(f, &friendhead, entry)
+		if (f->num == frnum)
+			break;
+	if (!f)
+		return;
+
+#ifdef __linux__
+	/* Gather the chunk and hand over full buffers, partial ones are
+	 * flushed by the rx coroutine once toxcore is done for this
+	 * iteration */
+	while (rxsplice && len > 0) {
+		if (!f->rxb.base)
+			f->rxb.base = rxbufget();
+		n = MIN(len, RXBUFSZ - f->rxb.len);
+		memcpy(f->rxb.base + f->rxb.len, &data[wrote], n);
+		f->rxb.len += n;
+		wrote += n;
+		len -= n;
+		if (f->rxb.len == RXBUFSZ && rxflush(f, 1) < 0) {
+			cancelrxtransfer(f);
+			charge(f, t0);
+			return;
+		}
+	}
+	if (f->rxb.len > f->rxb.off)
+		crready(&f->co[CRX]);
+#endif
+	while (len > 0) {
+		n = write(f->fd[FFILE_OUT], &data[wrote], len);
+		if (n < 0) {
+			if (errno == EPIPE) {
+				cancelrxtransfer(f);
+				break;
+			} else if (errno == EWOULDBLOCK) {
+				continue;
+			}
+			break;
+		} else if (n == 0) {
+			break;
+		}
+		wrote += n;
+		len -= n;
+	}
+	f->rxbytes += wrote;
+	rxstats.bytes += wrote;
+	f->acct.ncb++;
+	f->acct.bytesin += wrote;
+	charge(f, t0);
+}
+
+/* Account a finished transfer that started at `*start', if any */
+static void
+xferdone(struct friend *f, struct xferstats *x, uint64_t *start, uint64_t bytes, int done)
+{
+	double secs;
+
+	if (!*start)
+		return;
+	secs = (monons() - *start) / 1E9;
+	if (done) {
+		x->done++;
+		histadd(&x->time, monons() - *start);
+		if (secs > 0) {
+			if (x == &txstats)
+				f->lnk.txrate = bytes / secs;
+			else
+				f->lnk.rxrate = bytes / secs;
+			f->lnk.dirty = 1;
+		}
+		logmsg(": %s : %s > Complete, %llu bytes in %.1fs (%.1f KiB/s)\n",
+		       f->name, x == &txstats ? "Tx" : "Rx", (unsigned long long)bytes,
+		       secs, secs > 0 ? bytes / secs / 1024 : 0.0);
+	} else {
+		x->cancelled++;
+	}
+	*start = 0;
+}
+
+static void
+canceltxtransfer(struct friend *f)
+{
+	if (f->tx.state == TRANSFER_NONE)
 		return;
+	logmsg(": %s : Tx > Cancelling\n", f->name);
+	xferdone(f, &txstats, &f->tx.start, f->tx.bytes, 0);
+	/* An offline friend's transfers are gone already */
+	if (f->conn != TOX_CONNECTION_NONE &&
+	    !tox_file_control(tox, f->num, f->tx.fnum, TOX_FILE_CONTROL_CANCEL, NULL))
+		weprintf("Failed to kill Tx transfer\n");
+	f->tx.state = TRANSFER_NONE;
+	queuedue = 1;
+	tfree(f->tx.buf);
+	f->tx.buf = NULL;
+	f->tx.cooldown = 0;
+	crready(&f->co[CTX]);
+	/* Queued files are retried once the friend is back */
+	if (f->qactive)
+		queuestop(f, 0);
+	else
+		fiforeset(f->dirfd, &f->fd[FFILE_IN], ffiles[FFILE_IN]);
+}
+
+static uint8_t *
+rxbufget(void)
+{
+#ifdef __linux__
+	void *p;
+
+	if (nrxpool > 0)
+		return rxpool[--nrxpool];
+	p = mmap(NULL, RXBUFSZ, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		eprintf("mmap:");
+	return p;
+#else
+	return NULL;
+#endif
+}
+
+static void
+rxbufdrop(struct friend *f)
+{
+#ifdef __linux__
+	if (f->rxb.base)
+		munmap(f->rxb.base, RXBUFSZ);
+#endif
+	memset(&f->rxb, 0, sizeof(f->rxb));
+}
+
+/* Hand the gathered data to file_out, waiting for room with `wait' set.
+ * The pipe may still reference the pages afterwards, so the buffer is
+ * unmapped rather than reused.  Returns -1 when the reader is gone. */
+static int
+rxflush(struct friend *f, int wait)
+{
+#ifdef __linux__
+	struct iovec  iov;
+	struct pollfd pfd;
+	ssize_t n;
+	int     flags;
+
+	while (f->rxb.off < f->rxb.len) {
+		iov.iov_base = f->rxb.base + f->rxb.off;
+		iov.iov_len = f->rxb.len - f->rxb.off;
+		/* Only a whole buffer can be gifted, a partial one will
+		 * have more data appended behind the pipe's back */
+		flags = SPLICE_F_NONBLOCK;
+		if (f->rxb.off == 0 && f->rxb.len == RXBUFSZ)
+			flags |= SPLICE_F_GIFT;
+		n = vmsplice(f->fd[FFILE_OUT], &iov, 1, flags);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EPIPE)
+				return -1;
+			if (errno != EAGAIN) {
+				weprintf("vmsplice:");
+				return -1;
+			}
+			if (!wait)
+				return 0;
+			pfd.fd = f->fd[FFILE_OUT];
+			pfd.events = POLLOUT;
+			poll(&pfd, 1, -1);
+			continue;
+		}
+		f->rxb.off += n;
+		nrxsplices++;
+		nrxspliced += n;
+	}
+	rxbufdrop(f);
+#endif
+	return 0;
+}
+
+/* Map buffers ahead, outside of the callbacks */
+static void
+rxpoolfill(void)
+{
+#ifdef __linux__
+	void *p;
+
+	while (nrxpool < RXPOOL) {
+		p = mmap(NULL, RXBUFSZ, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			break;
+		rxpool[nrxpool++] = p;
+	}
+#endif
+}
+
+/* Tear down the receiving end of a transfer that is over */
+static void
+rxclose(struct friend *f)
+{
+	rxbufdrop(f);
+	if (f->fd[FFILE_OUT] != -1) {
+		close(f->fd[FFILE_OUT]);
+		f->fd[FFILE_OUT] = -1;
+	}
+	ffilewrite(f, FFILE_STATE, NULL);
+	f->rxstate = TRANSFER_NONE;
+	crready(&f->co[CRX]);
+}
+
+static void
+cancelrxtransfer(struct friend *f)
+{
+	if (f->rxstate == TRANSFER_NONE)
+		return;
+	logmsg(": %s : Rx > Cancelling\n", f->name);
+	xferdone(f, &rxstats, &f->rxstart, f->rxbytes, 0);
+	if (f->conn != TOX_CONNECTION_NONE &&
+	    !tox_file_control(tox, f->num, f->rxfnum, TOX_FILE_CONTROL_CANCEL, NULL))
+		weprintf("Failed to kill Rx transfer\n");
+	rxclose(f);
+}
+
+static void
+sendfriendfile(struct friend *f)
+{
+	struct  timespec start, now, diff = {0, 0};
+	ssize_t n;
+	uint64_t t0 = cpuns(), t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (diff.tv_sec == 0 && diff.tv_nsec < interval(tox) * TXBUDGET * 1E4) {
+		/* Attempt to transmit the pending buffer */
+		if (f->tx.pendingbuf) {
+			if (tox_file_send(tox,
+					f->num,
+					0,
+					UINT64_MAX,
+					NULL,
+					f->tx.buf,
+					f->tx.n,
+					NULL) == UINT32_MAX) {
+				f->tx.cooldown = 1;
+				txstats.stalls++;
+				break;
+			}
+			f->tx.pendingbuf = 0;
+			f->tx.bytes += f->tx.n;
+			f->acct.bytesout += f->tx.n;
+			txstats.bytes += f->tx.n;
+		}
+		/* Signal transfer completion to other end, retried like a
+		 * chunk while the send queue is full */
+		if (f->tx.eof) {
+			if (!tox_file_control(tox, f->num, f->tx.fnum,
+					      TOX_FILE_CONTROL_CANCEL, NULL)) {
+				f->tx.cooldown = 1;
+				txstats.stalls++;
+				break;
+			}
+			xferdone(f, &txstats, &f->tx.start, f->tx.bytes, 1);
+			f->tx.state = TRANSFER_NONE;
+			queuedue = 1;
+			tfree(f->tx.buf);
+			f->tx.buf = NULL;
+			if (f->qactive)
+				queuestop(f, 1);
+			break;
+		}
+		/* Grab another buffer from the FIFO */
+		t1 = monons();
+		if (f->tx.src != -1)
+			n = read(f->tx.src, f->tx.buf, f->tx.chunksz);
+		else
+			n = fiforead(f->dirfd, &f->fd[FFILE_IN], ffiles[FFILE_IN],
+				     f->tx.buf, f->tx.chunksz);
+		if (n > 0) {
+			histadd(&pathh[HFILEIN], monons() - t1);
+			fileinbytes += n;
+		}
+		if (n == 0) {
+			f->tx.eof = 1;
+			continue;
+		}
+		if (n < 0) {
+			if (errno != EWOULDBLOCK && errno != EINTR)
+				weprintf("read:");
+			break;
+		}
+		/* Store transfer size in case we can't send it right now */
+		f->tx.n = n;
+		if (tox_file_send(tox,
+				f->num,
+				0,
+				UINT64_MAX,
+				NULL,
+				f->tx.buf,
+				f->tx.n,
+				NULL) == UINT32_MAX) {
+			f->tx.cooldown = 1;
+			f->tx.pendingbuf = 1;
+			txstats.stalls++;
+			break;
+		}
+		f->tx.bytes += n;
+		f->acct.bytesout += n;
+		txstats.bytes += n;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		diff = timediff(start, now);
+	}
+	charge(f, t0);
+}
+
+/* Insert by priority, after entries of the same priority */
+static void
+queueadd(struct friend *f, int prio, const char *path)
+{
+	struct qent *q, *e;
+
+	q = tcalloc(MQUEUE, 1, sizeof(*q));
+	q->prio = prio;
+	q->path = tstrdup(MQUEUE, path);
+	TAILQ_FOREACH(e, &f->queue, entry)
+		if (e->prio > prio && !(f->qactive && e == TAILQ_FIRST(&f->queue)))
+			break;
+	if (e)
+		TAILQ_INSERT_BEFORE(e, q, entry);
+	else
+		TAILQ_INSERT_TAIL(&f->queue, q, entry);
+	nqueued++;
+}
+
+/* Pick up the queue left over from the last run */
+static void
+queueload(struct friend *f)
+{
+	FILE   *fp;
+	char   *line = NULL, *p;
+	size_t  sz = 0;
+	ssize_t n;
+	int     fd, prio;
+
+	fd = openat(f->dirfd, ffiles[FQUEUE].name, O_RDONLY);
+	if (fd < 0)
+		return;
+	fp = fdopen(fd, "r");
+	if (!fp) {
+		close(fd);
+		return;
+	}
+	while ((n = getline(&line, &sz, fp)) > 0) {
+		if (line[n - 1] == '\n')
+			line[n - 1] = '\0';
+		prio = strtol(line, &p, 10);
+		if (p == line || *p != ' ')
+			continue;
+		queueadd(f, prio, p + 1);
+	}
+	free(line);
+	fclose(fp);
+}
+
+static void
+queuedump(struct friend *f)
+{
+	struct qent *q;
+	char   path[sizeof(f->path) + sizeof("/queue")];
+	int    fd;
+
+	/* Dormant friends have no directory fd */
+	if (f->dormant) {
+		snprintf(path, sizeof(path), "%s/%s", f->path, ffiles[FQUEUE].name);
+		fd = open(path, O_WRONLY | O_CREAT, 0666);
+	} else {
+		fd = ffileget(f, FQUEUE);
+	}
+	if (fd < 0)
+		return;
+	ftruncate(fd, 0);
+	lseek(fd, 0, SEEK_SET);
+	TAILQ_FOREACH(q, &f->queue, entry)
+		dprintf(fd, "%d %s\n", q->prio, q->path);
+	if (f->dormant)
+		close(fd);
+}
+
+static void
+queueout(void)
+{
+	ftruncate(gslots[QUEUE].fd[OUT], 0);
+	lseek(gslots[QUEUE].fd[OUT], 0, SEEK_SET);
+	dprintf(gslots[QUEUE].fd[OUT], "queued %zu\nactive %zu\n", nqueued, nqactive);
+}
+
+/* Offer the first queued file to the friend.  Unreadable files are
+ * dropped from the queue, -1 means the offer itself failed */
+static int
+queuestart(struct friend *f)
+{
+	struct qent *q = TAILQ_FIRST(&f->queue);
+	struct stat  st;
+	const char  *name;
+	uint32_t     r;
+
+	/* A FIFO swapped in for the file must not block the loop */
+	f->tx.src = open(q->path, O_RDONLY | O_NONBLOCK);
+	if (f->tx.src < 0 || fstat(f->tx.src, &st) < 0) {
+		weprintf(": %s : Queue > Dropping %s:", f->name, q->path);
+		goto drop;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		weprintf(": %s : Queue > Dropping %s: Not a regular file\n", f->name, q->path);
+		goto drop;
+	}
+	name = strrchr(q->path, '/');
+	name = name ? name + 1 : q->path;
+	r = tox_file_send(tox, f->num, TOX_FILE_KIND_DATA, st.st_size, NULL,
+			  (const uint8_t *)name, strlen(name), NULL);
+	f->tx.fnum = r;
+	if (r == UINT32_MAX) {
+		weprintf(": %s : Queue > Failed to offer %s\n", f->name, q->path);
+		close(f->tx.src);
+		f->tx.src = -1;
+		return -1;
+	}
+	f->tx.state = TRANSFER_INITIATED;
+	crready(&f->co[CTX]);
+	f->qactive = 1;
+	nqactive++;
+	queueout();
+	logmsg(": %s : Tx > Offered %s\n", f->name, q->path);
+	return 0;
+drop:
+	if (f->tx.src >= 0)
+		close(f->tx.src);
+	f->tx.src = -1;
+	TAILQ_REMOVE(&f->queue, q, entry);
+	tfree(q->path);
+	tfree(q);
+	nqueued--;
+	queuedump(f);
+	queueout();
+	return 0;
+}
+
+/* The running queued send is over, `done' drops it from the queue */
+static void
+queuestop(struct friend *f, int done)
+{
+	struct qent *q = TAILQ_FIRST(&f->queue);
+
+	close(f->tx.src);
+	f->tx.src = -1;
+	f->qactive = 0;
+	nqactive--;
+	if (done) {
+		TAILQ_REMOVE(&f->queue, q, entry);
+		tfree(q->path);
+		tfree(q);
+		nqueued--;
+		queuedump(f);
+	}
+	queueout();
+}
+
+/* Start queued sends of online, otherwise idle, friends up to
+ * QUEUEMAX, best priority first.  Runs when a friend comes online, a
+ * send ends or something is queued; a full send queue is retried a
+ * second later. */
+static void
+queuepass(void)
+{
+	struct friend *f, *best;
+	struct qent *q;
+
+	while (nqueued > nqactive && nqactive < QUEUEMAX) {
+		best = NULL;
+		TAILQ_FOREACH(f, &friendhead, entry) {
+			if (f->link == TOX_CONNECTION_NONE || f->conn == TOX_CONNECTION_NONE)
+				continue;
+			if (f->tx.state != TRANSFER_NONE || TAILQ_EMPTY(&f->queue))
+				continue;
+			q = TAILQ_FIRST(&f->queue);
+			if (!best || q->prio < TAILQ_FIRST(&best->queue)->prio)
+				best = f;
+		}
+		if (!best)
+			break;
+		if (queuestart(best) < 0) {
+			queueretry = time(NULL) + 1;
+			break;
+		}
+	}
+}
+
+/* Data on file_in while idle starts an anonymous transfer */
+static void
+txoffer(struct friend *f)
+{
+	f->tx.fnum = tox_file_send(tox, f->num, 0, UINT64_MAX, NULL, NULL, 0, NULL);
+	if (f->tx.fnum == UINT32_MAX) {
+		weprintf("Failed to initiate new transfer\n");
+		fiforeset(f->dirfd, &f->fd[FFILE_IN], ffiles[FFILE_IN]);
+	} else {
+		f->tx.state = TRANSFER_INITIATED;
+		logmsg(": %s : Tx > Initiated\n", f->name);
+	}
+}
+
+/* Outgoing transfer, from file_in or the queue.  Suspends until there
+ * is something to offer, on the receiver's answer, on file_in between
+ * chunks and for TXCOOLDOWN iterations once the send queue is full.
+ * Cancels and completions elsewhere drop it back to idle. */
+static int
+txrun(void *arg)
+{
+	struct friend *f = arg;
+	struct coro *c = &f->co[CTX];
+
+	CR_BEGIN(c);
+	for (;;) {
+		/* queuestart() offers queued files on its own */
+		while (f->tx.state == TRANSFER_NONE) {
+			crwait(c, &f->fd[FFILE_IN], 0);
+			CR_SUSPEND(c);
+			if (f->tx.state == TRANSFER_NONE && c->ev == CRFD)
+				txoffer(f);
+		}
+		while (f->tx.state == TRANSFER_INITIATED) {
+			crwait(c, NULL, 0);
+			CR_SUSPEND(c);
+		}
+		while (f->tx.state == TRANSFER_INPROGRESS ||
+		       f->tx.state == TRANSFER_PAUSED) {
+			if (f->tx.state == TRANSFER_PAUSED) {
+				crwait(c, NULL, 0);
+			} else if (f->tx.cooldown) {
+				f->tx.cooldown = 0;
+				crwait(c, NULL, interval(tox) * TXCOOLDOWN * 1000000ULL);
+			} else {
+				sendfriendfile(f);
+				if (f->tx.state != TRANSFER_INPROGRESS || f->tx.cooldown)
+					continue;
+				/* Queued files are read without waiting */
+				crwait(c, f->tx.src != -1 ? NULL : &f->fd[FFILE_IN], 0);
+				if (f->tx.src != -1)
+					crready(c);
+			}
+			CR_SUSPEND(c);
+		}
+	}
+	CR_END(c);
+}
+
+/* Incoming transfer.  Suspends until an offer arrives, then until a
+ * reader opens file_out, which can't be waited on and is tried once per
+ * iteration interval, then on file data.  Whether the reader is still
+ * there is checked once a second, writes notice it earlier. */
+static int
+rxrun(void *arg)
+{
+	struct friend *f = arg;
+	struct coro *c = &f->co[CRX];
+	TOX_ERR_FILE_CONTROL cerr;
+	uint64_t t;
+	int fd;
+
+	CR_BEGIN(c);
+	for (;;) {
+		while (f->rxstate == TRANSFER_NONE) {
+			crwait(c, NULL, 0);
+			CR_SUSPEND(c);
+		}
+		while (f->rxstate == TRANSFER_PENDING) {
+			if (f->conn != TOX_CONNECTION_NONE && f->fd[FFILE_OUT] == -1 &&
+			    (fd = fifoopen(f->dirfd, ffiles[FFILE_OUT])) >= 0)
+				f->fd[FFILE_OUT] = fd;
+			if (f->conn != TOX_CONNECTION_NONE && f->fd[FFILE_OUT] != -1) {
+				if (!tox_file_control(tox, f->num, f->rxfnum,
+						      TOX_FILE_CONTROL_RESUME, &cerr)) {
+					/* A full send queue drains, try again
+					 * with the reader kept */
+					if (cerr == TOX_ERR_FILE_CONTROL_SENDQ)
+						goto wait;
+					weprintf("Failed to accept transfer from receiver\n");
+					cancelrxtransfer(f);
+				} else {
+					logmsg(": %s : Rx > Accepted\n", f->name);
+					f->rxstart = monons();
+					f->rxbytes = 0;
+					f->rxprobe = f->rxstart + 1000000000ULL;
+					f->rxstate = TRANSFER_INPROGRESS;
+				}
+				break;
+			}
+wait:
+			crwait(c, NULL, interval(tox) * 1000000ULL);
+			CR_SUSPEND(c);
+		}
+		while (f->rxstate == TRANSFER_INPROGRESS) {
+			/* Hand over file data gathered during this iteration */
+			if (f->rxb.len > f->rxb.off && rxflush(f, 0) < 0) {
+				cancelrxtransfer(f);
+				break;
+			}
+			if (monons() >= f->rxprobe) {
+				if (rxsplice)
+					rxpoolfill();
+				fd = fifoopen(f->dirfd, ffiles[FFILE_OUT]);
+				if (fd < 0) {
+					cancelrxtransfer(f);
+					break;
+				}
+				close(fd);
+				f->rxprobe = monons() + 1000000000ULL;
+			}
+			t = monons();
+			crwait(c, NULL, f->rxprobe > t ? f->rxprobe - t : 1);
+			CR_SUSPEND(c);
+		}
+	}
+	CR_END(c);
+}
+
+/* Names from the other end: no absolute paths and no empty or hidden
+ * components, subdirectories only if `dirs' is set */
+static int
+relpathok(const char *p, int dirs)
+{
+	const char *c = p, *slash;
+
+	for (;;) {
+		if (*c == '\0' || *c == '/' || *c == '.')
+			return 0;
+		slash = strchr(c, '/');
+		if (!slash)
+			return 1;
+		if (!dirs)
+			return 0;
+		c = slash + 1;
+	}
+}
+
+/* Create the directories leading to `rel' below `dirfd' */
+static int
+mkparents(int dirfd, const char *rel)
+{
+	char path[PATH_MAX], *p;
+
+	snprintf(path, sizeof(path), "%s", rel);
+	for (p = strchr(path, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (mkdirat(dirfd, path, 0777) < 0 && errno != EEXIST) {
+			weprintf("mkdirat %s:", path);
+			return -1;
+		}
+		*p = '/';
+	}
+	return 0;
+}
+
+static struct syncent *
+syncfind(const char *rel)
+{
+	struct syncent *s;
+
+	TAILQ_FOREACH(s, &synchead, entry)
+		if (!strcmp(s->rel, rel))
+			return s;
+	return NULL;
+}
+
+static void
+syncdrop(struct syncent *s)
+{
+	TAILQ_REMOVE(&synchead, s, entry);
+	tfree(s->rel);
+	tfree(s);
+	nsyncpending--;
+}
+
+/* A file in sync/ changed, it is sent once it has been quiet for
+ * SYNCDELAY so that bursts of writes go out as one transfer */
+static void
+syncchanged(const char *rel)
+{
+	struct syncent *s = syncfind(rel);
+
+	if (s && s->echo) {
+		syncdrop(s);
+		return;
+	}
+	if (!s) {
+		s = tcalloc(MSYNC, 1, sizeof(*s));
+		s->rel = tstrdup(MSYNC, rel);
+		s->first = monons();
+		TAILQ_INSERT_TAIL(&synchead, s, entry);
+		nsyncpending++;
+	}
+	s->last = monons();
+}
+
+/* We are about to put a received file in place, don't send it back */
+static void
+syncecho(const char *rel)
+{
+	struct syncent *s;
+
+	if (syncfd < 0)
+		return;
+	s = syncfind(rel);
+	if (!s) {
+		s = tcalloc(MSYNC, 1, sizeof(*s));
+		s->rel = tstrdup(MSYNC, rel);
+		TAILQ_INSERT_TAIL(&synchead, s, entry);
+		nsyncpending++;
+	}
+	s->echo = 1;
+	s->last = monons();
+}
+
+/* Add sync/<rel> to the friend's delta queue unless it is already
+ * waiting there */
+static void
+syncqueue(struct friend *f, const char *rel, uint64_t at)
+{
+	struct qent *q;
+	char   path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "sync/%s", rel);
+	TAILQ_FOREACH(q, &f->dqueue, entry) {
+		if (f->dtx && q == TAILQ_FIRST(&f->dqueue))
+			continue;
+		if (q->sync && !strcmp(q->path, path))
+			return;
+	}
+	q = tcalloc(MQUEUE, 1, sizeof(*q));
+	q->path = tstrdup(MQUEUE, path);
+	q->sync = 1;
+	q->at = at;
+	TAILQ_INSERT_TAIL(&f->dqueue, q, entry);
+	nsyncqueued++;
+}
+
+static void
+syncsend(const char *rel, uint64_t at)
+{
+	struct friend *f;
+
+	TAILQ_FOREACH(f, &friendhead, entry)
+		if (f->syncsub)
+			syncqueue(f, rel, at);
+	TAILQ_FOREACH(f, &dormanthead, entry)
+		if (f->syncsub)
+			syncqueue(f, rel, at);
+}
+
+static void
+syncaddwatch(const char *rel)
+{
+#ifdef __linux__
+	struct syncwatch *w;
+	char   path[PATH_MAX];
+	int    wd;
+
+	if (syncfd < 0)
+		return;
+	if (*rel)
+		snprintf(path, sizeof(path), "sync/%s", rel);
+	else
+		snprintf(path, sizeof(path), "sync");
+	wd = inotify_add_watch(syncfd, path,
+			       IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR);
+	if (wd < 0) {
+		weprintf("inotify_add_watch %s:", path);
+		return;
+	}
+	TAILQ_FOREACH(w, &watchhead, entry)
+		if (w->wd == wd)
+			return;
+	w = tcalloc(MSYNC, 1, sizeof(*w));
+	w->wd = wd;
+	w->rel = tstrdup(MSYNC, rel);
+	TAILQ_INSERT_TAIL(&watchhead, w, entry);
+	nsyncwatches++;
+#endif
+}
+
+/* Mark the files below sync/<rel> changed, or queue them for `f' only.
+ * With `watch' set directories are watched as they are found. */
+static void
+syncwalk(const char *rel, struct friend *f, int watch)
+{
+	struct dirent *e;
+	struct stat st;
+	DIR   *d;
+	char   path[PATH_MAX], sub[PATH_MAX];
+
+	if (*rel)
+		snprintf(path, sizeof(path), "sync/%s", rel);
+	else
+		snprintf(path, sizeof(path), "sync");
+	if (watch)
+		syncaddwatch(rel);
+	d = opendir(path);
+	if (!d) {
+		weprintf("opendir %s:", path);
+		return;
+	}
+	while ((e = readdir(d))) {
+		if (e->d_name[0] == '.')
+			continue;
+		if (*rel)
+			snprintf(sub, sizeof(sub), "%s/%s", rel, e->d_name);
+		else
+			snprintf(sub, sizeof(sub), "%s", e->d_name);
+		if (fstatat(dirfd(d), e->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+			continue;
+		if (S_ISDIR(st.st_mode))
+			syncwalk(sub, f, watch);
+		else if (S_ISREG(st.st_mode) && f)
+			syncqueue(f, sub, monons());
+		else if (S_ISREG(st.st_mode))
+			syncchanged(sub);
+	}
+	closedir(d);
+}
+
+static void
+syncread(void)
+{
+#ifdef __linux__
+	struct inotify_event *ev;
+	struct syncwatch *w;
+	union {
+		struct inotify_event ev;
+		char   buf[4096];
+	} u;
+	ssize_t n;
+	char   *p, rel[PATH_MAX];
+
+	n = read(syncfd, u.buf, sizeof(u.buf));
+	if (n <= 0)
+		return;
+	for (p = u.buf; p < u.buf + n; p += sizeof(*ev) + ev->len) {
+		ev = (struct inotify_event *)p;
+		/* Events were lost, everything might have changed */
+		if (ev->mask & IN_Q_OVERFLOW) {
+			syncwalk("", NULL, 0);
+			continue;
+		}
+		TAILQ_FOREACH(w, &watchhead, entry)
+			if (w->wd == ev->wd)
+				break;
+		if (!w)
+			continue;
+		if (ev->mask & IN_IGNORED) {
+			TAILQ_REMOVE(&watchhead, w, entry);
+			tfree(w->rel);
+			tfree(w);
+			nsyncwatches--;
+			continue;
+		}
+		/* Hidden files include our own partial copies */
+		if (!ev->len || ev->name[0] == '.')
+			continue;
+		if (*w->rel)
+			snprintf(rel, sizeof(rel), "%s/%s", w->rel, ev->name);
+		else
+			snprintf(rel, sizeof(rel), "%s", ev->name);
+		if (ev->mask & IN_ISDIR) {
+			if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+				syncwalk(rel, NULL, 1);
+		} else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+			syncchanged(rel);
+		}
+	}
+#endif
+}
+
+/* Send the changes that have been quiet for SYNCDELAY */
+static void
+syncpass(void)
+{
+	struct syncent *s, *tmp;
+	uint64_t now = monons();
+
+	for (s = TAILQ_FIRST(&synchead); s; s = tmp) {
+		tmp = TAILQ_NEXT(s, entry);
+		if (now - s->last < SYNCDELAY * 1000000ULL)
+			continue;
+		if (!s->echo)
+			syncsend(s->rel, s->first);
+		syncdrop(s);
+	}
+}
+
+/* Echo 1 to sync_in to mirror sync/ to the friend, 0 to stop */
+static void
+syncin(struct friend *f)
+{
+	struct qent *q, *tmp;
+	char   c;
+
+	if (fiforead(f->dirfd, &f->fd[FSYNC_IN], ffiles[FSYNC_IN], &c, 1) != 1)
+		return;
+	if ((c != '0' && c != '1') || f->syncsub == c - '0')
+		return;
+	f->syncsub = c - '0';
+	ffilewrite(f, FSYNC, "%d\n", f->syncsub);
+	if (f->syncsub) {
+		logmsg(": %s : Sync > Subscribed\n", f->name);
+		if (syncfolder)
+			syncwalk("", f, 0);
+		return;
+	}
+	logmsg(": %s : Sync > Unsubscribed\n", f->name);
+	for (q = TAILQ_FIRST(&f->dqueue); q; q = tmp) {
+		tmp = TAILQ_NEXT(q, entry);
+		if (!q->sync || (f->dtx && q == TAILQ_FIRST(&f->dqueue)))
+			continue;
+		TAILQ_REMOVE(&f->dqueue, q, entry);
+		tfree(q->path);
+		tfree(q);
+	}
+}
+
+static int
+pktsend(struct friend *f, const uint8_t *buf, size_t len)
+{
+	if (!tox_friend_send_lossless_packet(tox, f->num, buf, len, NULL))
+		return -1;
+	f->acct.bytesout += len;
+	return 0;
+}
+
+/* Try the packet left over from the last attempt, -1 if it is still
+ * waiting for room in the send queue */
+static int
+pktflush(struct friend *f, struct pkt *p)
+{
+	if (!p->len)
+		return 0;
+	if (pktsend(f, p->buf, p->len) < 0)
+		return -1;
+	p->len = 0;
+	return 0;
+}
+
+/* Queue the paths written to delta_in, one per line */
+static void
+deltaread(struct friend *f)
+{
+	struct qent *q;
+	ssize_t n;
+	char    buf[PIPE_BUF + 1], *line, *nl;
+
+	n = fiforead(f->dirfd, &f->fd[FDELTA_IN], ffiles[FDELTA_IN],
+		     buf, sizeof(buf) - 1);
+	if (n <= 0)
+		return;
+	buf[n] = '\0';
+	for (line = buf; (nl = strchr(line, '\n')); line = nl + 1) {
+		*nl = '\0';
+		if (!*line)
+			continue;
+		if (access(line, R_OK) < 0) {
+			weprintf(": %s : Delta > %s:", f->name, line);
+			continue;
+		}
+		q = tcalloc(MQUEUE, 1, sizeof(*q));
+		q->path = tstrdup(MQUEUE, line);
+		TAILQ_INSERT_TAIL(&f->dqueue, q, entry);
+		logmsg(": %s : Delta > Queued %s\n", f->name, line);
+	}
+}
+
+/* Offer the first file of the delta queue, the receiver answers with
+ * the signatures of its old copy */
+static void
+deltastart(struct friend *f)
+{
+	struct qent *q = TAILQ_FIRST(&f->dqueue);
+	struct dtx  *d;
+	struct stat  st;
+	const char  *name;
+	size_t       len;
+	int          fd;
+
+	/* Files in sync/ keep their place in the tree */
+	if (q->sync) {
+		name = q->path + sizeof("sync/") - 1;
+	} else {
+		name = strrchr(q->path, '/');
+		name = name ? name + 1 : q->path;
+	}
+	len = strlen(name);
+	fd = open(q->path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    !len || len >= PATH_MAX || 18 + len > TOX_MAX_CUSTOM_PACKET_SIZE) {
+		weprintf(": %s : Delta > Dropping %s\n", f->name, q->path);
+		if (fd >= 0)
+			close(fd);
+		TAILQ_REMOVE(&f->dqueue, q, entry);
+		tfree(q->path);
+		tfree(q);
+		return;
+	}
+	d = tcalloc(MXFER, 1, sizeof(*d));
+	d->fd = fd;
+	d->size = st.st_size;
+	if (d->size) {
+		d->map = mmap(NULL, d->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (d->map == MAP_FAILED) {
+			weprintf("mmap %s:", q->path);
+			close(fd);
+			tfree(d);
+			TAILQ_REMOVE(&f->dqueue, q, entry);
+			tfree(q->path);
+			tfree(q);
+			return;
+		}
+	}
+	d->xid = ++deltaxid;
+	d->blocksz = deltablocksz(d->size);
+	d->state = DOFFER;
+	d->seen = time(NULL);
+	d->start = monons();
+	d->out.buf[0] = PKT_DOFFER;
+	pack32(&d->out.buf[1], d->xid);
+	pack64(&d->out.buf[5], d->size);
+	pack32(&d->out.buf[13], d->blocksz);
+	d->out.buf[17] = q->sync;
+	memcpy(&d->out.buf[18], name, len);
+	d->out.len = 18 + len;
+	f->dtx = d;
+	logmsg(": %s : Delta > Offered %s\n", f->name, q->path);
+}
+
+/* `drop' removes the file from the delta queue, otherwise it is offered
+ * again once the friend is back */
+static void
+deltatxstop(struct friend *f, int drop)
+{
+	struct dtx  *d = f->dtx;
+	struct qent *q;
+
+	if (!d)
+		return;
+	if (d->map)
+		munmap(d->map, d->size);
+	close(d->fd);
+	tfree(d->idx.sig);
+	tfree(d->idx.head);
+	tfree(d->idx.next);
+	tfree(d);
+	f->dtx = NULL;
+	if (drop && (q = TAILQ_FIRST(&f->dqueue))) {
+		TAILQ_REMOVE(&f->dqueue, q, entry);
+		tfree(q->path);
+		tfree(q);
+	}
+}
+
+static void
+deltalit(struct dtx *d, uint64_t n)
+{
+	d->out.buf[0] = PKT_DLIT;
+	pack32(&d->out.buf[1], d->xid);
+	memcpy(&d->out.buf[5], d->map + d->lit, n);
+	d->out.len = 5 + n;
+	d->lit += n;
+	d->nlit += n;
+}
+
+static void
+deltacopy(struct dtx *d)
+{
+	d->out.buf[0] = PKT_DCOPY;
+	pack32(&d->out.buf[1], d->xid);
+	pack32(&d->out.buf[5], d->cpblock);
+	pack32(&d->out.buf[9], d->cpcount);
+	d->out.len = 13;
+	d->ncopy += (uint64_t)d->cpcount * d->blocksz;
+	d->cpcount = 0;
+}
+
+/* Walk the file a byte at a time looking for blocks the receiver has,
+ * emitting runs of matched blocks and the literal bytes in between */
+static void
+deltascan(struct friend *f)
+{
+	struct dtx *d = f->dtx;
+	uint64_t budget = interval(tox) * TXBUDGET * 1E4, t0 = monons();
+	uint64_t lmax = TOX_MAX_CUSTOM_PACKET_SIZE - 5;
+	size_t   bs = d->blocksz, iter = 0;
+	int64_t  b;
+
+	for (;;) {
+		if (pktflush(f, &d->out) < 0)
+			break;
+		if (!(++iter % 4096) && monons() - t0 > budget)
+			break;
+		if (d->idx.n && d->pos + bs <= d->size) {
+			if (!d->rolling) {
+				d->weak = deltaweak(d->map + d->pos, bs);
+				d->rolling = 1;
+			}
+			b = deltafind(&d->idx, d->weak, d->map + d->pos, bs);
+			if (b >= 0) {
+				/* Literals before the block go out first */
+				if (d->pos > d->lit) {
+					deltalit(d, MIN(lmax, d->pos - d->lit));
+					continue;
+				}
+				if (d->cpcount && b == d->cpblock + d->cpcount) {
+					d->cpcount++;
+				} else {
+					if (d->cpcount)
+						deltacopy(d);
+					d->cpblock = b;
+					d->cpcount = 1;
+				}
+				d->pos += bs;
+				d->lit = d->pos;
+				d->rolling = 0;
+				continue;
+			}
+			if (d->cpcount) {
+				deltacopy(d);
+				continue;
+			}
+			if (d->pos - d->lit == lmax) {
+				deltalit(d, lmax);
+				continue;
+			}
+			if (d->pos + bs < d->size)
+				d->weak = deltaroll(d->weak, d->map[d->pos],
+						    d->map[d->pos + bs], bs);
+			d->pos++;
+			continue;
+		}
+		/* The tail is shorter than a block */
+		if (d->cpcount) {
+			deltacopy(d);
+			continue;
+		}
+		if (d->size > d->lit) {
+			deltalit(d, MIN(lmax, d->size - d->lit));
+			continue;
+		}
+		d->out.buf[0] = PKT_DEND;
+		pack32(&d->out.buf[1], d->xid);
+		pack64(&d->out.buf[5], d->size);
+		crypto_generichash(&d->out.buf[13], crypto_generichash_BYTES,
+				   d->map, d->size, NULL, 0);
+		d->out.len = 13 + crypto_generichash_BYTES;
+		pktflush(f, &d->out);
+		d->state = DWAIT;
+		d->seen = time(NULL);
+		break;
+	}
+}
+
+/* `fail' drops the partial copy and tells the sender unless it was
+ * the one to give up */
+static void
+deltarxstop(struct friend *f, int fail)
+{
+	struct drx *d = f->drx;
+
+	if (!d)
+		return;
+	if (d->map)
+		munmap(d->map, d->mapsz);
+	if (d->fd >= 0)
+		close(d->fd);
+	if (d->wfd >= 0)
+		close(d->wfd);
+	if (fail) {
+		unlinkat(d->dirfd, d->tmp, 0);
+		deltafailed++;
+	}
+	close(d->dirfd);
+	tfree(d);
+	f->drx = NULL;
+}
+
+/* PKT_DDONE or PKT_DCANCEL, best effort */
+static void
+deltactl(struct friend *f, int id, uint32_t xid, int status)
+{
+	uint8_t pkt[1 + 4 + 1];
+
+	pkt[0] = id;
+	pack32(&pkt[1], xid);
+	pkt[5] = status;
+	if (tox_friend_send_lossless_packet(tox, f->num, pkt, sizeof(pkt), NULL))
+		f->acct.bytesout += sizeof(pkt);
+}
+
+static void
+deltaoffer(struct friend *f, const uint8_t *data, size_t len)
+{
+	struct drx *d;
+	struct stat st;
+	uint32_t xid = unpack32(&data[1]);
+	size_t   bs = unpack32(&data[13]);
+	int      sync = data[17];
+	char     name[PATH_MAX];
+	const char *base, *dir;
+
+	len -= 18;
+	memcpy(name, &data[18], len);
+	name[len] = '\0';
+	if (strlen(name) != len || !relpathok(name, sync) ||
+	    bs < DELTAMINBLK || bs > DELTAMAXBLK || (bs & (bs - 1))) {
+		weprintf(": %s : Delta > Invalid offer\n", f->name);
+		deltactl(f, PKT_DDONE, xid, 1);
+		return;
+	}
+	if (sync && (!syncfolder || !f->syncsub)) {
+		weprintf(": %s : Sync > Not subscribed, refusing %s\n", f->name, name);
+		deltactl(f, PKT_DDONE, xid, 1);
+		return;
+	}
+	/* A new offer replaces one the sender gave up on */
+	deltarxstop(f, 1);
+
+	d = tcalloc(MXFER, 1, sizeof(*d));
+	d->xid = xid;
+	d->size = unpack64(&data[5]);
+	d->blocksz = bs;
+	d->fd = d->wfd = -1;
+	d->sync = sync;
+	snprintf(d->name, sizeof(d->name), "%s", name);
+	/* The partial copy is hidden next to the old one */
+	base = strrchr(name, '/');
+	if (base)
+		snprintf(d->tmp, sizeof(d->tmp), "%.*s/.%s.part",
+			 (int)(base - name), name, base + 1);
+	else
+		snprintf(d->tmp, sizeof(d->tmp), ".%s.part", name);
+	f->drx = d;
+	dir = sync ? "sync" : ffiles[FDELTA].name;
+	d->dirfd = openat(sync ? AT_FDCWD : f->dirfd, dir, O_RDONLY | O_DIRECTORY);
+	if (d->dirfd < 0) {
+		weprintf("openat %s:", dir);
+		tfree(d);
+		f->drx = NULL;
+		deltactl(f, PKT_DDONE, xid, 1);
+		return;
+	}
+	if (mkparents(d->dirfd, name) == 0)
+		d->wfd = openat(d->dirfd, d->tmp, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (d->wfd < 0) {
+		weprintf("openat %s:", d->tmp);
+		deltarxstop(f, 1);
+		deltactl(f, PKT_DDONE, xid, 1);
+		return;
+	}
+	/* Without an old copy everything comes as literals */
+	d->fd = openat(d->dirfd, name, O_RDONLY);
+	if (d->fd >= 0 && fstat(d->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		d->base = st;
+		d->same = 1;
+		if (st.st_size > 0)
+			d->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, d->fd, 0);
+		if (d->map == MAP_FAILED) {
+			d->map = NULL;
+			d->same = 0;
+		} else if (d->map) {
+			d->mapsz = st.st_size;
+			d->nblocks = MIN(d->mapsz / bs, DELTAMAXSIGS);
+		}
+	}
+	d->out.buf[0] = PKT_DACCEPT;
+	pack32(&d->out.buf[1], xid);
+	pack32(&d->out.buf[5], d->nblocks);
+	d->out.len = 9;
+	d->state = DSIGN;
+	d->seen = time(NULL);
+	d->start = monons();
+	logmsg(": %s : Delta > Receiving %s, %u blocks to reuse\n",
+	       f->name, name, d->nblocks);
+}
+
+/* Send the signatures of the old copy, as many as fit per packet */
+static void
+deltasignstep(struct friend *f)
+{
+	struct drx *d = f->drx;
+	struct dsig sig[(TOX_MAX_CUSTOM_PACKET_SIZE - 9) / (4 + DELTASTRONG)];
+	uint64_t budget = interval(tox) * TXBUDGET * 1E4, t0 = monons();
+	uint32_t i, n;
+	uint8_t *p;
+
+	while (pktflush(f, &d->out) == 0) {
+		if (d->nsigned == d->nblocks) {
+			d->state = DRECV;
+			break;
+		}
+		if (monons() - t0 > budget)
+			break;
+		n = MIN(LEN(sig), d->nblocks - d->nsigned);
+		deltasign(sig, d->map + (uint64_t)d->nsigned * d->blocksz,
+			  d->blocksz, n);
+		d->out.buf[0] = PKT_DSIG;
+		pack32(&d->out.buf[1], d->xid);
+		pack32(&d->out.buf[5], d->nsigned);
+		for (i = 0, p = &d->out.buf[9]; i < n; i++, p += 4 + DELTASTRONG) {
+			pack32(p, sig[i].weak);
+			memcpy(p + 4, sig[i].strong, DELTASTRONG);
+		}
+		d->out.len = p - d->out.buf;
+		d->nsigned += n;
+	}
+}
+
+static int
+deltawrite(struct drx *d, const uint8_t *p, size_t n)
+{
+	ssize_t r;
+
+	if (d->written + n > d->size)
+		return -1;
+	if (d->same && (d->written + n > d->mapsz ||
+	    (p != d->map + d->written && memcmp(p, d->map + d->written, n))))
+		d->same = 0;
+	while (n > 0) {
+		r = write(d->wfd, p, n);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			weprintf("write %s:", d->tmp);
+			return -1;
+		}
+		p += r;
+		n -= r;
+		d->written += r;
+	}
+	return 0;
+}
+
+/* Whether sync/<name> holds a local change the sender hasn't seen: one
+ * still settling, one made while the file was being received, or one
+ * made since startup still waiting in the sender's delta queue */
+static int
+syncconflict(struct friend *f, struct drx *d)
+{
+	struct syncent *s;
+	struct qent *q;
+	struct stat st;
+	char   path[PATH_MAX];
+
+	if ((s = syncfind(d->name)) && !s->echo)
+		return 1;
+	if (fstatat(d->dirfd, d->name, &st, 0) < 0)
+		return 0;
+	if (st.st_ino != d->base.st_ino || st.st_size != d->base.st_size ||
+	    st.st_mtim.tv_sec != d->base.st_mtim.tv_sec ||
+	    st.st_mtim.tv_nsec != d->base.st_mtim.tv_nsec)
+		return 1;
+	if (st.st_mtime < syncsince)
+		return 0;
+	snprintf(path, sizeof(path), "sync/%s", d->name);
+	TAILQ_FOREACH(q, &f->dqueue, entry)
+		if (q->sync && !strcmp(q->path, path))
+			return 1;
+	return 0;
+}
+
+/* Keep the local copy next to the received one as <name>.conflict-<time> */
+static void
+syncaside(struct friend *f, struct drx *d)
+{
+	struct syncent *s;
+	struct qent *q, *tmp;
+	char   aside[PATH_MAX + 32], path[PATH_MAX];
+
+	snprintf(aside, sizeof(aside), "%s.conflict-%lld", d->name,
+		 (long long)time(NULL));
+	if (renameat(d->dirfd, d->name, d->dirfd, aside) < 0) {
+		weprintf("rename %s:", d->name);
+		return;
+	}
+	/* The local change goes out under its new name, the sender must
+	 * not get it under the old one */
+	if ((s = syncfind(d->name)) && !s->echo)
+		syncdrop(s);
+	snprintf(path, sizeof(path), "sync/%s", d->name);
+	for (q = TAILQ_FIRST(&f->dqueue); q; q = tmp) {
+		tmp = TAILQ_NEXT(q, entry);
+		if (!q->sync || strcmp(q->path, path))
+			continue;
+		if (f->dtx && q == TAILQ_FIRST(&f->dqueue)) {
+			deltactl(f, PKT_DCANCEL, f->dtx->xid, 1);
+			deltatxstop(f, 1);
+			continue;
+		}
+		TAILQ_REMOVE(&f->dqueue, q, entry);
+		tfree(q->path);
+		tfree(q);
+	}
+	nsyncconflicts++;
+	logmsg(": %s : Sync > %s : Conflict, local copy kept as %s\n",
+	       f->name, d->name, aside);
+}
+
+/* Check the rebuilt file against the sender's hash and put it in
+ * place of the old copy */
+static int
+deltafinish(struct friend *f, const uint8_t *data)
+{
+	struct drx *d = f->drx;
+	uint8_t  h[crypto_generichash_BYTES], *map = NULL;
+
+	if (unpack64(&data[5]) != d->size || d->written != d->size)
+		return -1;
+	if (d->size) {
+		map = mmap(NULL, d->size, PROT_READ, MAP_SHARED, d->wfd, 0);
+		if (map == MAP_FAILED) {
+			weprintf("mmap %s:", d->tmp);
+			return -1;
+		}
+	}
+	crypto_generichash(h, sizeof(h), map, d->size, NULL, 0);
+	if (map)
+		munmap(map, d->size);
+	if (memcmp(h, &data[13], sizeof(h))) {
+		weprintf(": %s : Delta > %s : Hash mismatch\n", f->name, d->name);
+		return -1;
+	}
+	/* Leave an unchanged file alone, a mirror would send it back */
+	if (d->same && d->written == d->mapsz) {
+		unlinkat(d->dirfd, d->tmp, 0);
+		return 0;
+	}
+	/* Closed first, inotify would report closing it under the new
+	 * name as a change of ours */
+	close(d->wfd);
+	d->wfd = -1;
+	if (d->sync && syncconflict(f, d))
+		syncaside(f, d);
+	if (d->sync)
+		syncecho(d->name);
+	if (renameat(d->dirfd, d->tmp, d->dirfd, d->name) < 0) {
+		weprintf("rename %s:", d->tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/* Delta packets from a friend, both as sender and as receiver */
+static void
+deltapacket(struct friend *f, const uint8_t *data, size_t len)
+{
+	struct dtx *t = f->dtx;
+	struct drx *r = f->drx;
+	struct qent *q;
+	uint32_t xid, n, first, i;
+	uint64_t off, cnt;
+	const uint8_t *p;
+
+	if (len < 5)
+		return;
+	xid = unpack32(&data[1]);
+	switch (data[0]) {
+	case PKT_DOFFER:
+		if (len > 18 && len - 18 < PATH_MAX)
+			deltaoffer(f, data, len);
+		break;
+	case PKT_DACCEPT:
+		if (!t || t->xid != xid || t->state != DOFFER || len != 9)
+			break;
+		t->seen = time(NULL);
+		n = unpack32(&data[5]);
+		if (n > DELTAMAXSIGS) {
+			deltactl(f, PKT_DCANCEL, xid, 1);
+			deltatxstop(f, 1);
+			break;
+		}
+		t->idx.n = n;
+		t->state = DSCAN;
+		if (!n)
+			break;
+		t->idx.sig = tcalloc(MXFER, n, sizeof(*t->idx.sig));
+		t->idx.next = tcalloc(MXFER, n, sizeof(*t->idx.next));
+		t->idx.mask = deltaslots(n) - 1;
+		t->idx.head = tcalloc(MXFER, t->idx.mask + 1, sizeof(*t->idx.head));
+		t->state = DSIGS;
+		break;
+	case PKT_DSIG:
+		if (!t || t->xid != xid || t->state != DSIGS || len < 9 ||
+		    (len - 9) % (4 + DELTASTRONG))
+			break;
+		t->seen = time(NULL);
+		first = unpack32(&data[5]);
+		n = (len - 9) / (4 + DELTASTRONG);
+		if (first != t->nsig || n > t->idx.n - first) {
+			deltactl(f, PKT_DCANCEL, xid, 1);
+			deltatxstop(f, 1);
+			break;
+		}
+		for (i = 0, p = &data[9]; i < n; i++, p += 4 + DELTASTRONG) {
+			t->idx.sig[first + i].weak = unpack32(p);
+			memcpy(t->idx.sig[first + i].strong, p + 4, DELTASTRONG);
+		}
+		t->nsig += n;
+		if (t->nsig == t->idx.n) {
+			deltaindex(&t->idx);
+			t->state = DSCAN;
+		}
+		break;
+	case PKT_DDONE:
+		if (!t || t->xid != xid || len != 6)
+			break;
+		if (data[5] || t->state != DWAIT) {
+			weprintf(": %s : Delta > Failed to send %s\n",
+				 f->name, TAILQ_FIRST(&f->dqueue)->path);
+			deltafailed++;
+		} else {
+			logmsg(": %s : Delta > Sent %s, %llu literal, %llu copied bytes\n",
+			       f->name, TAILQ_FIRST(&f->dqueue)->path,
+			       (unsigned long long)t->nlit,
+			       (unsigned long long)t->ncopy);
+			deltasent++;
+			q = TAILQ_FIRST(&f->dqueue);
+			if (q->sync) {
+				histadd(&synch, monons() - q->at);
+				nsyncsent++;
+			}
+			deltalitbytes += t->nlit;
+			deltacopybytes += t->ncopy;
+		}
+		deltatxstop(f, 1);
+		break;
+	case PKT_DCANCEL:
+		if (r && r->xid == xid)
+			deltarxstop(f, 1);
+		break;
+	case PKT_DLIT:
+		if (!r || r->xid != xid || r->state != DRECV)
+			break;
+		r->seen = time(NULL);
+		if (deltawrite(r, &data[5], len - 5) < 0) {
+			deltactl(f, PKT_DDONE, xid, 1);
+			deltarxstop(f, 1);
+		}
+		break;
+	case PKT_DCOPY:
+		if (!r || r->xid != xid || r->state != DRECV || len != 13)
+			break;
+		r->seen = time(NULL);
+		first = unpack32(&data[5]);
+		n = unpack32(&data[9]);
+		off = (uint64_t)first * r->blocksz;
+		cnt = (uint64_t)n * r->blocksz;
+		if (first >= r->nblocks || n > r->nblocks - first ||
+		    deltawrite(r, r->map + off, cnt) < 0) {
+			deltactl(f, PKT_DDONE, xid, 1);
+			deltarxstop(f, 1);
+		}
+		break;
+	case PKT_DEND:
+		if (!r || r->xid != xid || r->state != DRECV ||
+		    len != 13 + crypto_generichash_BYTES)
+			break;
+		if (deltafinish(f, data) < 0) {
+			deltactl(f, PKT_DDONE, xid, 1);
+			deltarxstop(f, 1);
+			break;
+		}
+		logmsg(": %s : Delta > Received %s\n", f->name, r->name);
+		deltarecv++;
+		nsyncapplied += r->sync;
+		histadd(&deltah, monons() - r->start);
+		deltactl(f, PKT_DDONE, xid, 0);
+		deltarxstop(f, 0);
+		break;
+	}
+}
+
+/* SHAVE or SNONE, best effort */
+static void
+swarmreply(struct friend *f, int id, uint32_t sid, uint64_t size)
+{
+	uint8_t pkt[1 + 4 + 8];
+
+	pkt[0] = id;
+	pack32(&pkt[1], sid);
+	pack64(&pkt[5], size);
+	pktsend(f, pkt, id == PKT_SHAVE ? sizeof(pkt) : 5);
+}
+
+static struct hashent *
+hashlookup(struct stat *st)
+{
+	size_t i;
+
+	for (i = 0; i < MIN(nhashcache, LEN(hashcache)); i++) {
+		if (hashcache[i].dev == st->st_dev && hashcache[i].ino == st->st_ino &&
+		    hashcache[i].size == st->st_size &&
+		    hashcache[i].mtim.tv_sec == st->st_mtim.tv_sec &&
+		    hashcache[i].mtim.tv_nsec == st->st_mtim.tv_nsec)
+			return &hashcache[i];
+	}
+	return NULL;
+}
+
+/* Answer the query once the hash is known, the share is dropped if it
+ * doesn't match */
+static void
+sharematch(struct friend *f, struct share *sh, const uint8_t *h)
+{
+	if (memcmp(h, sh->want, sizeof(sh->want))) {
+		swarmreply(f, PKT_SNONE, sh->sid, 0);
+		sharedrop(f, sh);
+		return;
+	}
+	sh->hashed = 1;
+	swarmreply(f, PKT_SHAVE, sh->sid, sh->size);
+	logmsg(": %s : Swarm > Sharing %s\n", f->name, sh->path);
+}
+
+/* Hash a share for at most `budget' ns, called from swarmpass() */
+static void
+sharehash(struct friend *f, struct share *sh, uint64_t budget)
+{
+	struct hashent *e;
+	uint64_t t0 = monons(), n;
+	uint8_t  h[crypto_generichash_BYTES];
+
+	if (!sh->hs) {
+		if (posix_memalign((void **)&sh->hs, 64, sizeof(*sh->hs))) {
+			sh->hs = NULL;
+			return;
+		}
+		crypto_generichash_init(sh->hs, NULL, 0, sizeof(h));
+		if (sh->size > 0) {
+			sh->map = mmap(NULL, sh->size, PROT_READ, MAP_PRIVATE, sh->fd, 0);
+			if (sh->map == MAP_FAILED) {
+				weprintf("mmap:");
+				sh->map = NULL;
+				swarmreply(f, PKT_SNONE, sh->sid, 0);
+				sharedrop(f, sh);
+				return;
+			}
+		}
+	}
+	while (sh->pos < sh->size) {
+		if (monons() - t0 > budget)
+			return;
+		n = MIN(sh->size - sh->pos, 1 << 20);
+		crypto_generichash_update(sh->hs, sh->map + sh->pos, n);
+		sh->pos += n;
+	}
+	crypto_generichash_final(sh->hs, h, sizeof(h));
+	free(sh->hs);
+	sh->hs = NULL;
+	if (sh->map)
+		munmap(sh->map, sh->size);
+	sh->map = NULL;
+	if (!(e = hashlookup(&sh->st)))
+		e = &hashcache[nhashcache++ % LEN(hashcache)];
+	e->dev = sh->st.st_dev;
+	e->ino = sh->st.st_ino;
+	e->size = sh->st.st_size;
+	e->mtim = sh->st.st_mtim;
+	memcpy(e->h, h, sizeof(h));
+	sharematch(f, sh, h);
+}
+
+/* Offer sync/<name> if its hash matches.  The hash of a file that was
+ * hashed before is taken from the cache, others are hashed later by
+ * swarmpass() so that a large file doesn't stall the callback. */
+static void
+swarmquery(struct friend *f, const uint8_t *data, size_t len)
+{
+	struct share *sh;
+	struct hashent *e;
+	struct stat st;
+	uint32_t sid = unpack32(&data[1]);
+	uint8_t  h[crypto_generichash_BYTES];
+	char     name[PATH_MAX], path[PATH_MAX + sizeof("sync/")];
+	int      fd;
+
+	len -= 5 + sizeof(h);
+	memcpy(name, &data[5 + sizeof(h)], len);
+	name[len] = '\0';
+	if (!syncfolder || !f->syncsub || strlen(name) != len ||
+	    !relpathok(name, 1)) {
+		swarmreply(f, PKT_SNONE, sid, 0);
+		return;
+	}
+	snprintf(path, sizeof(path), "sync/%s", name);
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		if (fd >= 0)
+			close(fd);
+		swarmreply(f, PKT_SNONE, sid, 0);
+		return;
+	}
+	sh = tcalloc(MXFER, 1, sizeof(*sh));
+	sh->sid = sid;
+	sh->fd = fd;
+	sh->size = st.st_size;
+	sh->path = tstrdup(MXFER, path);
+	sh->st = st;
+	memcpy(sh->want, &data[5], sizeof(sh->want));
+	TAILQ_INSERT_TAIL(&f->shares, sh, entry);
+	if ((e = hashlookup(&st)))
+		sharematch(f, sh, e->h);
+}
+
+static void
+sharedrop(struct friend *f, struct share *sh)
+{
+	struct serve *sv, *tmp;
+
+	for (sv = TAILQ_FIRST(&f->serving); sv; sv = tmp) {
+		tmp = TAILQ_NEXT(sv, entry);
+		if (sv->sh != sh)
+			continue;
+		TAILQ_REMOVE(&f->serving, sv, entry);
+		tfree(sv);
+	}
+	TAILQ_REMOVE(&f->shares, sh, entry);
+	if (sh->map)
+		munmap(sh->map, sh->size);
+	free(sh->hs);
+	close(sh->fd);
+	tfree(sh->path);
+	tfree(sh);
+}
+
+/* Send the requested chunks in order, one packet at a time */
+static void
+servestep(struct friend *f)
+{
+	struct serve *sv;
+	uint64_t budget = interval(tox) * TXBUDGET * 1E4, t0 = monons();
+	size_t   n;
+	ssize_t  r;
+
+	while (pktflush(f, &f->sout) == 0 && (sv = TAILQ_FIRST(&f->serving))) {
+		if (sv->off == sv->end) {
+			TAILQ_REMOVE(&f->serving, sv, entry);
+			tfree(sv);
+			continue;
+		}
+		if (monons() - t0 > budget)
+			break;
+		n = MIN(sizeof(f->sout.buf) - 17, sv->end - sv->off);
+		r = pread(sv->sh->fd, &f->sout.buf[17], n, sv->off);
+		if (r <= 0) {
+			if (r < 0)
+				weprintf("pread:");
+			sharedrop(f, sv->sh);
+			continue;
+		}
+		f->sout.buf[0] = PKT_SDATA;
+		pack32(&f->sout.buf[1], sv->sh->sid);
+		pack32(&f->sout.buf[5], sv->tag);
+		pack64(&f->sout.buf[9], sv->off);
+		f->sout.len = 17 + r;
+		sv->off += r;
+		nserved += r;
+	}
+}
+
+static uint64_t
+chunklen(struct swarm *s, size_t i)
+{
+	return MIN(SWARMCHUNK, s->size - (uint64_t)i * SWARMCHUNK);
+}
+
+static struct source *
+swarmsource(struct swarm *s, uint32_t frnum)
+{
+	size_t i;
+
+	for (i = 0; i < s->nsrc; i++)
+		if (s->src[i].frnum == frnum)
+			return &s->src[i];
+	return NULL;
+}
+
+/* Bytes per second while the source had chunks in flight */
+static uint64_t
+sourcerate(struct source *src, uint64_t now)
+{
+	uint64_t busy = src->busy;
+
+	if (src->inflight)
+		busy += now - src->busyat;
+	return busy ? src->bytes * 1000000000ULL / busy : 0;
+}
+
+static void
+sourcebusy(struct source *src, int delta, uint64_t now)
+{
+	if (!src->inflight)
+		src->busyat = now;
+	src->inflight += delta;
+	if (!src->inflight)
+		src->busy += now - src->busyat;
+}
+
+/* Take chunk `i' from its owner, telling it to stop sending */
+static void
+chunkdrop(struct swarm *s, size_t i, uint64_t now)
+{
+	struct chunk  *c = &s->chunks[i];
+	struct source *src = swarmsource(s, c->owner);
+	struct friend *f;
+	uint8_t pkt[1 + 4 + 4];
+
+	if (!src)
+		return;
+	f = friendlookup(c->owner, 0);
+	if (f && f->conn != TOX_CONNECTION_NONE) {
+		pkt[0] = PKT_SCANCEL;
+		pack32(&pkt[1], s->sid);
+		pack32(&pkt[5], c->tag);
+		pktsend(f, pkt, sizeof(pkt));
+	}
+	sourcebusy(src, -1, now);
+	c->owner = -1;
+	c->got = 0;
+}
+
+static int
+chunkget(struct swarm *s, struct source *src, size_t i, uint64_t now)
+{
+	struct chunk  *c = &s->chunks[i];
+	struct friend *f = friendlookup(src->frnum, 0);
+	uint8_t pkt[1 + 4 + 4 + 4 + 4];
+
+	pkt[0] = PKT_SGET;
+	pack32(&pkt[1], s->sid);
+	pack32(&pkt[5], s->tags + 1);
+	pack32(&pkt[9], i);
+	pack32(&pkt[13], SWARMCHUNK);
+	if (!f || pktsend(f, pkt, sizeof(pkt)) < 0)
+		return -1;
+	c->tag = ++s->tags;
+	c->owner = src->frnum;
+	c->got = 0;
+	c->last = now;
+	sourcebusy(src, 1, now);
+	return 0;
+}
+
+/* A chunk for an idle source: the first unclaimed one, or near the end
+ * one it would finish from scratch in less than half the time its
+ * owner still needs */
+static int64_t
+chunkpick(struct swarm *s, struct source *src, uint64_t now)
+{
+	struct source *o;
+	uint64_t rate, orate, left;
+	size_t   i;
+	int64_t  best = -1;
+
+	for (i = 0; i < s->nchunks; i++)
+		if (!s->chunks[i].done && s->chunks[i].owner == -1)
+			return i;
+	rate = sourcerate(src, now);
+	if (!rate)
+		return -1;
+	for (i = 0; i < s->nchunks; i++) {
+		if (s->chunks[i].done || s->chunks[i].owner == src->frnum)
+			continue;
+		o = swarmsource(s, s->chunks[i].owner);
+		orate = o ? sourcerate(o, now) : 0;
+		left = chunklen(s, i) - s->chunks[i].got;
+		if (orate && left * rate <= 2 * chunklen(s, i) * orate)
+			continue;
+		if (best < 0 || s->chunks[i].got < s->chunks[best].got)
+			best = i;
+	}
+	if (best >= 0) {
+		chunkdrop(s, best, now);
+		nstolen++;
+	}
+	return best;
+}
+
+static void
+swarmfree(struct swarm *s, int ok)
+{
+	struct friend *f;
+	size_t  i;
+	uint8_t pkt[1 + 4];
+
+	pkt[0] = PKT_SDONE;
+	pack32(&pkt[1], s->sid);
+	for (i = 0; i < s->nsrc; i++) {
+		f = friendlookup(s->src[i].frnum, 0);
+		if (f && (s->src[i].state == SHAVE || s->src[i].state == SQUERIED)) {
+			pktsend(f, pkt, sizeof(pkt));
+			if (ok)
+				logmsg(": %s : Swarm > %s : %llu bytes\n", f->name,
+				       s->name, (unsigned long long)s->src[i].bytes);
+		}
+	}
+	if (s->fd >= 0) {
+		close(s->fd);
+		if (!ok)
+			unlinkat(gslots[SWARM].fd[OUT], s->tmp, 0);
+	}
+	TAILQ_REMOVE(&swarmhead, s, entry);
+	tfree(s->chunks);
+	tfree(s->src);
+	tfree(s->name);
+	tfree(s);
+	if (ok)
+		nswarmdone++;
+	else
+		nswarmfailed++;
+}
+
+/* Verify the whole file and move it into swarm/out */
+static void
+swarmfinish(struct swarm *s)
+{
+	uint8_t  h[crypto_generichash_BYTES], *map = NULL;
+	const char *base;
+
+	if (s->size) {
+		map = mmap(NULL, s->size, PROT_READ, MAP_SHARED, s->fd, 0);
+		if (map == MAP_FAILED) {
+			weprintf("mmap %s:", s->tmp);
+			swarmfree(s, 0);
+			return;
+		}
+	}
+	crypto_generichash(h, sizeof(h), map, s->size, NULL, 0);
+	if (map)
+		munmap(map, s->size);
+	if (memcmp(h, s->hash, sizeof(h))) {
+		weprintf("Swarm > %s : Hash mismatch\n", s->name);
+		swarmfree(s, 0);
+		return;
+	}
+	base = strrchr(s->name, '/');
+	base = base ? base + 1 : s->name;
+	if (renameat(gslots[SWARM].fd[OUT], s->tmp, gslots[SWARM].fd[OUT], base) < 0) {
+		weprintf("rename %s:", s->tmp);
+		swarmfree(s, 0);
+		return;
+	}
+	logmsg("Swarm > %s : Done in %llu ms\n", s->name,
+	       (unsigned long long)((monons() - s->start) / 1000000));
+	swarmfree(s, 1);
+}
+
+/* The first answer fixes the size and sets up the partial file.  The
+ * size comes from the friend, chunks are numbered in 32 bits on the wire
+ * and their table is allocated up front. */
+static int
+swarmsize(struct swarm *s, uint64_t size)
+{
+	const char *base;
+	size_t i;
+
+	if (size > SWARMMAXSIZE || size / SWARMCHUNK >= UINT32_MAX) {
+		weprintf("Swarm > %s : Bad size %llu\n", s->name,
+			 (unsigned long long)size);
+		return -1;
+	}
+	s->nchunks = (size + SWARMCHUNK - 1) / SWARMCHUNK;
+	s->chunks = ttrycalloc(MXFER, s->nchunks ? s->nchunks : 1, sizeof(*s->chunks));
+	if (!s->chunks) {
+		weprintf("Swarm > %s : No memory for %zu chunks\n", s->name,
+			 s->nchunks);
+		return -1;
+	}
+	base = strrchr(s->name, '/');
+	base = base ? base + 1 : s->name;
+	snprintf(s->tmp, sizeof(s->tmp), ".%s.part", base);
+	s->fd = openat(gslots[SWARM].fd[OUT], s->tmp, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (s->fd < 0) {
+		weprintf("openat %s:", s->tmp);
+		return -1;
+	}
+	if (ftruncate(s->fd, size) < 0) {
+		weprintf("ftruncate %s:", s->tmp);
+		return -1;
+	}
+	s->size = size;
+	for (i = 0; i < s->nchunks; i++)
+		s->chunks[i].owner = -1;
+	s->sized = 1;
+	return 0;
+}
+
+/* Swarm packets, both as provider and as downloader */
+static void
+swarmpacket(struct friend *f, const uint8_t *data, size_t len)
+{
+	struct swarm  *s;
+	struct source *src;
+	struct share  *sh;
+	struct serve  *sv;
+	struct chunk  *c;
+	uint32_t sid, tag, i;
+	uint64_t off, n, now = monons();
+
+	if (len < 5)
+		return;
+	sid = unpack32(&data[1]);
+
+	/* Provider side */
+	switch (data[0]) {
+	case PKT_SQUERY:
+		if (len > 5 + crypto_generichash_BYTES &&
+		    len - 5 - crypto_generichash_BYTES < PATH_MAX)
+			swarmquery(f, data, len);
+		return;
+	case PKT_SGET:
+		if (len != 17)
+			return;
+		TAILQ_FOREACH(sh, &f->shares, entry)
+			if (sh->sid == sid)
+				break;
+		off = (uint64_t)unpack32(&data[9]) * unpack32(&data[13]);
+		/* Not offered until hashed */
+		if (!sh || !sh->hashed || off >= sh->size)
+			return;
+		sv = tcalloc(MXFER, 1, sizeof(*sv));
+		sv->sh = sh;
+		sv->tag = unpack32(&data[5]);
+		sv->off = off;
+		sv->end = MIN(sh->size, off + unpack32(&data[13]));
+		TAILQ_INSERT_TAIL(&f->serving, sv, entry);
+		return;
+	case PKT_SCANCEL:
+		if (len != 9)
+			return;
+		tag = unpack32(&data[5]);
+		TAILQ_FOREACH(sv, &f->serving, entry) {
+			if (sv->sh->sid == sid && sv->tag == tag) {
+				TAILQ_REMOVE(&f->serving, sv, entry);
+				tfree(sv);
+				break;
+			}
+		}
+		return;
+	case PKT_SDONE:
+		TAILQ_FOREACH(sh, &f->shares, entry) {
+			if (sh->sid == sid) {
+				sharedrop(f, sh);
+				break;
+			}
+		}
+		return;
+	}
+
+	/* Downloader side */
+	TAILQ_FOREACH(s, &swarmhead, entry)
+		if (s->sid == sid)
+			break;
+	if (!s || !(src = swarmsource(s, f->num)))
+		return;
+	switch (data[0]) {
+	case PKT_SHAVE:
+		if (len != 13 || src->state != SQUERIED)
+			return;
+		n = unpack64(&data[5]);
+		if (!s->sized && swarmsize(s, n) < 0) {
+			swarmfree(s, 0);
+			return;
+		}
+		src->state = n == s->size ? SHAVE : SNONE;
+		s->seen = time(NULL);
+		break;
+	case PKT_SNONE:
+		src->state = SNONE;
+		break;
+	case PKT_SDATA:
+		if (len <= 17 || !s->sized)
+			return;
+		tag = unpack32(&data[5]);
+		off = unpack64(&data[9]);
+		n = len - 17;
+		i = off / SWARMCHUNK;
+		if (i >= s->nchunks)
+			return;
+		c = &s->chunks[i];
+		/* Late data from a chunk's previous owner */
+		if (c->done || c->owner != f->num || c->tag != tag ||
+		    off + n > (uint64_t)i * SWARMCHUNK + chunklen(s, i))
+			return;
+		if (pwrite(s->fd, &data[17], n, off) != n) {
+			weprintf("pwrite %s:", s->tmp);
+			swarmfree(s, 0);
+			return;
+		}
+		c->got += n;
+		c->last = now;
+		src->bytes += n;
+		nswarmbytes += n;
+		s->seen = time(NULL);
+		if (c->got == chunklen(s, i)) {
+			c->done = 1;
+			c->owner = -1;
+			s->ndone++;
+			sourcebusy(src, -1, now);
+		}
+		break;
+	}
+}
+
+/* Query sources as they come online, hand out chunks, take back the
+ * ones that stalled and finish completed downloads */
+static void
+swarmpass(void)
+{
+	struct swarm  *s, *stmp;
+	struct source *src;
+	struct friend *f;
+	struct share  *sh, *shtmp;
+	uint64_t now = monons();
+	uint8_t  pkt[TOX_MAX_CUSTOM_PACKET_SIZE];
+	size_t   i, j, len;
+	int64_t  c;
+
+	/* Shares don't survive outages */
+	TAILQ_FOREACH(f, &friendhead, entry) {
+		if (f->conn == TOX_CONNECTION_NONE) {
+			while ((sh = TAILQ_FIRST(&f->shares)))
+				sharedrop(f, sh);
+			f->sout.len = 0;
+			continue;
+		}
+		for (sh = TAILQ_FIRST(&f->shares); sh; sh = shtmp) {
+			shtmp = TAILQ_NEXT(sh, entry);
+			if (!sh->hashed)
+				sharehash(f, sh, interval(tox) * TXBUDGET * 1E4);
+		}
+		if (!TAILQ_EMPTY(&f->serving) || f->sout.len)
+			servestep(f);
+	}
+
+	for (s = TAILQ_FIRST(&swarmhead); s; s = stmp) {
+		stmp = TAILQ_NEXT(s, entry);
+		for (i = 0; i < s->nsrc; i++) {
+			src = &s->src[i];
+			f = friendlookup(src->frnum, 0);
+			if (!f || f->conn == TOX_CONNECTION_NONE) {
+				for (j = 0; j < s->nchunks; j++)
+					if (s->chunks[j].owner == src->frnum)
+						chunkdrop(s, j, now);
+				src->state = SNEW;
+				continue;
+			}
+			if (src->state != SNEW)
+				continue;
+			len = strlen(s->name);
+			pkt[0] = PKT_SQUERY;
+			pack32(&pkt[1], s->sid);
+			memcpy(&pkt[5], s->hash, sizeof(s->hash));
+			memcpy(&pkt[5 + sizeof(s->hash)], s->name, len);
+			if (pktsend(f, pkt, 5 + sizeof(s->hash) + len) == 0)
+				src->state = SQUERIED;
+		}
+		if (s->sized && s->ndone == s->nchunks) {
+			swarmfinish(s);
+			continue;
+		}
+		if (time(NULL) - s->seen > DELTATIMEOUT) {
+			weprintf("Swarm > %s : No progress, giving up\n", s->name);
+			swarmfree(s, 0);
+			continue;
+		}
+		if (!s->sized)
+			continue;
+		for (i = 0; i < s->nchunks; i++) {
+			if (s->chunks[i].owner != -1 &&
+			    now - s->chunks[i].last > SWARMSTALL * 1000000000ULL)
+				chunkdrop(s, i, now);
+		}
+		for (i = 0; i < s->nsrc; i++) {
+			src = &s->src[i];
+			while (src->state == SHAVE && src->inflight < SWARMINFLIGHT) {
+				c = chunkpick(s, src, now);
+				if (c < 0 || chunkget(s, src, c, now) < 0)
+					break;
+			}
+		}
+	}
+}
+
+/* Drive the delta transfers of online friends, called every iteration */
+static void
+deltapass(void)
+{
+	struct friend *f;
+	time_t now = time(NULL);
+
+	TAILQ_FOREACH(f, &friendhead, entry) {
+		/* Sessions don't survive outages, the file is offered again */
+		if (f->conn == TOX_CONNECTION_NONE) {
+			deltatxstop(f, 0);
+			deltarxstop(f, 1);
+			continue;
+		}
+		if (f->dtx && f->dtx->state != DSCAN &&
+		    now - f->dtx->seen > DELTATIMEOUT) {
+			weprintf(": %s : Delta > No answer, dropping %s\n",
+				 f->name, TAILQ_FIRST(&f->dqueue)->path);
+			deltactl(f, PKT_DCANCEL, f->dtx->xid, 1);
+			deltafailed++;
+			deltatxstop(f, 1);
+		}
+		if (f->drx && f->drx->state == DRECV &&
+		    now - f->drx->seen > DELTATIMEOUT) {
+			weprintf(": %s : Delta > %s : Timed out\n", f->name, f->drx->name);
+			deltarxstop(f, 1);
+		}
+		if (!f->dtx && !TAILQ_EMPTY(&f->dqueue))
+			deltastart(f);
+		if (f->dtx) {
+			if (f->dtx->state == DSCAN)
+				deltascan(f);
+			else
+				pktflush(f, &f->dtx->out);
+		}
+		if (f->drx && f->drx->state == DSIGN)
+			deltasignstep(f);
+	}
+}
+
+static void
+sendfriendtext(struct friend *f)
+{
+	struct   stat st;
+	ssize_t  n;
+	int      r;
+	uint64_t written = 0, rd = 0, sent, t0 = cpuns(), t1 = monons();
+	uint8_t  buf[TOX_MAX_MESSAGE_LENGTH];
+
+	n = fiforead(f->dirfd, &f->fd[FTEXT_IN], ffiles[FTEXT_IN], buf, sizeof(buf));
+	if (n <= 0)
+		return;
+	if (trace) {
+		/* A write updates the FIFO's mtime, which is as close
+		 * as we get to when the message was handed to us */
+		rd = realns();
+		written = rd;
+		if (fstat(f->fd[FTEXT_IN], &st) == 0)
+			written = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+		if (written > rd)
+			written = rd;
+	}
+	if (buf[n - 1] == '\n')
+		n--;
+	sent = trace ? realns() : 0;
+	r = tox_friend_send_message(tox, f->num, TOX_MESSAGE_TYPE_ACTION, buf, n, NULL);
+	if (r < 0) {
+		weprintf("Failed to send message\n");
+	} else {
+		ntxmsg++;
+		f->trace.ntx++;
+		f->acct.bytesout += n;
+		if (trace)
+			sendtrace(f, written, rd, sent);
 	}
+	histadd(&pathh[HTEXTIN], monons() - t1);
+	charge(f, t0);
+}
 
-	ftruncate(f->fd[FFILE_STATE], 0);
-	lseek(f->fd[FFILE_STATE], 0, SEEK_SET);
-	dprintf(f->fd[FFILE_STATE], "%s\n", filename);
-	f->rxstate = TRANSFER_PENDING;
-	logmsg(": %s : Rx > Pending %s\n", f->name, filename);
+static void
+sendtrace(struct friend *f, uint64_t written, uint64_t rd, uint64_t sent)
+{
+	uint8_t  pkt[1 + 4 + 3 * 8];
+
+	histadd(&traceh[HPICKUP], rd - written);
+	histadd(&traceh[HQUEUE], sent - rd);
+
+	pkt[0] = PKT_TRACE;
+	pack32(&pkt[1], f->trace.ntx);
+	pack64(&pkt[5], written);
+	pack64(&pkt[13], rd);
+	pack64(&pkt[21], sent);
+	if (!tox_friend_send_lossless_packet(tox, f->num, pkt, sizeof(pkt), NULL))
+		weprintf("Failed to send trace packet\n");
+	else
+		f->acct.bytesout += sizeof(pkt);
 }
 
 static void
-cbfiledata(Tox *m, uint32_t frnum,  uint32_t fnum,  uint32_t fileid,  uint64_t fsz, 
-				const uint8_t *data, size_t len,  void *udata)
+removefriend(struct friend *f)
 {
-	struct   friend *f;
-	ssize_t  n;
-	uint16_t wrote = 0;
+	char c;
 
-	TAILQ_FOREACH(f, &friendhead, entry)
-		if (f->num == frnum)
-			break;
-	if (!f)
+	if (fiforead(f->dirfd, &f->fd[FREMOVE], ffiles[FREMOVE], &c, 1) != 1 || c != '1')
 		return;
+	tox_friend_delete(tox, f->num, NULL);
+	datasave();
+	logmsg(": %s > Removed\n", f->name);
+	frienddestroy(f, 1);
+}
 
-	while (len > 0) {
-		n = write(f->fd[FFILE_OUT], &data[wrote], len);
-		if (n < 0) {
-			if (errno == EPIPE) {
-				cancelrxtransfer(f);
-				break;
-			} else if (errno == EWOULDBLOCK) {
-				continue;
-			}
-			break;
-		} else if (n == 0) {
+/* Returns the fd of one of the friend's static files.  On an fd budget
+ * these live in a small LRU cache instead of being held open forever. */
+static int
+ffileget(struct friend *f, int idx)
+{
+	struct fdent *e, *lru = NULL;
+	int    i, fd;
+
+	if (!fdbudget)
+		return f->fd[idx];
+	if (f->fd[idx] != -1) {
+		fdhits++;
+		f->fdused[idx] = ++fdtick;
+		return f->fd[idx];
+	}
+	fdmisses++;
+
+	if (!fdcache)
+		fdcache = tcalloc(MMISC, fdbudget, sizeof(*fdcache));
+	for (i = 0; i < fdbudget; i++) {
+		e = &fdcache[i];
+		if (!e->f) {
+			lru = e;
 			break;
 		}
-		wrote += n;
-		len -= n;
+		if (!lru || e->f->fdused[e->idx] < lru->f->fdused[lru->idx])
+			lru = e;
+	}
+	if (lru->f) {
+		close(lru->f->fd[lru->idx]);
+		lru->f->fd[lru->idx] = -1;
+	}
+
+	fd = openat(f->dirfd, ffiles[idx].name, ffiles[idx].flags, 0666);
+	if (fd < 0) {
+		weprintf("openat %s:", ffiles[idx].name);
+		lru->f = NULL;
+		return -1;
 	}
+	lru->f = f;
+	lru->idx = idx;
+	f->fd[idx] = fd;
+	f->fdused[idx] = ++fdtick;
+	return fd;
 }
 
+/* Rewrite or append to a static file, a NULL `fmt' just truncates it */
 static void
-canceltxtransfer(struct friend *f)
+ffilewrite(struct friend *f, int idx, const char *fmt, ...)
 {
-	if (f->tx.state == TRANSFER_NONE)
+	va_list  ap;
+	uint64_t t0 = monons();
+	int      fd;
+
+	fd = ffileget(f, idx);
+	if (fd < 0)
 		return;
-	logmsg(": %s : Tx > Cancelling\n", f->name);
-	if (tox_file_control(tox, f->num, 0, TOX_FILE_CONTROL_CANCEL, NULL) < 0)
-		weprintf("Failed to kill Tx transfer\n");
-	f->tx.state = TRANSFER_NONE;
-	free(f->tx.buf);
-	f->tx.buf = NULL;
-	f->tx.lastblock.tv_sec = 0;
-	f->tx.lastblock.tv_nsec = 0;
-	f->tx.cooldown = 0;
-	fiforeset(f->dirfd, &f->fd[FFILE_IN], ffiles[FFILE_IN]);
+	if (ffiles[idx].flags & O_TRUNC) {
+		ftruncate(fd, 0);
+		lseek(fd, 0, SEEK_SET);
+	}
+	if (fmt) {
+		va_start(ap, fmt);
+		vdprintf(fd, fmt, ap);
+		va_end(ap);
+	}
+	histadd(&pathh[idx == FTEXT_OUT ? HTEXTOUT : HSTATIC], monons() - t0);
 }
 
 static void
-cancelrxtransfer(struct friend *f)
+fdcachedrop(struct friend *f)
 {
-	if (f->rxstate == TRANSFER_NONE)
-		return;
-	logmsg(": %s : Rx > Cancelling\n", f->name);
-	if (tox_file_control(tox, f->num, 0, TOX_FILE_CONTROL_CANCEL, NULL) < 0)
-		weprintf("Failed to kill Rx transfer\n");
-	if (f->fd[FFILE_OUT] != -1) {
-		close(f->fd[FFILE_OUT]);
-		f->fd[FFILE_OUT] = -1;
+	int i;
+
+	for (i = 0; fdcache && i < fdbudget; i++) {
+		if (fdcache[i].f != f)
+			continue;
+		close(f->fd[fdcache[i].idx]);
+		f->fd[fdcache[i].idx] = -1;
+		fdcache[i].f = NULL;
 	}
-	ftruncate(f->fd[FFILE_STATE], 0);
-	lseek(f->fd[FFILE_STATE], 0, SEEK_SET);
-	f->rxstate = TRANSFER_NONE;
 }
 
+/* Close the input FIFOs of a friend that has been offline for long.
+ * They stay on disk, writers block until the friend is back. */
 static void
-sendfriendfile(struct friend *f)
+friendidle(struct friend *f)
 {
-	struct  timespec start, now, diff = {0, 0};
-	ssize_t n;
+	int i;
 
-	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < LEN(ffiles); i++) {
+		if (ffiles[i].type != FIFO || i == FREMOVE || f->fd[i] == -1)
+			continue;
+		close(f->fd[i]);
+		f->fd[i] = -1;
+	}
+	f->idle = 1;
+}
 
-	while (diff.tv_sec == 0 && diff.tv_nsec < interval(tox) * 1E6) {
-		/* Attempt to transmit the pending buffer */
-		if (f->tx.pendingbuf) {
-			if (tox_file_send(tox, 
-					f->num, 
-					0,
-					UINT64_MAX,
-					&f->tx.fnum, 
-					f->tx.buf, 				
-					f->tx.n, 
-					NULL) < 0) {
-				clock_gettime(CLOCK_MONOTONIC, &f->tx.lastblock);
-				f->tx.cooldown = 1;
-				break;
-			}
-			f->tx.pendingbuf = 0;
-		}
-		/* Grab another buffer from the FIFO */
-		n = fiforead(f->dirfd, &f->fd[FFILE_IN], ffiles[FFILE_IN], f->tx.buf,
-			     f->tx.chunksz);
-		if (n == 0) {
-			/* Signal transfer completion to other end */
-			if (tox_file_control(tox, f->num, f->tx.fnum,
-						  TOX_FILE_CONTROL_CANCEL, NULL) < 0)
-				weprintf("Failed to signal transfer completion to the receiver\n");
-			f->tx.state = TRANSFER_NONE;
-			break;
-		}
-		if (n < 0) {
-			if (errno != EWOULDBLOCK)
-				weprintf("fiforead:");
-			break;
-		}
-		/* Store transfer size in case we can't send it right now */
-		f->tx.n = n;
-		if (tox_file_send(tox, 
-				f->num, 
-				0,
-				UINT64_MAX,
-				&f->tx.fnum, 
-				f->tx.buf, 				
-				f->tx.n, 
-				NULL) < 0) {
-			clock_gettime(CLOCK_MONOTONIC, &f->tx.lastblock);
-			f->tx.cooldown = 1;
-			f->tx.pendingbuf = 1;
-			return;
+/* Reopen whatever friendidle() or friendhibernate() closed */
+static void
+friendwake(struct friend *f)
+{
+	struct file sf;
+	int    i, r;
+
+	if (f->dirfd == -1) {
+		f->dirfd = open(f->path, O_RDONLY | O_DIRECTORY);
+		if (f->dirfd < 0)
+			eprintf("open %s:", f->path);
+	}
+	for (i = 0; i < LEN(ffiles); i++) {
+		/* file_out is opened when a transfer is accepted */
+		if (f->fd[i] != -1 || i == FFILE_OUT)
+			continue;
+		if (ffiles[i].type == FIFO) {
+			r = mkfifoat(f->dirfd, ffiles[i].name, 0666);
+			if (r < 0 && errno != EEXIST)
+				eprintf("mkfifoat %s:", ffiles[i].name);
+			f->fd[i] = fifoopen(f->dirfd, ffiles[i]);
+		} else if (ffiles[i].type == STATIC && !fdbudget) {
+			/* Keep the last known contents */
+			sf = ffiles[i];
+			sf.flags &= ~O_TRUNC;
+			f->fd[i] = fifoopen(f->dirfd, sf);
 		}
-		clock_gettime(CLOCK_MONOTONIC, &now);
-		diff = timediff(start, now);
+	}
+	f->idle = 0;
+	if (f->dormant) {
+		f->dormant = 0;
+		TAILQ_REMOVE(&dormanthead, f, entry);
+		TAILQ_INSERT_TAIL(&friendhead, f, entry);
+		logmsg(": %s > Revived\n", f->name);
 	}
 }
 
+/* Reduce a long offline friend to its number, key and last known state.
+ * Only text_in and remove stay open, so that writing to either revives
+ * the friend; writers to the other FIFOs block until then. */
 static void
-sendfriendtext(struct friend *f)
+friendhibernate(struct friend *f)
 {
-	ssize_t n;
-	int     r;
-	uint8_t buf[TOX_MAX_MESSAGE_LENGTH];
+	int i, r;
 
-	n = fiforead(f->dirfd, &f->fd[FTEXT_IN], ffiles[FTEXT_IN], buf, sizeof(buf));
-	if (n <= 0)
-		return;
-	if (buf[n - 1] == '\n')
-		n--;
-	r = tox_friend_send_message(tox, f->num, TOX_MESSAGE_TYPE_ACTION, buf, n, NULL);
-	if (r < 0)
-		weprintf("Failed to send message\n");
+	fdcachedrop(f);
+	for (i = 0; i < LEN(ffiles); i++) {
+		if (i == FTEXT_IN || i == FREMOVE) {
+			/* friendidle() may have closed them */
+			if (f->fd[i] != -1)
+				continue;
+			r = mkfifoat(f->dirfd, ffiles[i].name, 0666);
+			if (r < 0 && errno != EEXIST)
+				eprintf("mkfifoat %s:", ffiles[i].name);
+			f->fd[i] = fifoopen(f->dirfd, ffiles[i]);
+			continue;
+		}
+		if (f->fd[i] == -1)
+			continue;
+		close(f->fd[i]);
+		f->fd[i] = -1;
+	}
+	close(f->dirfd);
+	f->dirfd = -1;
+	f->dormant = 1;
+	TAILQ_REMOVE(&friendhead, f, entry);
+	TAILQ_INSERT_TAIL(&dormanthead, f, entry);
+	logmsg(": %s > Dormant\n", f->name);
 }
 
-static void
-removefriend(struct friend *f)
+/* Find a friend by number.  Dormant friends are revived if `wake' is set
+ * and not returned otherwise. */
+static struct friend *
+friendlookup(uint32_t frnum, int wake)
 {
-	char c;
+	struct friend *f;
 
-	if (fiforead(f->dirfd, &f->fd[FREMOVE], ffiles[FREMOVE], &c, 1) != 1 || c != '1')
-		return;
-	tox_friend_delete(tox, f->num, NULL);
-	datasave();
-	logmsg(": %s > Removed\n", f->name);
-	frienddestroy(f);
+	TAILQ_FOREACH(f, &friendhead, entry)
+		if (f->num == frnum)
+			return f;
+	TAILQ_FOREACH(f, &dormanthead, entry) {
+		if (f->num == frnum) {
+			if (!wake)
+				return NULL;
+			friendwake(f);
+			return f;
+		}
+	}
+	return NULL;
 }
 
 static int
@@ -1161,9 +5046,7 @@ reprompt1:
 		return;
 	}
 
-	data = malloc(sz);
-	if (!data)
-		eprintf("malloc:");
+	data = tmalloc(MSAVE, sz);
 
 	if (read(fd, data, sz) != sz)
 		eprintf("read %s:", savefile);
@@ -1189,7 +5072,7 @@ reprompt2:
 			free(passphrase2);
 		}
 	}
-	free(data);
+	tfree(data);
 	close(fd);
 	
 }
@@ -1197,28 +5080,31 @@ reprompt2:
 static void
 datasave(void)
 {
+	char    *path;
 	off_t    sz;
-	int      fd;
+	int      fd, saved = phase;
 	uint8_t *data;
 
-	fd = open(savefile, O_WRONLY | O_TRUNC | O_CREAT , 0666);
+	phase = PSAVE;
+	path = replayfile ? replaysave : savefile;
+	fd = open(path, O_WRONLY | O_TRUNC | O_CREAT , 0666);
 	if (fd < 0)
-		eprintf("open %s:", savefile);
+		eprintf("open %s:", path);
 
 	sz = encryptsavefile ? tox_encrypted_size(tox) : tox_size(tox);
-	data = malloc(sz);
-	if (!data)
-		eprintf("malloc:");
+	data = tmalloc(MSAVE, sz);
+	savesize = sz;
 	if (encryptsavefile)
 		tox_encrypted_save(tox, data, sz);
 	else
 		tox_save(tox, data);
 	if (write(fd, data, sz) != sz)
-		eprintf("write %s:", savefile);
+		eprintf("write %s:", path);
 	fsync(fd);
 
-	free(data);
+	tfree(data);
 	close(fd);
+	phase = saved;
 }
 
 static int
@@ -1317,8 +5203,19 @@ localinit(void)
 static int
 toxinit(void)
 {
+	uint8_t dhtid[TOX_CLIENT_ID_SIZE];
+	char    dhtidstr[2 * TOX_CLIENT_ID_SIZE + 1];
+
 	toxopt.ipv6_enabled = ipv6;
 	toxopt.udp_enabled = udp;
+	toxopt.local_discovery_enabled = localdiscovery || lan;
+	toxopt.hole_punching_enabled = holepunching;
+	toxopt.tcp_port = relay ? relayport : 0;
+	if (lan) {
+		toxopt.start_port = lanstartport;
+		toxopt.end_port = lanendport;
+		logmsg("Net > LAN mode, ports %hu-%hu\n", lanstartport, lanendport);
+	}
 	if (proxy) {
 		udp = 0;
 		toxopt.udp_enabled = udp;
@@ -1331,75 +5228,430 @@ toxinit(void)
 		logmsg("Net > Using proxy %s:%hu\n", proxyaddr, proxyport);
 	}
 
-	tox = tox_new(&toxopt, NULL);
-	if (!tox)
-		eprintf("Core : Tox > Initialization failed\n");
-
-	dataload();
-	datasave();
+	tox = tox_new(&toxopt, NULL);
+	if (!tox)
+		eprintf("Core : Tox > Initialization failed\n");
+
+	if (relay || lan) {
+		/* Others need our DHT key, not our Tox ID, in their
+		 * relays[] and lanpeers[] */
+		tox_self_get_dht_id(tox, dhtid);
+		id2str(dhtid, dhtidstr);
+		logmsg("Net > DHT key %s\n", dhtidstr);
+	}
+	if (relay)
+		logmsg("Net > Serving TCP relay on port %hu\n", relayport);
+
+	dataload();
+	datasave();
+
+	/*toxav = toxav_new(tox, MAXCALLS);
+	if (!toxav)
+		eprintf("Core : ToxAV > Initialization failed\n");
+
+	toxavconfig = av_DefaultSettings;
+	framesize = (toxavconfig.audio_sample_rate * toxavconfig.audio_frame_duration *
+		     toxavconfig.audio_channels) / 1000;*/
+
+	tox_callback_friend_connection_status(tox, cbconnstatus, NULL);
+	tox_callback_friend_message(tox, cbfriendmessage, NULL);
+	tox_callback_friend_request(tox, cbfriendrequest, NULL);
+	tox_callback_friend_name(tox, cbnamechange, NULL);
+	tox_callback_friend_status_message(tox, cbstatusmessage, NULL);
+	tox_callback_friend_status(tox, cbuserstate, NULL);
+	tox_callback_file_recv_control(tox, cbfilecontrol, NULL);
+	tox_callback_file_chunk_request(tox, cbfilesendreq, NULL);
+	tox_callback_file_recv(tox, cbfiledata, NULL);
+	tox_callback_friend_lossless_packet(tox, cblosslesspacket, NULL);
+	tox_callback_self_connection_status(tox, cbselfconnstatus, NULL);
+	tox_callback_friend_lossy_packet(tox, cblossypacket, NULL);
+
+	/*toxav_register_callstate_callback(toxav, cbcallinvite, av_OnInvite, NULL);
+	toxav_register_callstate_callback(toxav, cbcallstart, av_OnStart, NULL);
+	toxav_register_callstate_callback(toxav, cbcallterminate, av_OnEnd, "Ended");
+	toxav_register_callstate_callback(toxav, cbcallterminate, av_OnCancel, "Cancelled");
+	toxav_register_callstate_callback(toxav, cbcallterminate, av_OnReject, "Rejected");
+
+	toxav_register_callstate_callback(toxav, cbcallterminate, av_OnRequestTimeout, "Request timeout");
+	toxav_register_callstate_callback(toxav, cbcallterminate, av_OnPeerTimeout, "Peer timeout");
+	toxav_register_callstate_callback(toxav, cbcalltypechange, av_OnPeerCSChange, NULL);
+	toxav_register_callstate_callback(toxav, cbcalltypechange, av_OnSelfCSChange, NULL);
+
+	toxav_register_audio_callback(toxav, cbcalldata, NULL);*/
+
+	return 0;
+}
+
+static void *
+resolver(void *arg)
+{
+	struct resolve *res;
+	struct addrinfo hints, *ai;
+	char   host[NI_MAXHOST], addr[INET6_ADDRSTRLEN];
+	int    family, r;
+
+	pthread_mutex_lock(&resolvelock);
+	for (;;) {
+		TAILQ_FOREACH(res, &resolvehead, entry)
+			if (res->state == RESOLVE_PENDING)
+				break;
+		if (!res) {
+			pthread_cond_wait(&resolvecond, &resolvelock);
+			continue;
+		}
+		snprintf(host, sizeof(host), "%s", res->host);
+		family = res->family;
+		pthread_mutex_unlock(&resolvelock);
+
+		/* This is the blocking part, keep it outside the lock */
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = family;
+		hints.ai_socktype = SOCK_DGRAM;
+		r = getaddrinfo(host, NULL, &hints, &ai);
+		if (r == 0) {
+			r = getnameinfo(ai->ai_addr, ai->ai_addrlen, addr, sizeof(addr),
+					NULL, 0, NI_NUMERICHOST);
+			freeaddrinfo(ai);
+		}
+
+		pthread_mutex_lock(&resolvelock);
+		if (r == 0) {
+			snprintf(res->addr, sizeof(res->addr), "%s", addr);
+			res->state = RESOLVE_OK;
+			res->expire = time(NULL) + RESOLVETTL;
+		} else {
+			weprintf("Net : %s > Resolution failed: %s\n", host, gai_strerror(r));
+			/* Keep serving a stale address if we had one */
+			res->state = res->addr[0] ? RESOLVE_OK : RESOLVE_FAILED;
+			res->expire = time(NULL) + RESOLVEFAILTTL;
+		}
+	}
+	return NULL;
+}
+
+/* Restrict thread `tid' to the CPUs in `list', or with `whole' set the
+ * calling thread and every thread it starts afterwards */
+static void
+cpupin(const char *who, pthread_t tid, const char *list, int whole)
+{
+#ifdef __linux__
+	cpu_set_t   set;
+	const char *p = list;
+	char       *end;
+	long        lo, hi;
+	int         r;
+
+	CPU_ZERO(&set);
+	for (;;) {
+		lo = strtol(p, &end, 10);
+		if (end == p || lo < 0)
+			goto bad;
+		hi = lo;
+		if (*end == '-') {
+			p = end + 1;
+			hi = strtol(p, &end, 10);
+			if (end == p || hi < lo)
+				goto bad;
+		}
+		if (hi >= CPU_SETSIZE)
+			goto bad;
+		for (; lo <= hi; lo++)
+			CPU_SET(lo, &set);
+		if (*end == '\0')
+			break;
+		if (*end != ',')
+			goto bad;
+		p = end + 1;
+	}
+	if (whole)
+		r = sched_setaffinity(0, sizeof(set), &set) < 0 ? errno : 0;
+	else
+		r = pthread_setaffinity_np(tid, sizeof(set), &set);
+	if (r != 0) {
+		errno = r;
+		weprintf("CPU : %s > Failed to pin to %s:", who, list);
+	}
+	return;
+bad:
+	weprintf("CPU : %s > Invalid CPU list: %s\n", who, list);
+#else
+	weprintf("CPU : %s > CPU affinity is not supported\n", who);
+#endif
+}
+
+/* Pin the whole process first, so that helper threads inherit it */
+static void
+threadinit(void)
+{
+	threads[TMAIN].tid = pthread_self();
+	threads[TMAIN].started = 1;
+	if (cpuprocess)
+		cpupin("process", threads[TMAIN].tid, cpuprocess, 1);
+}
+
+/* Start a detached helper thread for `role' */
+static void
+threadstart(int role, void *(*fn)(void *))
+{
+	struct thread *t = &threads[role];
+	sigset_t set, oset;
+	int      r;
+
+	/* Signals are for the main thread only */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &oset);
+	r = pthread_create(&t->tid, NULL, fn, NULL);
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	if (r != 0) {
+		errno = r;
+		eprintf("pthread_create:");
+	}
+	pthread_detach(t->tid);
+	t->started = 1;
+	if (**t->cpus)
+		cpupin(t->name, t->tid, *t->cpus, 0);
+}
+
+static void
+resolverinit(void)
+{
+	threadstart(TRESOLVER, resolver);
+}
+
+static size_t
+countfds(void)
+{
+	struct dirent *de;
+	DIR   *d;
+	size_t n = 0;
+	int    fd;
+
+	d = opendir("/proc/self/fd");
+	if (d) {
+		while ((de = readdir(d)))
+			n += de->d_name[0] != '.';
+		closedir(d);
+		/* Do not count the fd of the directory itself */
+		return n - 1;
+	}
+	for (fd = 0; fd < sysconf(_SC_OPEN_MAX); fd++)
+		n += fcntl(fd, F_GETFD) != -1;
+	return n;
+}
+
+/* SIGUSR1 handler, runs on the main thread at the watchdog's request.
+ * Whichever of the two takes btfd first closes it. */
+static void
+backtracedump(int sig)
+{
+	int   fd = __sync_lock_test_and_set(&btfd, -1);
+#ifdef __GLIBC__
+	void *bt[64];
+
+	if (fd >= 0)
+		backtrace_symbols_fd(bt, backtrace(bt, LEN(bt)), fd);
+#endif
+	if (fd >= 0)
+		close(fd);
+	btdone = 1;
+}
+
+static void
+stalldump(struct snapshot *s, int ph, uint64_t ns)
+{
+	struct resolve *res;
+	size_t npending = 0;
+	int    fd, i;
+
+	pthread_mutex_lock(&resolvelock);
+	TAILQ_FOREACH(res, &resolvehead, entry)
+		npending += res->state == RESOLVE_PENDING;
+	pthread_mutex_unlock(&resolvelock);
+
+	fd = open("stall.tmp", O_WRONLY | O_TRUNC | O_CREAT, 0666);
+	if (fd < 0) {
+		weprintf("open %s:", "stall.tmp");
+		return;
+	}
+	dprintf(fd, "time %lu\n", (unsigned long)time(NULL));
+	dprintf(fd, "stalled.ms %llu\n", (unsigned long long)ns / 1000000);
+	dprintf(fd, "phase %s\n", phases[ph]);
+	dprintf(fd, "iteration %llu\n", (unsigned long long)s->iter);
+	dprintf(fd, "friends %zu\n", s->nfriends);
+	dprintf(fd, "friends.online %zu\n", s->nonline);
+	dprintf(fd, "friends.dormant %zu\n", s->ndormant);
+	dprintf(fd, "requests %zu\n", s->nreqs);
+	dprintf(fd, "xfer.tx.active %zu\n", s->ntx);
+	dprintf(fd, "xfer.rx.active %zu\n", s->nrx);
+	dprintf(fd, "resolve.pending %zu\n", npending);
+	dprintf(fd, "fd.poll %zu\n", s->npfds);
+	dprintf(fd, "fd.open %zu\n", countfds());
+	dprintf(fd, "backtrace\n");
+
+	btdone = 0;
+	btfd = fd;
+	pthread_kill(threads[TMAIN].tid, SIGUSR1);
+	for (i = 0; i < 100 && !btdone; i++)
+		usleep(10000);
+	/* Unless the handler got to it, it never will */
+	if (__sync_bool_compare_and_swap(&btfd, fd, -1)) {
+		dprintf(fd, "timed out\n");
+		close(fd);
+	}
+
+	if (rename("stall.tmp", "stall") < 0)
+		weprintf("rename %s:", "stall");
+	logmsg("Watchdog > Loop stalled for %llu ms in %s\n",
+	       (unsigned long long)ns / 1000000, phases[ph]);
+}
+
+static void *
+watchdog(void *arg)
+{
+	struct snapshot s;
+	uint64_t last = 0, now;
+	int      ph;
+
+	for (;;) {
+		sleep(1);
+		pthread_mutex_lock(&wdlock);
+		s = wdsnap;
+		pthread_mutex_unlock(&wdlock);
+		ph = phase;
+		now = monons();
+		/* Waiting in poll() is not a stall, and report each
+		 * stalled iteration only once */
+		if (ph == PPOLL || s.iter == last)
+			continue;
+		if (now - s.start < STALLDELAY * 1000000000ULL)
+			continue;
+		last = s.iter;
+		stalldump(&s, ph, now - s.start);
+		pthread_mutex_lock(&wdlock);
+		nstalls++;
+		pthread_mutex_unlock(&wdlock);
+	}
+	return NULL;
+}
+
+static void
+watchdoginit(void)
+{
+	struct sigaction sa;
+#ifdef __GLIBC__
+	void *bt[1];
+#endif
 
-	/*toxav = toxav_new(tox, MAXCALLS);
-	if (!toxav)
-		eprintf("Core : ToxAV > Initialization failed\n");
+	if (STALLDELAY == 0)
+		return;
+#ifdef __GLIBC__
+	/* The first call loads libgcc, do it now rather than in
+	 * the signal handler */
+	backtrace(bt, LEN(bt));
+#endif
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = backtracedump;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+
+	wdsnap.start = monons();
+	threadstart(TWATCHDOG, watchdog);
+}
 
-	toxavconfig = av_DefaultSettings;
-	framesize = (toxavconfig.audio_sample_rate * toxavconfig.audio_frame_duration *
-		     toxavconfig.audio_channels) / 1000;*/
+/* Never blocks: returns 0 and a numeric address in `addr' if we have one
+ * for `host', otherwise queues a lookup for the resolver thread and
+ * returns -1 */
+static int
+resolve(const char *host, char *addr, size_t sz)
+{
+	struct  resolve *res;
+	struct  in6_addr in6;
+	int     r = -1;
 
-	tox_callback_friend_connection_status(tox, cbconnstatus, NULL);
-	tox_callback_friend_message(tox, cbfriendmessage, NULL);
-	tox_callback_friend_request(tox, cbfriendrequest, NULL);
-	tox_callback_friend_name(tox, cbnamechange, NULL);
-	tox_callback_friend_status_message(tox, cbstatusmessage, NULL);
-	tox_callback_friend_status(tox, cbuserstate, NULL);
-	tox_callback_file_recv_control(tox, cbfilecontrol, NULL);
-	tox_callback_file_chunk_request(tox, cbfilesendreq, NULL);
-	tox_callback_file_recv(tox, cbfiledata, NULL);
+	if (inet_pton(AF_INET, host, &in6) == 1 || inet_pton(AF_INET6, host, &in6) == 1) {
+		snprintf(addr, sz, "%s", host);
+		return 0;
+	}
 
-	/*toxav_register_callstate_callback(toxav, cbcallinvite, av_OnInvite, NULL);
-	toxav_register_callstate_callback(toxav, cbcallstart, av_OnStart, NULL);
-	toxav_register_callstate_callback(toxav, cbcallterminate, av_OnEnd, "Ended");
-	toxav_register_callstate_callback(toxav, cbcallterminate, av_OnCancel, "Cancelled");
-	toxav_register_callstate_callback(toxav, cbcallterminate, av_OnReject, "Rejected");
+	pthread_mutex_lock(&resolvelock);
+	TAILQ_FOREACH(res, &resolvehead, entry)
+		if (!strcmp(res->host, host))
+			break;
+	if (!res) {
+		res = tcalloc(MRESOLVE, 1, sizeof(*res));
+		res->host = tstrdup(MRESOLVE, host);
+		res->family = ipv6 ? AF_UNSPEC : AF_INET;
+		res->state = RESOLVE_PENDING;
+		TAILQ_INSERT_TAIL(&resolvehead, res, entry);
+		pthread_cond_signal(&resolvecond);
+	} else if (res->state != RESOLVE_PENDING && time(NULL) >= res->expire) {
+		res->state = RESOLVE_PENDING;
+		pthread_cond_signal(&resolvecond);
+	}
+	if (res->addr[0]) {
+		snprintf(addr, sz, "%s", res->addr);
+		r = 0;
+	}
+	pthread_mutex_unlock(&resolvelock);
 
-	toxav_register_callstate_callback(toxav, cbcallterminate, av_OnRequestTimeout, "Request timeout");
-	toxav_register_callstate_callback(toxav, cbcallterminate, av_OnPeerTimeout, "Peer timeout");
-	toxav_register_callstate_callback(toxav, cbcalltypechange, av_OnPeerCSChange, NULL);
-	toxav_register_callstate_callback(toxav, cbcalltypechange, av_OnSelfCSChange, NULL);
+	return r;
+}
 
-	toxav_register_audio_callback(toxav, cbcalldata, NULL);*/
+/* Bootstrap from `n', or add it as a TCP relay */
+static void
+nodeadd(struct node *n, int tcprelay)
+{
+	int     r;
+	char   *host, addr[INET6_ADDRSTRLEN];
+	uint8_t id[TOX_CLIENT_ID_SIZE];
 
-	return 0;
+	host = ipv6 && n->addr6 ? n->addr6 : n->addr4;
+	/* Hostnames are skipped until the resolver has an answer */
+	if (!host || resolve(host, addr, sizeof(addr)) < 0)
+		return;
+	str2id(n->idstr, id);
+	if (tcprelay) {
+		r = tox_add_tcp_relay(tox, addr, n->port, id, NULL);
+		if (r == 0)
+			weprintf("Net : %s > Adding TCP relay failed\n", host);
+	} else {
+		r = tox_bootstrap(tox, addr, n->port, id, NULL);
+		if (r == 0)
+			weprintf("Net : %s > Bootstrap failed\n", host);
+	}
 }
 
 static int
 toxconnect(void)
 {
-	struct  node *n;
 	struct  node tmp;
 	size_t  i, j;
-	int     r;
-	uint8_t id[TOX_CLIENT_ID_SIZE];
 
-	srand(time(NULL));
+	/* Known peers on the LAN go first, they are the fastest way in */
+	for (i = 0; lan && lanpeers[i].addr4; i++)
+		nodeadd(&lanpeers[i], 0);
 
-	/* shuffle it to minimize load on nodes */
-	for (i = LEN(nodes) - 1; i > 0; i--) {
-		j = rand() % LEN(nodes);
-		tmp = nodes[j];
-		nodes[j] = nodes[i];
-		nodes[i] = tmp;
-	}
+	if (!lan || lanpublic || !lanpeers[0].addr4) {
+		srand(time(NULL));
 
-	for (i = 0; i < LEN(nodes); i++) {
-		n = &nodes[i];
-		if (ipv6 && !n->addr6)
-			continue;
-		str2id(n->idstr, id);
-		r = tox_bootstrap(tox, ipv6 ? n->addr6 : n->addr4, n->port, id, NULL);
-		if (r == 0)
-			weprintf("Net : %s > Bootstrap failed\n", ipv6 ? n->addr6 : n->addr4);
+		/* shuffle it to minimize load on nodes */
+		for (i = LEN(nodes) - 1; i > 0; i--) {
+			j = rand() % LEN(nodes);
+			tmp = nodes[j];
+			nodes[j] = nodes[i];
+			nodes[i] = tmp;
+		}
+
+		for (i = 0; i < LEN(nodes); i++) {
+			if (ipv6 && !nodes[i].addr6)
+				continue;
+			nodeadd(&nodes[i], 0);
+		}
 	}
+
+	for (i = 0; relays[i].addr4; i++)
+		nodeadd(&relays[i], 1);
 	return 0;
 }
 
@@ -1428,18 +5680,103 @@ str2id(char *idstr, uint8_t *id)
 		sscanf(p, "%2hhx", &id[i]);
 }
 
+/* Remove the shard directories above a friend's that are empty now */
+static void
+shardprune(const char *idstr)
+{
+	char dir[PATH_MAX];
+
+	snprintf(dir, sizeof(dir), "friends/%.2s/%.2s", idstr, idstr + 2);
+	if (rmdir(dir) < 0)
+		return;
+	snprintf(dir, sizeof(dir), "friends/%.2s", idstr);
+	if (rmdir(dir) < 0)
+		return;
+	rmdir("friends");
+}
+
+/* Set up the friend's directory, either flat in the base directory or
+ * sharded as friends/AB/CD/<id> by the first two bytes of the key.
+ * Directories are moved over from the other layout either way. */
+static void
+frienddir(struct friend *f)
+{
+	struct stat st;
+	char   dir[sizeof(f->path)];
+	int    r;
+
+	if (!shard) {
+		snprintf(f->path, sizeof(f->path), "%s", f->idstr);
+		snprintf(dir, sizeof(dir), "friends/%.2s/%.2s/%s", f->idstr,
+			 f->idstr + 2, f->idstr);
+		if (lstat(dir, &st) == 0 && S_ISDIR(st.st_mode)) {
+			/* Drop the link shardlinks left in its place */
+			if (lstat(f->path, &st) == 0 && S_ISLNK(st.st_mode))
+				unlink(f->path);
+			if (rename(dir, f->path) < 0)
+				weprintf("rename %s:", dir);
+			shardprune(f->idstr);
+		}
+		r = mkdir(f->path, 0777);
+		if (r < 0 && errno != EEXIST)
+			eprintf("mkdir %s:", f->path);
+		return;
+	}
+
+	snprintf(dir, sizeof(dir), "friends");
+	r = mkdir(dir, 0777);
+	if (r < 0 && errno != EEXIST)
+		eprintf("mkdir %s:", dir);
+	snprintf(dir, sizeof(dir), "friends/%.2s", f->idstr);
+	r = mkdir(dir, 0777);
+	if (r < 0 && errno != EEXIST)
+		eprintf("mkdir %s:", dir);
+	snprintf(dir, sizeof(dir), "friends/%.2s/%.2s", f->idstr, f->idstr + 2);
+	r = mkdir(dir, 0777);
+	if (r < 0 && errno != EEXIST)
+		eprintf("mkdir %s:", dir);
+	snprintf(f->path, sizeof(f->path), "%s/%s", dir, f->idstr);
+
+	/* Carry over a directory from the flat layout */
+	if (lstat(f->idstr, &st) == 0 && S_ISDIR(st.st_mode)) {
+		if (rename(f->idstr, f->path) < 0)
+			weprintf("rename %s:", f->idstr);
+	}
+	r = mkdir(f->path, 0777);
+	if (r < 0 && errno != EEXIST)
+		eprintf("mkdir %s:", f->path);
+
+	if (shardlinks) {
+		r = symlink(f->path, f->idstr);
+		if (r < 0 && errno != EEXIST)
+			weprintf("symlink %s:", f->idstr);
+	}
+}
+
 static struct friend *
 friendcreate(int32_t frnum)
 {
 	struct  friend *f;
-	DIR    *d;
 	size_t  i;
 	size_t     r;
+	int     fd;
+	char    c;
 	uint8_t status[TOX_MAX_STATUS_MESSAGE_LENGTH + 1];
-
-	f = calloc(1, sizeof(*f));
-	if (!f)
-		eprintf("calloc:");
+	char    clean[UTF8CLEANSZ(TOX_MAX_STATUS_MESSAGE_LENGTH)];
+
+	f = tcalloc(MFRIEND, 1, sizeof(*f));
+	f->tx.src = -1;
+	/* Both coroutines set up their first wait right away */
+	f->co[CTX].run = txrun;
+	f->co[CRX].run = rxrun;
+	for (i = 0; i < LEN(f->co); i++) {
+		f->co[i].arg = f;
+		crready(&f->co[i]);
+	}
+	TAILQ_INIT(&f->queue);
+	TAILQ_INIT(&f->dqueue);
+	TAILQ_INIT(&f->shares);
+	TAILQ_INIT(&f->serving);
 
 	r = tox_friend_get_name_size(tox, frnum, NULL) ;//(uint8_t *)f->name);
 	if (r < 0) {
@@ -1455,36 +5792,47 @@ friendcreate(int32_t frnum)
 	tox_friend_get_public_key(tox, f->num, f->id, NULL);
 	id2str(f->id, f->idstr);
 
-	r = mkdir(f->idstr, 0777);
-	if (r < 0 && errno != EEXIST)
-		eprintf("mkdir %s:", f->idstr);
+	frienddir(f);
 
-	d = opendir(f->idstr);
-	if (!d)
-		eprintf("opendir %s:", f->idstr);
+	f->dirfd = open(f->path, O_RDONLY | O_DIRECTORY);
+	if (f->dirfd < 0)
+		eprintf("open %s:", f->path);
 
-	r = dirfd(d);
-	if (r < 0)
-		eprintf("dirfd %s:", f->idstr);
-	f->dirfd = r;
+	/* Subscription to sync/ from the last run */
+	fd = openat(f->dirfd, ffiles[FSYNC].name, O_RDONLY);
+	if (fd >= 0) {
+		if (read(fd, &c, 1) == 1)
+			f->syncsub = c == '1';
+		close(fd);
+	}
 
+	/* On an fd budget static files are opened on demand */
 	for (i = 0; i < LEN(ffiles); i++) {
 		f->fd[i] = -1;
 		if (ffiles[i].type == FIFO) {
 			fiforeset(f->dirfd, &f->fd[i], ffiles[i]);
-		} else if (ffiles[i].type == STATIC) {
+		} else if (ffiles[i].type == STATIC && !fdbudget) {
 			f->fd[i] = fifoopen(f->dirfd, ffiles[i]);
+		} else if (ffiles[i].type == FOLDER) {
+			if (mkdirat(f->dirfd, ffiles[i].name, 0777) < 0 && errno != EEXIST)
+				eprintf("mkdirat %s:", ffiles[i].name);
 		}
 	}
 
 	/* Dump name */
-	ftruncate(f->fd[FNAME], 0);
-	dprintf(f->fd[FNAME], "%s\n", f->name);
+	ffilewrite(f, FNAME, "%s\n", f->name);
+	ffilewrite(f, FSYNC, "%d\n", f->syncsub);
+
+	queueload(f);
 
 	/* Dump online state */
-	ftruncate(f->fd[FONLINE], 0);
-	dprintf(f->fd[FONLINE], "%d\n",
-		tox_friend_get_status(tox, frnum, NULL));
+	r = tox_friend_get_connection_status(tox, frnum, NULL);
+	f->conn = r;
+	f->link = r;
+	linkevent(f, r);
+	if (r == TOX_CONNECTION_NONE)
+		f->offsince = time(NULL);
+	ffilewrite(f, FONLINE, "%d\n", (int)r);
 
 	/* Dump status */
 	r = tox_friend_get_status_message_size(tox, frnum, NULL);
@@ -1495,9 +5843,8 @@ friendcreate(int32_t frnum)
 	} else if (r > sizeof(status) - 1) {
 		r = sizeof(status) - 1;
 	}
-	status[r] = '\0';
-	ftruncate(f->fd[FSTATUS], 0);
-	dprintf(f->fd[FSTATUS], "%s\n", status);
+	utf8clean(clean, status, r);
+	ffilewrite(f, FSTATUS, "%s\n", clean);
 
 	/* Dump user state */
 	r = tox_friend_get_status(tox, frnum, NULL);
@@ -1506,12 +5853,11 @@ friendcreate(int32_t frnum)
 	} else if (r >= LEN(ustate)) {
 		weprintf(": %s : State : %d > Invalid\n", f->name, r);
 	} else {
-		ftruncate(f->fd[FSTATE], 0);
-		dprintf(f->fd[FSTATE], "%s\n", ustate[r]);
+		ffilewrite(f, FSTATE, "%s\n", ustate[r]);
 	}
 
 	/* Dump file pending state */
-	ftruncate(f->fd[FFILE_STATE], 0);
+	ffilewrite(f, FFILE_STATE, NULL);
 
 	/* Dump call pending state */
 //	ftruncate(f->fd[FCALL_STATE], 0);
@@ -1525,24 +5871,60 @@ friendcreate(int32_t frnum)
 	return f;
 }
 
+/* With `rm' unset a non-empty queue is kept for the next run */
 static void
-frienddestroy(struct friend *f)
+frienddestroy(struct friend *f, int rm)
 {
-	int i;
+	struct qent *q;
+	struct share *sh;
+	int i, keep;
 
 	canceltxtransfer(f);
 	cancelrxtransfer(f);
+	for (i = 0; i < LEN(f->co); i++)
+		crdrop(&f->co[i]);
+	deltatxstop(f, 0);
+	deltarxstop(f, 1);
+	while ((sh = TAILQ_FIRST(&f->shares)))
+		sharedrop(f, sh);
 	//if (f->av.num != -1 && toxav_get_call_state(toxav, f->av.num) != av_CallNonExistent)
 		//cancelcall(f, "Destroying"); /* todo: check state */
+	fdcachedrop(f);
+	if (f->dirfd == -1)
+		f->dirfd = open(f->path, O_RDONLY | O_DIRECTORY);
+	keep = !rm && !TAILQ_EMPTY(&f->queue);
+	while ((q = TAILQ_FIRST(&f->queue))) {
+		TAILQ_REMOVE(&f->queue, q, entry);
+		tfree(q->path);
+		tfree(q);
+		nqueued--;
+	}
+	while ((q = TAILQ_FIRST(&f->dqueue))) {
+		TAILQ_REMOVE(&f->dqueue, q, entry);
+		tfree(q->path);
+		tfree(q);
+	}
+	/* Received delta files keep their folder, the sync subscription
+	 * is kept for the next run */
 	for (i = 0; i < LEN(ffiles); i++) {
-		if (f->dirfd != -1) {
-			unlinkat(f->dirfd, ffiles[i].name, 0);
-			if (f->fd[i] != -1)
-				close(f->fd[i]);
-		}
+		if (f->dirfd != -1 && !(keep && i == FQUEUE) && !(!rm && i == FSYNC))
+			unlinkat(f->dirfd, ffiles[i].name,
+				 ffiles[i].type == FOLDER ? AT_REMOVEDIR : 0);
+		if (f->fd[i] != -1)
+			close(f->fd[i]);
 	}
-	rmdir(f->idstr);
-	TAILQ_REMOVE(&friendhead, f, entry);
+	if (f->dirfd != -1)
+		close(f->dirfd);
+	rmdir(f->path);
+	if (shard)
+		shardprune(f->idstr);
+	if (shard && shardlinks)
+		unlink(f->idstr);
+	if (f->dormant)
+		TAILQ_REMOVE(&dormanthead, f, entry);
+	else
+		TAILQ_REMOVE(&friendhead, f, entry);
+	tfree(f);
 }
 
 static void
@@ -1553,16 +5935,15 @@ friendload(void)
 	uint32_t *frnums;
 
 	sz = tox_self_get_friend_list_size(tox);
-	frnums = malloc(sz * sizeof(*frnums));
-	if (!frnums)
-		eprintf("malloc:");
+	frnums = tcalloc(MMISC, sz, sizeof(*frnums));
 
 	tox_self_get_friend_list(tox, frnums);
 
 	for (i = 0; i < sz; i++)
 		friendcreate(frnums[i]);
+	queueout();
 
-	free(frnums);
+	tfree(frnums);
 }
 
 static void
@@ -1703,6 +6084,136 @@ out:
 	logmsg("Request > Sent\n");
 }
 
+/* Each line is "<friend id> <priority> <path>", lower priorities go first */
+static void
+setqueue(void *data)
+{
+	static char   buf[PIPE_BUF * 2];
+	static size_t len;
+	struct friend *f;
+	struct stat st;
+	ssize_t n;
+	char   *line, *nl, *p, *path;
+	long    prio;
+
+	n = fiforead(gslots[QUEUE].dirfd, &gslots[QUEUE].fd[IN], gfiles[IN],
+		     buf + len, sizeof(buf) - len - 1);
+	if (n <= 0)
+		return;
+	len += n;
+	buf[len] = '\0';
+
+	ftruncate(gslots[QUEUE].fd[ERR], 0);
+	lseek(gslots[QUEUE].fd[ERR], 0, SEEK_SET);
+	for (line = buf; (nl = strchr(line, '\n')); line = nl + 1) {
+		*nl = '\0';
+		p = strchr(line, ' ');
+		if (!p || p - line != 2 * TOX_CLIENT_ID_SIZE) {
+			dprintf(gslots[QUEUE].fd[ERR], "Invalid friend ID\n");
+			continue;
+		}
+		*p++ = '\0';
+		prio = strtol(p, &path, 10);
+		if (path == p || *path != ' ' || path[1] == '\0') {
+			dprintf(gslots[QUEUE].fd[ERR], "Expected <id> <priority> <path>\n");
+			continue;
+		}
+		path++;
+		TAILQ_FOREACH(f, &friendhead, entry)
+			if (!strcasecmp(f->idstr, line))
+				break;
+		if (!f) {
+			TAILQ_FOREACH(f, &dormanthead, entry)
+				if (!strcasecmp(f->idstr, line))
+					break;
+		}
+		if (!f) {
+			dprintf(gslots[QUEUE].fd[ERR], "No such friend: %s\n", line);
+			continue;
+		}
+		if (access(path, R_OK) < 0 || stat(path, &st) < 0) {
+			dprintf(gslots[QUEUE].fd[ERR], "%s: %s\n", path, strerror(errno));
+			continue;
+		}
+		if (!S_ISREG(st.st_mode)) {
+			dprintf(gslots[QUEUE].fd[ERR], "%s: Not a regular file\n", path);
+			continue;
+		}
+		queueadd(f, prio, path);
+		queuedump(f);
+		queuedue = 1;
+		logmsg(": %s : Queue > %s\n", f->name, path);
+	}
+	/* Keep a partial line for the next read, drop overlong ones */
+	len = strlen(line);
+	if (len >= sizeof(buf) - PIPE_BUF)
+		len = 0;
+	memmove(buf, line, len);
+	queueout();
+}
+
+/* Each line is "<hash> <id>[,<id>...] <name>", the file is fetched in
+ * chunks from every listed friend that has it in their sync/ */
+static void
+setswarm(void *data)
+{
+	struct swarm  *s;
+	struct friend *f;
+	ssize_t n;
+	size_t  nsrc = 1;
+	char    buf[PIPE_BUF], *ids, *name, *id, *p;
+
+	n = fiforead(gslots[SWARM].dirfd, &gslots[SWARM].fd[IN], gfiles[IN],
+		     buf, sizeof(buf) - 1);
+	if (n <= 0)
+		return;
+	buf[n] = '\0';
+	if ((p = strchr(buf, '\n')))
+		*p = '\0';
+
+	ftruncate(gslots[SWARM].fd[ERR], 0);
+	lseek(gslots[SWARM].fd[ERR], 0, SEEK_SET);
+	ids = strchr(buf, ' ');
+	name = ids ? strchr(ids + 1, ' ') : NULL;
+	if (!name || ids - buf != 2 * crypto_generichash_BYTES ||
+	    !relpathok(name + 1, 1) || strlen(name + 1) > NAME_MAX) {
+		dprintf(gslots[SWARM].fd[ERR], "Expected <hash> <id>[,<id>...] <name>\n");
+		return;
+	}
+	*ids++ = '\0';
+	*name++ = '\0';
+	for (p = ids; *p; p++)
+		nsrc += *p == ',';
+
+	s = tcalloc(MXFER, 1, sizeof(*s));
+	str2id(buf, s->hash);
+	s->src = tcalloc(MXFER, nsrc, sizeof(*s->src));
+	for (id = strtok(ids, ","); id; id = strtok(NULL, ",")) {
+		TAILQ_FOREACH(f, &friendhead, entry)
+			if (!strcasecmp(f->idstr, id))
+				break;
+		if (!f) {
+			dprintf(gslots[SWARM].fd[ERR], "No such friend: %s\n", id);
+			continue;
+		}
+		if (swarmsource(s, f->num))
+			continue;
+		s->src[s->nsrc++].frnum = f->num;
+	}
+	if (!s->nsrc) {
+		tfree(s->src);
+		tfree(s);
+		return;
+	}
+	s->sid = ++swarmsid;
+	s->name = tstrdup(MXFER, name);
+	s->fd = -1;
+	s->start = monons();
+	s->seen = time(NULL);
+	TAILQ_INSERT_TAIL(&swarmhead, s, entry);
+	logmsg("Swarm > %s from %zu friends\n", name, s->nsrc);
+}
+
 static void
 setnospam(void *data)
 {
@@ -1744,165 +6255,294 @@ end:
 	fiforeset(gslots[NOSPAM].dirfd, &gslots[NOSPAM].fd[IN], gfiles[IN]);
 }
 
+/* Watch sync/ and send what is in it to subscribed friends */
+static void
+syncinit(void)
+{
+	int r;
+
+	if (!syncfolder)
+		return;
+	r = mkdir("sync", 0777);
+	if (r < 0 && errno != EEXIST)
+		eprintf("mkdir %s:", "sync");
+#ifdef __linux__
+	syncfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (syncfd < 0)
+		weprintf("inotify_init1:");
+#endif
+	syncsince = time(NULL);
+	syncwalk("", NULL, 1);
+}
+
+static void
+recordinit(void)
+{
+	char magic[sizeof(RECMAGIC) - 1];
+
+	recstart = monons();
+	if (recfile) {
+		recfp = fopen(recfile, "w");
+		if (!recfp)
+			eprintf("fopen %s:", recfile);
+		if (fwrite(RECMAGIC, 1, sizeof(magic), recfp) != sizeof(magic))
+			eprintf("fwrite %s:", recfile);
+		logmsg("Record > %s\n", recfile);
+	}
+	if (replayfile) {
+		replayfp = fopen(replayfile, "r");
+		if (!replayfp)
+			eprintf("fopen %s:", replayfile);
+		if (fread(magic, 1, sizeof(magic), replayfp) != sizeof(magic) ||
+		    memcmp(magic, RECMAGIC, sizeof(magic)))
+			eprintf("Replay : %s > Not an event record\n", replayfile);
+	}
+}
+
+static void
+pfdadd(int fd)
+{
+	struct pollfd *p;
+
+	if (npfds == pfdcap) {
+		p = tcalloc(MMISC, pfdcap ? 2 * pfdcap : 64, sizeof(*p));
+		if (npfds)
+			memcpy(p, pfds, npfds * sizeof(*p));
+		tfree(pfds);
+		pfds = p;
+		pfdcap = pfdcap ? 2 * pfdcap : 64;
+	}
+	pfds[npfds].fd = fd;
+	pfds[npfds].events = POLLIN;
+	pfds[npfds].revents = 0;
+	npfds++;
+}
+
+/* Mark the fds poll() returned, a hang up counts as readable as it does
+ * for select() */
+static void
+pfdready(int fdmax)
+{
+	size_t i;
+
+	if (fdmax >= fdreadycap) {
+		tfree(fdready);
+		fdreadycap = 2 * (fdmax + 1);
+		fdready = tcalloc(MMISC, fdreadycap, 1);
+	}
+	memset(fdready, 0, fdmax + 1);
+	for (i = 0; i < npfds; i++)
+		if (pfds[i].revents)
+			fdready[pfds[i].fd] = 1;
+}
+
 static void
 loop(void)
 {
 	struct file reqfifo;
 	struct friend *f, *ftmp;
 	struct request *req, *rtmp;
-	struct timespec curtime, diff;
-	struct timeval tv;
-	fd_set rfds;
-	time_t t0, t1;
-	int    connected = 0, i, n, r, fd, fdmax;
-	char   tstamp[64], c;
-
-	t0 = time(NULL);
-	logmsg("DHT > Connecting\n");
-	toxconnect();
-	int ctest = 0;
+	struct coro *co, *colast;
+	struct snapshot snap = { 0 };
+	uint64_t treq, t;
+	time_t tstats, tstart, now;
+	int    i, n, r, fdmax, timeout;
+	char   c;
+
+	tstart = time(NULL);
+	tstats = tstart;
+	selfsince = tstart;
+	if (replayfp) {
+		logmsg("Replay > %s, saving to %s\n", replayfile, replaysave);
+	} else {
+		bootat = tstart;
+		logmsg("DHT > Connecting\n");
+		toxconnect();
+	}
 	while (running) {
-		/* Handle connection states */
-		if (tox_self_get_connection_status(tox)) {
-			if (!connected) {
-				logmsg("DHT > Connected\n");
-				TAILQ_FOREACH(f, &friendhead, entry) {
-					canceltxtransfer(f);
-					cancelrxtransfer(f);
-				}
-				connected = 1;
-			}
-			ctest++;
-			if(ctest>3600){
-				connected = 0;
-				ctest = 0;
-			}
+		phase = PCONNECT;
+		selfconnstep(time(NULL));
+		if (replayfp) {
+			phase = PREPLAY;
+			timeout = replaystep();
+			if (timeout < 0)
+				break;
 		} else {
-			if (connected) {
-				logmsg("DHT > Disconnected\n");
-				connected = 0;
-			}
-			t1 = time(NULL);
-			if (t1 > t0 + CONNECTDELAY) {
-				t0 = time(NULL);
-				logmsg("DHT > Connecting\n");
-				toxconnect();
+			phase = PITERATE;
+			tox_iterate(tox);
+			timeout = interval(tox);
+		}
+
+		if (time(NULL) >= tstats + STATSDELAY) {
+			phase = PSTATS;
+			tstats = time(NULL);
+			driftcheck(tstats - tstart);
+			for (f = TAILQ_FIRST(&friendhead); f; f = ftmp) {
+				ftmp = TAILQ_NEXT(f, entry);
+				if (PINGDELAY && f->conn != TOX_CONNECTION_NONE &&
+				    monons() - f->lnk.pingat >= PINGDELAY * 1000000000ULL)
+					sendping(f);
+				if (f->lnk.dirty)
+					linkdump(f);
+				if (f->tx.state != TRANSFER_NONE || f->rxstate != TRANSFER_NONE)
+					continue;
+				if (f->link != TOX_CONNECTION_NONE)
+					continue;
+				if (hibernate && tstats >= f->offsince + HIBERNATEDELAY)
+					friendhibernate(f);
+				else if (fdbudget && !f->idle && tstats >= f->offsince + IDLEDELAY)
+					friendidle(f);
 			}
+			statsdump();
+			topdump();
 		}
-		tox_iterate(tox);
 
-		/* Prepare select-fd-set */
-		FD_ZERO(&rfds);
+		/* Prepare the poll set */
+		npfds = 0;
 		fdmax = -1;
 
+		snap.nfriends = snap.nonline = snap.ndormant = 0;
+		snap.nreqs = snap.ntx = snap.nrx = 0;
+
 		for (i = 0; i < LEN(gslots); i++)
 			FD_APPEND(gslots[i].fd[IN]);
+		if (syncfd != -1)
+			FD_APPEND(syncfd);
 
-		TAILQ_FOREACH(req, &reqhead, entry)
+		TAILQ_FOREACH(req, &reqhead, entry) {
 			FD_APPEND(req->fd);
+			snap.nreqs++;
+		}
+
+		TAILQ_FOREACH(f, &dormanthead, entry) {
+			FD_APPEND(f->fd[FTEXT_IN]);
+			FD_APPEND(f->fd[FREMOVE]);
+			snap.ndormant++;
+		}
 
 		TAILQ_FOREACH(f, &friendhead, entry) {
-			/* File transfer cooldown */
-			if (f->tx.cooldown) {
-				clock_gettime(CLOCK_MONOTONIC, &curtime);
-				diff = timediff(f->tx.lastblock, curtime);
-
-				if (diff.tv_sec > 0 || diff.tv_nsec > interval(tox) * 3 * 1E6) {
-					f->tx.lastblock.tv_sec = 0;
-					f->tx.lastblock.tv_nsec = 0;
-					f->tx.cooldown = 0;
-				}
-			}
+			snap.nfriends++;
+			snap.nonline += f->conn != TOX_CONNECTION_NONE;
+			snap.ntx += f->tx.state != TRANSFER_NONE;
+			snap.nrx += f->rxstate != TRANSFER_NONE;
 
 			/* Only monitor friends that are online */
-			if (tox_friend_get_connection_status(tox, f->num, NULL) == 1) {
+			if (f->conn != TOX_CONNECTION_NONE)
 				FD_APPEND(f->fd[FTEXT_IN]);
 
-				if (f->tx.state == TRANSFER_NONE ||
-				    (f->tx.state == TRANSFER_INPROGRESS && !f->tx.cooldown))
-					FD_APPEND(f->fd[FFILE_IN]);
-			}
 			FD_APPEND(f->fd[FREMOVE]);
+			if (f->fd[FDELTA_IN] != -1)
+				FD_APPEND(f->fd[FDELTA_IN]);
+			if (f->fd[FSYNC_IN] != -1)
+				FD_APPEND(f->fd[FSYNC_IN]);
+
+			/* Delta work left over from the budget, or the next
+			 * queued file once the last one is done */
+			if (f->conn != TOX_CONNECTION_NONE &&
+			    ((!f->dtx && !TAILQ_EMPTY(&f->dqueue)) ||
+			     (f->dtx && f->dtx->state == DSCAN && !f->dtx->out.len) ||
+			     (f->drx && f->drx->state == DSIGN && !f->drx->out.len)))
+				timeout = 0;
 		}
 
-		tv.tv_sec = 0;
-		tv.tv_usec = interval(tox) * 1000;
-		n = select(fdmax + 1, &rfds, NULL, NULL, &tv);
+		/* What the transfer coroutines wait on, their FIFOs only
+		 * while the friend is online */
+		if (!TAILQ_EMPTY(&crreadyhead)) {
+			timeout = 0;
+		} else if ((co = TAILQ_FIRST(&crtimerhead))) {
+			t = monons();
+			timeout = MIN(timeout, co->wake > t ?
+				      (int)((co->wake - t + 999999) / 1000000) : 0);
+		}
+		TAILQ_FOREACH(co, &crfdhead, fentry) {
+			f = co->arg;
+			if (*co->fdp != -1 && f->conn != TOX_CONNECTION_NONE)
+				FD_APPEND(*co->fdp);
+		}
+
+		snap.npfds = npfds;
+		if (snap.iter)
+			histadd(&looph, monons() - snap.start);
+		phase = PPOLL;
+
+		n = poll(pfds, npfds, timeout);
+
+		/* The watchdog times each iteration from here */
+		snap.iter++;
+		snap.start = monons();
+		pthread_mutex_lock(&wdlock);
+		wdsnap = snap;
+		pthread_mutex_unlock(&wdlock);
+		phase = PTRANSFER;
+
 		if (n < 0) {
 			if (errno == EINTR)
 				continue;
-			eprintf("select:");
+			eprintf("poll:");
 		}
-
-		/* Check for broken transfers (friend went offline, file_out was closed) */
-		TAILQ_FOREACH(f, &friendhead, entry) {
-			if (tox_friend_get_connection_status(tox, f->num, NULL) == 0) {
-				canceltxtransfer(f);
-				cancelrxtransfer(f);
-			}
-			if (f->rxstate != TRANSFER_INPROGRESS)
-				continue;
-			fd = fifoopen(f->dirfd, ffiles[FFILE_OUT]);
-			if (fd < 0) {
-				cancelrxtransfer(f);
-			} else {
-				close(fd);
-			}
+		pfdready(fdmax);
+
+		now = time(NULL);
+		TAILQ_FOREACH(f, &friendhead, entry)
+			friendlink(f, now);
+
+		/* Resume the transfer coroutines whose event fired, a
+		 * pending buffer after a full send queue waits for its
+		 * cooldown rather than for file_in.  Those made ready
+		 * while this runs wait for the next iteration. */
+		t = monons();
+		while ((co = TAILQ_FIRST(&crtimerhead)) && t >= co->wake) {
+			TAILQ_REMOVE(&crtimerhead, co, tentry);
+			co->wake = 0;
+			crpush(co, CRTIMER);
 		}
-
-		/* If we hit the receiver too hard, we will run out of
-		 * local buffer slots.	In that case tox_file_send()
-		 * will return -1 and we will have to queue the buffer to
-		 * send it later.  If this is the last buffer read from
-		 * the FIFO, then select() won't make the fd readable again
-		 * so we have to check if there's anything pending to be
-		 * sent.
-		 */
-		TAILQ_FOREACH(f, &friendhead, entry) {
-			if (tox_friend_get_connection_status(tox, f->num, NULL) == 0)
-				continue;
-			if (f->tx.state != TRANSFER_INPROGRESS)
-				continue;
-			if (f->tx.pendingbuf)
-				sendfriendfile(f);
-			if (f->tx.state == TRANSFER_NONE)
-				FD_CLR(f->fd[FFILE_IN], &rfds);
+		if (n > 0) {
+			TAILQ_FOREACH(co, &crfdhead, fentry)
+				if (*co->fdp != -1 && FD_READY(*co->fdp))
+					crpush(co, CRFD);
+		}
+		colast = TAILQ_LAST(&crreadyhead, corohead);
+		while (colast && (co = TAILQ_FIRST(&crreadyhead))) {
+			TAILQ_REMOVE(&crreadyhead, co, rentry);
+			co->ready = 0;
+			crunwait(co);
+			co->run(co->arg);
+			if (co == colast)
+				break;
 		}
 
-		/* Accept pending transfers if any */
-		TAILQ_FOREACH(f, &friendhead, entry) {
-			if (tox_friend_get_connection_status(tox, f->num, NULL) == 0)
-				continue;
-			if (f->rxstate == TRANSFER_NONE)
-				continue;
-			if (f->fd[FFILE_OUT] >= 0)
-				continue;
-			r = fifoopen(f->dirfd, ffiles[FFILE_OUT]);
-			if (r < 0)
-				continue;
-			f->fd[FFILE_OUT] = r;
-			if (tox_file_control(tox, f->num, 0, TOX_FILE_CONTROL_RESUME, NULL) < 0) {
-				weprintf("Failed to accept transfer from receiver\n");
-				cancelrxtransfer(f);
-			} else {
-				logmsg(": %s : Rx > Accepted\n", f->name);
-				f->rxstate = TRANSFER_INPROGRESS;
-			}
+		if (queueretry && now >= queueretry) {
+			queueretry = 0;
+			queuedue = 1;
+		}
+		if (queuedue) {
+			queuedue = 0;
+			queuepass();
 		}
 
+		syncpass();
+		deltapass();
+		swarmpass();
+
 		if (n == 0)
 			continue;
 
+		if (syncfd != -1 && FD_READY(syncfd))
+			syncread();
+
+		phase = PSLOT;
 		for (i = 0; i < LEN(gslots); i++) {
-			if (FD_ISSET(gslots[i].fd[IN], &rfds) == 0)
+			if (!FD_READY(gslots[i].fd[IN]))
 				continue;
 			(*gslots[i].cb)(NULL);
 		}
 
+		phase = PREQUEST;
 		for (req = TAILQ_FIRST(&reqhead); req; req = rtmp) {
 			rtmp = TAILQ_NEXT(req, entry);
-			if (FD_ISSET(req->fd, &rfds) == 0)
+			if (!FD_READY(req->fd))
 				continue;
+			treq = monons();
 			reqfifo.name = req->idstr;
 			reqfifo.flags = O_RDONLY | O_NONBLOCK;
 			if (fiforead(gslots[REQUEST].fd[OUT], &req->fd, reqfifo,
@@ -1927,42 +6567,29 @@ loop(void)
 			unlinkat(gslots[REQUEST].fd[OUT], req->idstr, 0);
 			close(req->fd);
 			TAILQ_REMOVE(&reqhead, req, entry);
-			free(req->msg);
-			free(req);
+			tfree(req->msg);
+			tfree(req);
+			histadd(&pathh[HREQREPLY], monons() - treq);
+		}
+
+		/* Revived friends are picked up by the pass below,
+		 * which sends the text or removes them */
+		phase = PFRIEND;
+		for (f = TAILQ_FIRST(&dormanthead); f; f = ftmp) {
+			ftmp = TAILQ_NEXT(f, entry);
+			if (FD_READY(f->fd[FTEXT_IN]) || FD_READY(f->fd[FREMOVE]))
+				friendwake(f);
 		}
 
 		for (f = TAILQ_FIRST(&friendhead); f; f = ftmp) {
 			ftmp = TAILQ_NEXT(f, entry);
-			if (FD_ISSET(f->fd[FTEXT_IN], &rfds))
+			if (FD_READY(f->fd[FTEXT_IN]))
 				sendfriendtext(f);
-			if (FD_ISSET(f->fd[FFILE_IN], &rfds)) {
-				switch (f->tx.state) {
-				case TRANSFER_NONE:
-					/* Prepare a new transfer */
-					snprintf(tstamp, sizeof(tstamp), "%lu", (unsigned long)time(NULL));
-					if (tox_file_send(tox, 
-							f->num, 
-							0,
-							UINT64_MAX,
-							&f->tx.fnum, 
-							f->tx.buf, 				
-							f->tx.n, 
-							NULL) < 0){
-						//(tox_new_file_sender(tox, f->num,
-						//	0, (uint8_t *)tstamp, strlen(tstamp)) < 0) {
-						weprintf("Failed to initiate new transfer\n");
-						fiforeset(f->dirfd, &f->fd[FFILE_IN], ffiles[FFILE_IN]);
-					} else {
-						f->tx.state = TRANSFER_INITIATED;
-						logmsg(": %s : Tx > Initiated\n", f->name);
-					}
-					break;
-				case TRANSFER_INPROGRESS:
-					sendfriendfile(f);
-					break;
-				}
-			}
-			if (FD_ISSET(f->fd[FREMOVE], &rfds))
+			if (f->fd[FDELTA_IN] != -1 && FD_READY(f->fd[FDELTA_IN]))
+				deltaread(f);
+			if (f->fd[FSYNC_IN] != -1 && FD_READY(f->fd[FSYNC_IN]))
+				syncin(f);
+			if (FD_READY(f->fd[FREMOVE]))
 				removefriend(f);
 		}
 	}
@@ -1975,10 +6602,11 @@ initshutdown(int sig)
 }
 
 static void
-shutdown(void)
+cleanup(void)
 {
 	struct friend *f, *ftmp;
 	struct request *r, *rtmp;
+	struct swarm *s;
 	int    i, m;
 
 	logmsg("Shutdown\n");
@@ -1988,9 +6616,17 @@ shutdown(void)
 	/* Friends */
 	for (f = TAILQ_FIRST(&friendhead); f; f = ftmp) {
 		ftmp = TAILQ_NEXT(f, entry);
-		frienddestroy(f);
+		frienddestroy(f, 0);
+	}
+	for (f = TAILQ_FIRST(&dormanthead); f; f = ftmp) {
+		ftmp = TAILQ_NEXT(f, entry);
+		frienddestroy(f, 0);
 	}
 
+	/* Unfinished swarm downloads */
+	while ((s = TAILQ_FIRST(&swarmhead)))
+		swarmfree(s, 0);
+
 	/* Requests */
 	for (r = TAILQ_FIRST(&reqhead); r; r = rtmp) {
 		rtmp = TAILQ_NEXT(r, entry);
@@ -2001,8 +6637,8 @@ shutdown(void)
 				close(r->fd);
 		}
 		TAILQ_REMOVE(&reqhead, r, entry);
-		free(r->msg);
-		free(r);
+		tfree(r->msg);
+		tfree(r);
 	}
 
 	/* Global files and slots */
@@ -2018,10 +6654,19 @@ shutdown(void)
 		}
 		rmdir(gslots[i].name);
 	}
+	if (syncfd != -1)
+		close(syncfd);
 	unlink("id");
+	unlink("stats");
+	unlink("top");
 	if (idfd != -1)
 		close(idfd);
 
+	if (recfp && fclose(recfp) == EOF)
+		weprintf("fclose %s:", recfile);
+	if (replayfp)
+		fclose(replayfp);
+
 //	toxav_kill(toxav);
 	tox_kill(tox);
 }
@@ -2029,7 +6674,8 @@ shutdown(void)
 static void
 usage(void)
 {
-	eprintf("usage: %s [-4|-6] [-E|-e] [-T|-t] [-P|-p] [savefile]\n", argv0);
+	eprintf("usage: %s [-4|-6] [-E|-e] [-T|-t] [-P|-p] [-R|-r] [-L|-l] [-D|-d]\n"
+		"       [-c cpus] [-o record | -i record [-f]] [savefile]\n", argv0);
 }
 
 int
@@ -2060,6 +6706,36 @@ main(int argc, char *argv[])
 	case 'p':
 		proxy = 0;
 		break;
+	case 'R':
+		relay = 1;
+		break;
+	case 'r':
+		relay = 0;
+		break;
+	case 'L':
+		lan = 1;
+		break;
+	case 'l':
+		lan = 0;
+		break;
+	case 'c':
+		cpuprocess = EARGF(usage());
+		break;
+	case 'o':
+		recfile = EARGF(usage());
+		break;
+	case 'i':
+		replayfile = EARGF(usage());
+		break;
+	case 'f':
+		replayfast = 1;
+		break;
+	case 'D':
+		trace = 1;
+		break;
+	case 'd':
+		trace = 0;
+		break;
 	default:
 		usage();
 	} ARGEND;
@@ -2068,6 +6744,12 @@ main(int argc, char *argv[])
 		usage();
 	if (argc == 1)
 		savefile = *argv;
+	if ((recfile && replayfile) || (replayfast && !replayfile))
+		usage();
+	/* Handlers save as they would live, keep the profile intact */
+	if (replayfile &&
+	    snprintf(replaysave, sizeof(replaysave), "%s.replay", savefile) >= (int)sizeof(replaysave))
+		eprintf("%s: Path too long\n", savefile);
 
 	setbuf(stdout, NULL);
 
@@ -2078,10 +6760,18 @@ main(int argc, char *argv[])
 	signal(SIGPIPE, SIG_IGN);
 
 	printrat();
+	threadinit();
+	resolverinit();
 	toxinit();
 	localinit();
 	friendload();
+	syncinit();
+	recordinit();
+	watchdoginit();
+	/* Last, so that helper threads do not inherit it */
+	if (*cpumain)
+		cpupin(threads[TMAIN].name, threads[TMAIN].tid, cpumain, 0);
 	loop();
-	shutdown();
+	cleanup();
 	return 0;
 }
@@ -0,0 +1,1796 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Benchmarks and long running checks.  Each suite starts ratox instances
+ * built against the mock backend in a scratch directory, drives them
+ * through their FIFOs, with the harness itself as a mock peer where it
+ * needs to see what ratox hands to toxcore, and prints one JSON object
+ * per measurement:
+ *
+ *	{"name":"xfer.loss.2.kibps","value":812.4,"unit":"KiB/s","better":"higher"}
+ *
+ * With -c the results are compared against a stored run and any that got
+ * worse by more than the threshold are reported, making bench exit 1.
+ * Suites that check something rather than measure it exit 1 on failure. */
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tox/tox.h>
+
+#include <sodium.h>
+
+#include "../util.h"
+
+#define MAXRESULTS 1024
+#define PATSZ      (1 << 20)
+#define NETEMPORT  41000
+#define PORTBASE   40000
+#define NPATH      200	/* iterations per path */
+#define NREQUEST   20
+#define RXCHUNK    1360	/* file data per packet, as toxcore's */
+#define RXCPUSIZE  (16 << 20)
+#define NSOAKMSG   20	/* text_in latency samples per soak round */
+#define SOAKXFER   (256 << 10)
+#define SOAKWARMUP 5	/* rounds before the baseline is taken */
+#define SOAKRSS    20	/* percent RSS growth that fails the soak */
+#define SOAKLATENCY 3	/* and text_in latency growth factor */
+#define NFLAP      8	/* transfers per flap pattern */
+#define FLAPSIZE   (1 << 20)
+#define NSWARMSRC  8	/* most sources a swarm download uses */
+#define SWARMSIZE  (8 << 20)
+#define NSYNCDIR   100
+#define NSYNCFILE  10000	/* spread over NSYNCDIR directories */
+#define SYNCSIZE   1024
+#define DELTASIZE  (8 << 20)
+#define LONGSIZE   (32 << 20)
+#define LONGFLAP   2000	/* ms between blips of the DHT connection */
+#define RELAYPORT  33445
+#define RELAYKEY   "4D4482A5" /* mocktox's DHT key for RELAYPORT */ \
+	"00000000000000000000000000000000000000000000000000000000"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+struct inst {
+	pid_t    pid;
+	uint16_t port;
+	char     dir[PATH_MAX];
+	char     addr[2 * TOX_ADDRESS_SIZE + 1];
+	char     pk[2 * TOX_PUBLIC_KEY_SIZE + 1];
+};
+
+/* The harness' end of a friendship, a mock Tox in this process */
+struct peer {
+	Tox     *tox;
+	char     addr[2 * TOX_ADDRESS_SIZE + 1];
+	char     pk[2 * TOX_PUBLIC_KEY_SIZE + 1];
+	uint64_t nmsg;
+	uint64_t rxbytes;
+	int      rxdone;
+	int      txok;	/* 1 once ratox took our file, -1 if it cancelled */
+};
+
+struct result {
+	char   name[128];
+	double value;
+	int    higher;
+};
+
+struct suite {
+	char  *name;
+	int  (*run)(void);
+	int    dflt;	/* part of a plain `bench' run */
+};
+
+static int deltasuite(void);
+static int flapsuite(void);
+static int lansuite(void);
+static int longsuite(void);
+static int pathsuite(void);
+static int relaysuite(void);
+static int rxcpusuite(void);
+static int soaksuite(void);
+static int swarmsuite(void);
+static int syncsuite(void);
+static int xfersuite(void);
+
+static struct suite suites[] = {
+	{ "delta", deltasuite, 1 },
+	{ "flap",  flapsuite, 1 },
+	{ "lan",   lansuite, 1 },
+	{ "long",  longsuite, 0 },
+	{ "paths", pathsuite, 1 },
+	{ "relay", relaysuite, 0 },
+	{ "rxcpu", rxcpusuite, 1 },
+	{ "soak",  soaksuite, 0 },
+	{ "swarm", swarmsuite, 0 },
+	{ "sync",  syncsuite, 0 },
+	{ "xfer",  xfersuite, 1 },
+};
+
+static struct result results[MAXRESULTS];
+static size_t nresults;
+
+static char     ratoxbin[PATH_MAX] = "./ratox-mock";
+static char     netembin[PATH_MAX] = "./test/netem";
+static char     tmpdir[] = "/tmp/ratox-bench.XXXXXX";
+static uint8_t *pat;
+static size_t   xfersize = 1 << 20;
+static uint16_t nextport = PORTBASE;
+static pid_t    netempid = -1;
+static pid_t    pids[64];
+static int      keep;
+static char    *instflag;	/* extra ratox flag for inststart() */
+static Tox     *toxes[64];
+static size_t   ntoxes;
+static double   threshold = 10;
+static int      soaktime = 60;
+
+static uint64_t
+nowns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double
+msince(uint64_t t0)
+{
+	return (nowns() - t0) / 1E6;
+}
+
+static void
+result(const char *name, double value, const char *unit, int higher)
+{
+	struct result *r;
+
+	printf("{\"name\":\"%s\",\"value\":%.3f,\"unit\":\"%s\",\"better\":\"%s\"}\n",
+	       name, value, unit, higher ? "higher" : "lower");
+	fflush(stdout);
+	if (nresults == MAXRESULTS)
+		return;
+	r = &results[nresults++];
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	r->value = value;
+	r->higher = higher;
+}
+
+/* Let the mock peers run while waiting */
+static void
+idle(void)
+{
+	size_t i;
+
+	for (i = 0; i < ntoxes; i++)
+		tox_iterate(toxes[i]);
+	usleep(ntoxes ? 500 : 2000);
+}
+
+/* Read what fits of the file at `path', its end if it is larger */
+static ssize_t
+readfile(const char *path, char *buf, size_t sz)
+{
+	struct stat st;
+	ssize_t n, len = 0;
+	int     fd;
+
+	fd = open(path, O_RDONLY | O_NONBLOCK);
+	if (fd < 0)
+		return -1;
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size >= (off_t)sz)
+		lseek(fd, st.st_size - (sz - 1), SEEK_SET);
+	while (len < (ssize_t)sz - 1 && (n = read(fd, buf + len, sz - 1 - len)) > 0)
+		len += n;
+	close(fd);
+	buf[len] = '\0';
+	return len;
+}
+
+/* Wait until the file at `path' contains `needle', or with `inv' set until
+ * it is there and doesn't */
+static int
+waitfor(const char *path, const char *needle, int inv, int ms)
+{
+	uint64_t t0 = nowns();
+	char     buf[4096];
+
+	do {
+		if (readfile(path, buf, sizeof(buf)) >= 0 &&
+		    !strstr(buf, needle) == !!inv)
+			return 0;
+		idle();
+	} while (msince(t0) < ms);
+	return -1;
+}
+
+/* Write `s' to the FIFO at `path', waiting for ratox to open it */
+static int
+fifowrite(const char *path, const char *s, int ms)
+{
+	uint64_t t0 = nowns();
+	size_t   len = strlen(s);
+	int      fd;
+
+	while ((fd = open(path, O_WRONLY | O_NONBLOCK)) < 0) {
+		if ((errno != ENXIO && errno != ENOENT) || msince(t0) > ms)
+			return -1;
+		idle();
+	}
+	if (write(fd, s, len) != (ssize_t)len) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+static char *
+ipath(struct inst *r, const char *fmt, ...)
+{
+	static char buf[4][PATH_MAX];
+	static int  i;
+	va_list ap;
+	int     n;
+
+	i = (i + 1) % LEN(buf);
+	n = snprintf(buf[i], sizeof(buf[i]), "%s/", r->dir);
+	va_start(ap, fmt);
+	vsnprintf(buf[i] + n, sizeof(buf[i]) - n, fmt, ap);
+	va_end(ap);
+	return buf[i];
+}
+
+static pid_t
+run(char *const argv[], const char *dir, const char *log)
+{
+	pid_t pid;
+	int   fd;
+
+	pid = fork();
+	if (pid < 0)
+		eprintf("fork:");
+	if (pid)
+		return pid;
+	/* No atexit() cleanup in the child */
+	if (dir && chdir(dir) < 0) {
+		weprintf("chdir %s:", dir);
+		_exit(1);
+	}
+	fd = open(log, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd >= 0) {
+		dup2(fd, 1);
+		dup2(fd, 2);
+		close(fd);
+	}
+	fd = open("/dev/null", O_RDONLY);
+	if (fd >= 0)
+		dup2(fd, 0);
+	setpgid(0, 0);
+	execv(argv[0], argv);
+	weprintf("exec %s:", argv[0]);
+	_exit(1);
+}
+
+static void
+stop(pid_t *pid)
+{
+	if (*pid <= 0)
+		return;
+	kill(*pid, SIGTERM);
+	waitpid(*pid, NULL, 0);
+	*pid = -1;
+}
+
+/* Start a ratox instance in its own directory below the scratch one,
+ * going through the impairment proxy if `via' is set */
+static int
+inststart(struct inst *r, const char *name, uint16_t via)
+{
+	char    *argv[] = { ratoxbin, "-e", instflag, NULL };
+	char     buf[256];
+	uint64_t t0;
+	size_t   i;
+
+	snprintf(r->dir, sizeof(r->dir), "%s/%s", tmpdir, name);
+	if (mkdir(r->dir, 0755) < 0 && errno != EEXIST)
+		eprintf("mkdir %s:", r->dir);
+	r->port = nextport++;
+	snprintf(buf, sizeof(buf), "%hu", r->port);
+	setenv("MOCKTOX_PORT", buf, 1);
+	if (via) {
+		snprintf(buf, sizeof(buf), "%hu", via);
+		setenv("MOCKTOX_VIA", buf, 1);
+	}
+	r->pid = run(argv, r->dir, "log");
+	for (i = 0; i < LEN(pids) && pids[i] > 0; i++)
+		;
+	if (i < LEN(pids))
+		pids[i] = r->pid;
+	unsetenv("MOCKTOX_VIA");
+	t0 = nowns();
+	while (readfile(ipath(r, "id"), buf, sizeof(buf)) < 2 * TOX_ADDRESS_SIZE) {
+		if (msince(t0) > 5000) {
+			weprintf("%s: ratox did not start\n", name);
+			return -1;
+		}
+		usleep(2000);
+	}
+	memcpy(r->addr, buf, 2 * TOX_ADDRESS_SIZE);
+	r->addr[2 * TOX_ADDRESS_SIZE] = '\0';
+	memcpy(r->pk, r->addr, 2 * TOX_PUBLIC_KEY_SIZE);
+	r->pk[2 * TOX_PUBLIC_KEY_SIZE] = '\0';
+	return 0;
+}
+
+static void
+inststop(struct inst *r)
+{
+	size_t i;
+
+	for (i = 0; i < LEN(pids); i++)
+		if (pids[i] == r->pid)
+			pids[i] = -1;
+	stop(&r->pid);
+}
+
+static int
+online(struct inst *a, struct inst *b, int ms)
+{
+	return waitfor(ipath(a, "%s/online", b->pk), "0\n", 1, ms);
+}
+
+/* Have `a' send a friend request to `b', accept it and wait until both
+ * see each other online */
+static int
+befriend(struct inst *a, struct inst *b)
+{
+	char buf[256];
+
+	snprintf(buf, sizeof(buf), "%s bench\n", b->addr);
+	if (fifowrite(ipath(a, "request/in"), buf, 5000) < 0 ||
+	    waitfor(ipath(b, "request/out/%s", a->pk), "", 0, 10000) < 0 ||
+	    fifowrite(ipath(b, "request/out/%s", a->pk), "1\n", 5000) < 0)
+		goto err;
+	if (online(a, b, 10000) < 0 || online(b, a, 10000) < 0)
+		goto err;
+	return 0;
+err:
+	weprintf("befriending %s and %s failed\n", a->dir, b->dir);
+	return -1;
+}
+
+static void
+hex(const uint8_t *p, size_t len, char *s)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		sprintf(s + 2 * i, "%02X", p[i]);
+}
+
+static int
+unhex(const char *s, uint8_t *p, size_t len)
+{
+	unsigned int v;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (sscanf(s + 2 * i, "%2X", &v) != 1)
+			return -1;
+		p[i] = v;
+	}
+	return 0;
+}
+
+static void
+cbpeermsg(Tox *t, uint32_t n, TOX_MESSAGE_TYPE type, const uint8_t *msg, size_t len,
+	  void *ud)
+{
+	((struct peer *)ud)->nmsg++;
+}
+
+/* Take every file offered */
+static void
+cbpeeroffer(Tox *t, uint32_t n, uint32_t fnum, uint64_t sz, size_t len, void *ud)
+{
+	struct peer *p = ud;
+
+	p->rxbytes = 0;
+	p->rxdone = 0;
+	tox_file_control(t, n, fnum, TOX_FILE_CONTROL_RESUME, NULL);
+}
+
+static void
+cbpeerdata(Tox *t, uint32_t n, uint32_t fnum, uint32_t kind, uint64_t sz,
+	   const uint8_t *data, size_t len, void *ud)
+{
+	((struct peer *)ud)->rxbytes += len;
+}
+
+static void
+cbpeerctl(Tox *t, uint32_t n, uint32_t fnum, TOX_FILE_CONTROL ctl, void *ud)
+{
+	struct peer *p = ud;
+
+	/* Our outgoing files are numbered below 1 << 16 */
+	if (fnum < (1 << 16))
+		p->txok = ctl == TOX_FILE_CONTROL_RESUME ? 1 : -1;
+	else if (ctl == TOX_FILE_CONTROL_CANCEL)
+		p->rxdone = 1;
+}
+
+static Tox *
+toxstart(void)
+{
+	char buf[16];
+	Tox *t;
+
+	snprintf(buf, sizeof(buf), "%hu", nextport++);
+	setenv("MOCKTOX_PORT", buf, 1);
+	t = tox_new(NULL, NULL);
+	if (!t)
+		eprintf("tox_new failed\n");
+	if (ntoxes < LEN(toxes))
+		toxes[ntoxes++] = t;
+	return t;
+}
+
+static void
+toxstop(Tox *t)
+{
+	size_t i;
+
+	for (i = 0; i < ntoxes; i++) {
+		if (toxes[i] == t) {
+			toxes[i] = toxes[--ntoxes];
+			break;
+		}
+	}
+	tox_kill(t);
+}
+
+static void
+peerstart(struct peer *p)
+{
+	uint8_t addr[TOX_ADDRESS_SIZE];
+
+	memset(p, 0, sizeof(*p));
+	p->tox = toxstart();
+	tox_callback_friend_message(p->tox, cbpeermsg, p);
+	tox_callback_file_chunk_request(p->tox, cbpeeroffer, p);
+	tox_callback_file_recv(p->tox, cbpeerdata, p);
+	tox_callback_file_recv_control(p->tox, cbpeerctl, p);
+	tox_self_get_address(p->tox, addr);
+	hex(addr, sizeof(addr), p->addr);
+	memcpy(p->pk, p->addr, 2 * TOX_PUBLIC_KEY_SIZE);
+}
+
+/* Befriend ratox from a mock Tox, returning its friend number */
+static uint32_t
+toxbefriend(Tox *t, struct inst *r)
+{
+	uint8_t  addr[TOX_ADDRESS_SIZE];
+	char     pk[2 * TOX_PUBLIC_KEY_SIZE + 1];
+	uint32_t n;
+
+	tox_self_get_address(t, addr);
+	hex(addr, TOX_PUBLIC_KEY_SIZE, pk);
+	unhex(r->addr, addr, sizeof(addr));
+	n = tox_friend_add(t, addr, (uint8_t *)"bench", 5, NULL);
+	if (n == UINT32_MAX ||
+	    waitfor(ipath(r, "request/out/%s", pk), "", 0, 10000) < 0 ||
+	    fifowrite(ipath(r, "request/out/%s", pk), "1\n", 5000) < 0 ||
+	    waitfor(ipath(r, "%s/online", pk), "0\n", 1, 10000) < 0) {
+		weprintf("befriending ratox from the harness failed\n");
+		return UINT32_MAX;
+	}
+	return n;
+}
+
+static void
+netemstart(const char *flags)
+{
+	char *argv[32], buf[256], port[16], *p;
+	int   n = 0;
+
+	argv[n++] = netembin;
+	snprintf(buf, sizeof(buf), "%s", flags);
+	for (p = strtok(buf, " "); p && n < (int)LEN(argv) - 2; p = strtok(NULL, " "))
+		argv[n++] = p;
+	snprintf(port, sizeof(port), "%d", NETEMPORT);
+	argv[n++] = port;
+	argv[n] = NULL;
+	netempid = run(argv, NULL, "/dev/null");
+	usleep(50000);
+}
+
+static uint8_t
+patbyte(size_t off)
+{
+	return pat[off % PATSZ] ^ (off / PATSZ);
+}
+
+/* Push `size' bytes into a's file_in for b in writes of `wsz' bytes and
+ * read them back from b's file_out.  Returns the ms it took or -1 if it
+ * timed out or the data came out wrong. */
+static double
+xfer(struct inst *a, struct inst *b, size_t size, size_t wsz, int ms)
+{
+	struct pollfd pfd[2];
+	uint8_t  buf[65536], wbuf[65536];
+	uint64_t t0;
+	size_t   sent = 0, got = 0, i;
+	ssize_t  n;
+	int      in, out;
+
+	out = open(ipath(b, "%s/file_out", a->pk), O_RDONLY | O_NONBLOCK);
+	in = open(ipath(a, "%s/file_in", b->pk), O_WRONLY | O_NONBLOCK);
+	if (out < 0 || in < 0) {
+		weprintf("open file_in/file_out:");
+		goto err;
+	}
+	if (wsz > sizeof(wbuf))
+		wsz = sizeof(wbuf);
+	t0 = nowns();
+	while (got < size) {
+		if (msince(t0) > ms) {
+			weprintf("transfer timed out at %zu of %zu bytes\n", got, size);
+			goto err;
+		}
+		pfd[0].fd = out;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = in;
+		pfd[1].events = POLLOUT;
+		if (poll(pfd, in < 0 ? 1 : 2, 10) < 0 && errno != EINTR)
+			eprintf("poll:");
+		if (in >= 0 && pfd[1].revents & POLLOUT) {
+			n = MIN(wsz, size - sent);
+			for (i = 0; i < (size_t)n; i++)
+				wbuf[i] = patbyte(sent + i);
+			n = write(in, wbuf, n);
+			if (n > 0)
+				sent += n;
+			if (sent == size) {
+				close(in);
+				in = -1;
+			}
+		}
+		n = read(out, buf, sizeof(buf));
+		if (n > 0) {
+			for (i = 0; i < (size_t)n; i++) {
+				if (buf[i] != patbyte(got + i)) {
+					weprintf("transfer corrupt at byte %zu\n", got + i);
+					goto err;
+				}
+			}
+			got += n;
+		} else if (n == 0 || pfd[0].revents & POLLHUP) {
+			/* No writer yet */
+			usleep(1000);
+		}
+	}
+	close(out);
+	if (in >= 0)
+		close(in);
+	/* Let both sides finish the transfer before the next one */
+	waitfor(ipath(b, "%s/file_pending", a->pk), "\n", 1, 5000);
+	return msince(t0);
+err:
+	if (out >= 0)
+		close(out);
+	if (in >= 0)
+		close(in);
+	return -1;
+}
+
+/* CPU time in ms process `pid' used so far */
+static double
+proccpu(pid_t pid)
+{
+	unsigned long long utime, stime;
+	char   path[64], buf[1024], *p;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	/* Skip the command name, it may contain spaces */
+	if (readfile(path, buf, sizeof(buf)) < 0 || !(p = strrchr(buf, ')')) ||
+	    sscanf(p, ") %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+	           &utime, &stime) != 2)
+		return 0;
+	return (utime + stime) * 1000.0 / sysconf(_SC_CLK_TCK);
+}
+
+/* RSS in kB and the number of open fds of process `pid' */
+static size_t
+procrss(pid_t pid)
+{
+	char   path[64], buf[256];
+	size_t size, rss;
+
+	snprintf(path, sizeof(path), "/proc/%d/statm", (int)pid);
+	if (readfile(path, buf, sizeof(buf)) < 0 ||
+	    sscanf(buf, "%zu %zu", &size, &rss) != 2)
+		return 0;
+	return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static size_t
+procfds(pid_t pid)
+{
+	struct dirent *d;
+	char   path[64];
+	size_t n = 0;
+	DIR   *dp;
+
+	snprintf(path, sizeof(path), "/proc/%d/fd", (int)pid);
+	if (!(dp = opendir(path)))
+		return 0;
+	while ((d = readdir(dp)))
+		n += d->d_name[0] != '.';
+	closedir(dp);
+	return n;
+}
+
+static int
+waitgone(const char *path, int ms)
+{
+	uint64_t t0 = nowns();
+
+	while (access(path, F_OK) == 0) {
+		if (msince(t0) > ms)
+			return -1;
+		idle();
+	}
+	return 0;
+}
+
+/* Push `size' bytes into r's file_in for the peer in writes of `wsz'
+ * bytes.  Returns the ms until the peer saw all of it or -1. */
+static double
+xferpeer(struct inst *r, struct peer *p, size_t size, size_t wsz, int ms)
+{
+	struct pollfd pfd;
+	uint8_t  wbuf[65536];
+	uint64_t t0;
+	size_t   sent = 0, i;
+	ssize_t  n;
+	int      in;
+
+	in = open(ipath(r, "%s/file_in", p->pk), O_WRONLY | O_NONBLOCK);
+	if (in < 0) {
+		weprintf("open file_in:");
+		return -1;
+	}
+	if (wsz > sizeof(wbuf))
+		wsz = sizeof(wbuf);
+	p->rxbytes = 0;
+	p->rxdone = 0;
+	t0 = nowns();
+	while (!p->rxdone) {
+		if (msince(t0) > ms) {
+			weprintf("transfer timed out at %llu of %zu bytes\n",
+			         (unsigned long long)p->rxbytes, size);
+			if (in >= 0)
+				close(in);
+			return -1;
+		}
+		pfd.fd = in;
+		pfd.events = POLLOUT;
+		if (in >= 0 && poll(&pfd, 1, 0) > 0 && pfd.revents & POLLOUT) {
+			n = MIN(wsz, size - sent);
+			for (i = 0; i < (size_t)n; i++)
+				wbuf[i] = patbyte(sent + i);
+			n = write(in, wbuf, n);
+			if (n > 0)
+				sent += n;
+			if (sent == size) {
+				close(in);
+				in = -1;
+			}
+		}
+		idle();
+	}
+	if (in >= 0)
+		close(in);
+	if (p->rxbytes != size) {
+		weprintf("transfer ended at %llu of %zu bytes\n",
+		         (unsigned long long)p->rxbytes, size);
+		return -1;
+	}
+	return msince(t0);
+}
+
+/* Send `size' bytes from the peer to r and read them from its file_out.
+ * Returns the ms it took or -1. */
+static double
+xferfrom(struct inst *r, struct peer *p, uint32_t fr, size_t size, int ms)
+{
+	uint8_t  buf[65536];
+	uint64_t t0;
+	size_t   sent = 0, got = 0, n;
+	uint32_t fnum;
+	ssize_t  nr;
+	int      out, done = 0;
+
+	out = open(ipath(r, "%s/file_out", p->pk), O_RDONLY | O_NONBLOCK);
+	if (out < 0) {
+		weprintf("open file_out:");
+		return -1;
+	}
+	p->txok = 0;
+	t0 = nowns();
+	while ((fnum = tox_file_send(p->tox, fr, TOX_FILE_KIND_DATA, size, NULL,
+	                             (uint8_t *)"bench", 5, NULL)) == UINT32_MAX) {
+		if (msince(t0) > ms)
+			goto err;
+		idle();
+	}
+	while (!p->txok && msince(t0) < ms)
+		idle();
+	if (p->txok != 1)
+		goto err;
+	while (got < size) {
+		if (msince(t0) > ms)
+			goto err;
+		n = MIN(RXCHUNK, size - sent);
+		if (sent < size) {
+			if (tox_file_send(p->tox, fr, TOX_FILE_KIND_DATA, 0, NULL,
+			                  pat + sent % (PATSZ - RXCHUNK), n, NULL) != UINT32_MAX)
+				sent += n;
+			else
+				idle();
+		} else if (!done) {
+			/* The sender signals completion with a cancel */
+			if (tox_file_control(p->tox, fr, fnum, TOX_FILE_CONTROL_CANCEL, NULL))
+				done = 1;
+			else
+				idle();
+		} else {
+			idle();
+		}
+		while ((nr = read(out, buf, sizeof(buf))) > 0)
+			got += nr;
+	}
+	close(out);
+	waitfor(ipath(r, "%s/file_pending", p->pk), "\n", 1, 5000);
+	return msince(t0);
+err:
+	weprintf("transfer to ratox timed out at %zu of %zu bytes\n", got, size);
+	close(out);
+	return -1;
+}
+
+/* CPU ratox spends per GiB received, run it once each with rxsplice set
+ * and unset and compare with -c */
+static int
+rxcpusuite(void)
+{
+	struct inst r = { .pid = -1 };
+	struct peer p;
+	uint32_t fr;
+	double   cpu, t;
+	int      ret = 1;
+
+	peerstart(&p);
+	if (inststart(&r, "rxcpu", 0) < 0 ||
+	    (fr = toxbefriend(p.tox, &r)) == UINT32_MAX)
+		goto out;
+	cpu = proccpu(r.pid);
+	if ((t = xferfrom(&r, &p, fr, RXCPUSIZE, 120000)) < 0)
+		goto out;
+	cpu = proccpu(r.pid) - cpu;
+	result("rxcpu.ms_per_gib", cpu * (1 << 30) / RXCPUSIZE, "ms", 0);
+	result("rxcpu.kibps", RXCPUSIZE / 1024.0 / (t / 1000), "KiB/s", 1);
+	ret = 0;
+out:
+	inststop(&r);
+	toxstop(p.tox);
+	return ret;
+}
+
+/* Latency of each path through ratox on its own, with the harness as the
+ * friend at the other end: a line in text_in to the message on the wire,
+ * a message to the line in text_out, a name change to the rewritten name
+ * file, a request to its FIFO and accepting it, and file_in to the wire
+ * at different write sizes */
+static int
+pathsuite(void)
+{
+	static const size_t wsz[] = { 512, 4096, 65536 };
+	struct inst r = { .pid = -1 };
+	struct peer p;
+	Tox     *req[NREQUEST];
+	uint8_t  addr[TOX_ADDRESS_SIZE], key[TOX_PUBLIC_KEY_SIZE];
+	char     buf[256], pk[2 * TOX_PUBLIC_KEY_SIZE + 1];
+	double   sum, sumacc, t;
+	uint64_t t0, n0;
+	uint32_t fr;
+	size_t   i, nreq = 0;
+	int      ret = 1;
+
+	peerstart(&p);
+	if (inststart(&r, "paths", 0) < 0 ||
+	    (fr = toxbefriend(p.tox, &r)) == UINT32_MAX)
+		goto out;
+
+	for (i = 0, sum = 0; i < NPATH; i++) {
+		n0 = p.nmsg;
+		t0 = nowns();
+		if (fifowrite(ipath(&r, "%s/text_in", p.pk), "ping\n", 5000) < 0)
+			goto fail;
+		while (p.nmsg == n0 && msince(t0) < 5000)
+			idle();
+		if (p.nmsg == n0)
+			goto fail;
+		sum += msince(t0);
+	}
+	result("paths.text_in.us", sum * 1000 / NPATH, "us", 0);
+
+	for (i = 0, sum = 0; i < NPATH; i++) {
+		snprintf(buf, sizeof(buf), "pong %zu", i);
+		t0 = nowns();
+		if (!tox_friend_send_message(p.tox, fr, TOX_MESSAGE_TYPE_NORMAL,
+		                             (uint8_t *)buf, strlen(buf), NULL))
+			goto fail;
+		strcat(buf, "\n");
+		if (waitfor(ipath(&r, "%s/text_out", p.pk), buf, 0, 5000) < 0)
+			goto fail;
+		sum += msince(t0);
+	}
+	result("paths.text_out.us", sum * 1000 / NPATH, "us", 0);
+
+	for (i = 0, sum = 0; i < NPATH; i++) {
+		snprintf(buf, sizeof(buf), "bench%zu", i);
+		t0 = nowns();
+		tox_self_set_name(p.tox, (uint8_t *)buf, strlen(buf), NULL);
+		strcat(buf, "\n");
+		if (waitfor(ipath(&r, "%s/name", p.pk), buf, 0, 5000) < 0)
+			goto fail;
+		sum += msince(t0);
+	}
+	result("paths.static.us", sum * 1000 / NPATH, "us", 0);
+
+	unhex(r.addr, addr, sizeof(addr));
+	for (nreq = 0, sum = sumacc = 0; nreq < NREQUEST; nreq++) {
+		req[nreq] = toxstart();
+		tox_self_get_public_key(req[nreq], key);
+		hex(key, sizeof(key), pk);
+		t0 = nowns();
+		if (tox_friend_add(req[nreq], addr, (uint8_t *)"bench", 5, NULL) == UINT32_MAX ||
+		    waitfor(ipath(&r, "request/out/%s", pk), "", 0, 5000) < 0)
+			goto fail;
+		sum += msince(t0);
+		t0 = nowns();
+		if (fifowrite(ipath(&r, "request/out/%s", pk), "1\n", 5000) < 0 ||
+		    waitfor(ipath(&r, "%s/online", pk), "", 0, 5000) < 0)
+			goto fail;
+		sumacc += msince(t0);
+	}
+	result("paths.request.in.us", sum * 1000 / NREQUEST, "us", 0);
+	result("paths.request.accept.us", sumacc * 1000 / NREQUEST, "us", 0);
+
+	for (i = 0; i < LEN(wsz); i++) {
+		if ((t = xferpeer(&r, &p, xfersize, wsz[i], 60000)) < 0)
+			goto fail;
+		snprintf(buf, sizeof(buf), "paths.file_in.%zu.kibps", wsz[i]);
+		result(buf, xfersize / 1024.0 / (t / 1000), "KiB/s", 1);
+		waitfor(ipath(&r, "%s/file_pending", p.pk), "\n", 1, 5000);
+	}
+	ret = 0;
+	goto out;
+fail:
+	weprintf("paths: timed out\n");
+out:
+	while (nreq > 0)
+		toxstop(req[--nreq]);
+	inststop(&r);
+	toxstop(p.tox);
+	return ret;
+}
+
+/* One round of churn: a friend that comes, goes online and is removed,
+ * a request that is rejected, messages both ways and a transfer.
+ * Returns the mean text_in latency in us or -1. */
+static double
+soakround(struct inst *r, struct peer *p, uint32_t fr, size_t round)
+{
+	uint8_t  addr[TOX_ADDRESS_SIZE], key[TOX_PUBLIC_KEY_SIZE];
+	char     buf[64], pk[2][2 * TOX_PUBLIC_KEY_SIZE + 1];
+	double   sum = 0;
+	uint64_t t0, n0;
+	size_t   i;
+	Tox     *t[2];
+
+	unhex(r->addr, addr, sizeof(addr));
+	for (i = 0; i < LEN(t); i++) {
+		t[i] = toxstart();
+		tox_self_get_public_key(t[i], key);
+		hex(key, sizeof(key), pk[i]);
+		tox_friend_add(t[i], addr, (uint8_t *)"soak", 4, NULL);
+	}
+	if (waitfor(ipath(r, "request/out/%s", pk[0]), "", 0, 5000) < 0 ||
+	    fifowrite(ipath(r, "request/out/%s", pk[0]), "1\n", 5000) < 0 ||
+	    waitfor(ipath(r, "%s/online", pk[0]), "0\n", 1, 5000) < 0 ||
+	    waitfor(ipath(r, "request/out/%s", pk[1]), "", 0, 5000) < 0 ||
+	    fifowrite(ipath(r, "request/out/%s", pk[1]), "0\n", 5000) < 0 ||
+	    waitgone(ipath(r, "request/out/%s", pk[1]), 5000) < 0)
+		goto err;
+	for (i = 0; i < LEN(t); i++)
+		toxstop(t[i]);
+	if (fifowrite(ipath(r, "%s/remove", pk[0]), "1\n", 5000) < 0 ||
+	    waitgone(ipath(r, "%s", pk[0]), 5000) < 0)
+		goto err;
+
+	for (i = 0; i < NSOAKMSG; i++) {
+		snprintf(buf, sizeof(buf), "soak %zu %zu", round, i);
+		tox_friend_send_message(p->tox, fr, TOX_MESSAGE_TYPE_NORMAL,
+		                        (uint8_t *)buf, strlen(buf), NULL);
+		n0 = p->nmsg;
+		t0 = nowns();
+		if (fifowrite(ipath(r, "%s/text_in", p->pk), "ping\n", 5000) < 0)
+			return -1;
+		while (p->nmsg == n0 && msince(t0) < 5000)
+			idle();
+		if (p->nmsg == n0)
+			return -1;
+		sum += msince(t0);
+	}
+	if (xferpeer(r, p, SOAKXFER, 4096, 30000) < 0 ||
+	    waitfor(ipath(r, "%s/file_pending", p->pk), "\n", 1, 5000) < 0)
+		return -1;
+	return sum * 1000 / NSOAKMSG;
+err:
+	for (i = 0; i < LEN(t); i++)
+		toxstop(t[i]);
+	return -1;
+}
+
+/* Resource use of one instance with friends, requests, messages and
+ * transfers churning through it for soaktime seconds.  Fails when RSS,
+ * the fd count or text_in latency drifted from the first rounds. */
+static int
+soaksuite(void)
+{
+	struct inst r = { .pid = -1 };
+	struct peer p;
+	struct {
+		size_t rsskb, nfds;
+		double us;
+	} base = { 0 }, now = { 0 };
+	uint64_t t0;
+	uint32_t fr;
+	size_t   round;
+	int      ret = 1;
+
+	peerstart(&p);
+	if (inststart(&r, "soak", 0) < 0 ||
+	    (fr = toxbefriend(p.tox, &r)) == UINT32_MAX)
+		goto out;
+	t0 = nowns();
+	for (round = 0; round < SOAKWARMUP || msince(t0) < soaktime * 1000.0; round++) {
+		if ((now.us = soakround(&r, &p, fr, round)) < 0) {
+			weprintf("soak: round %zu timed out\n", round);
+			goto out;
+		}
+		now.rsskb = procrss(r.pid);
+		now.nfds = procfds(r.pid);
+		if (round == SOAKWARMUP - 1)
+			memcpy(&base, &now, sizeof(base));
+	}
+	result("soak.rounds", round, "rounds", 1);
+	result("soak.rss_kb.drift", (double)now.rsskb - base.rsskb, "kB", 0);
+	result("soak.fds.drift", (double)now.nfds - base.nfds, "fds", 0);
+	result("soak.text_in.us.drift", now.us - base.us, "us", 0);
+	ret = 0;
+	if (now.rsskb > base.rsskb + base.rsskb * SOAKRSS / 100) {
+		weprintf("soak: rss grew from %zu to %zu kB\n", base.rsskb, now.rsskb);
+		ret = 1;
+	}
+	if (now.nfds > base.nfds) {
+		weprintf("soak: fds grew from %zu to %zu\n", base.nfds, now.nfds);
+		ret = 1;
+	}
+	if (now.us > base.us * SOAKLATENCY) {
+		weprintf("soak: text_in latency grew from %.0f to %.0f us\n", base.us, now.us);
+		ret = 1;
+	}
+out:
+	inststop(&r);
+	toxstop(p.tox);
+	return ret;
+}
+
+/* Throughput and completion time through the impairment proxy as one of
+ * delay, jitter, loss or bandwidth grows */
+static int
+xfersuite(void)
+{
+	static const struct {
+		char *curve, *point, *flags;
+	} points[] = {
+		{ "delay",  "0",     ""             },
+		{ "delay",  "10",    "-d 10"        },
+		{ "delay",  "25",    "-d 25"        },
+		{ "delay",  "50",    "-d 50"        },
+		{ "delay",  "100",   "-d 100"       },
+		{ "delay",  "200",   "-d 200"       },
+		{ "jitter", "5",     "-d 50 -j 5"   },
+		{ "jitter", "10",    "-d 50 -j 10"  },
+		{ "jitter", "25",    "-d 50 -j 25"  },
+		{ "loss",   "0.5",   "-d 10 -l 0.5" },
+		{ "loss",   "1",     "-d 10 -l 1"   },
+		{ "loss",   "2",     "-d 10 -l 2"   },
+		{ "loss",   "5",     "-d 10 -l 5"   },
+		{ "loss",   "10",    "-d 10 -l 10"  },
+		{ "bw",     "512",   "-d 10 -b 512"   },
+		{ "bw",     "2048",  "-d 10 -b 2048"  },
+		{ "bw",     "8192",  "-d 10 -b 8192"  },
+		{ "bw",     "32768", "-d 10 -b 32768" },
+	};
+	struct inst a = { .pid = -1 }, b = { .pid = -1 };
+	char   name[128];
+	double t;
+	size_t i;
+	int    ret = 0;
+
+	netemstart("");
+	if (inststart(&a, "xfer-a", NETEMPORT) < 0 ||
+	    inststart(&b, "xfer-b", NETEMPORT) < 0 ||
+	    befriend(&a, &b) < 0) {
+		ret = 1;
+		goto out;
+	}
+	for (i = 0; i < LEN(points); i++) {
+		stop(&netempid);
+		netemstart(points[i].flags);
+		if (online(&a, &b, 10000) < 0 || online(&b, &a, 10000) < 0) {
+			weprintf("xfer %s %s: friends offline\n", points[i].curve, points[i].point);
+			ret = 1;
+			continue;
+		}
+		t = xfer(&a, &b, xfersize, 4096, 120000);
+		if (t < 0) {
+			ret = 1;
+			continue;
+		}
+		snprintf(name, sizeof(name), "xfer.%s.%s.ms", points[i].curve, points[i].point);
+		result(name, t, "ms", 0);
+		snprintf(name, sizeof(name), "xfer.%s.%s.kibps", points[i].curve, points[i].point);
+		result(name, xfersize / 1024.0 / (t / 1000), "KiB/s", 1);
+	}
+out:
+	inststop(&a);
+	inststop(&b);
+	stop(&netempid);
+	return ret;
+}
+
+/* Two instances in LAN mode straight over loopback: the time from
+ * starting them to both seeing the other online and a transfer */
+static int
+lansuite(void)
+{
+	struct inst a = { .pid = -1 }, b = { .pid = -1 };
+	uint64_t t0;
+	double   t;
+	int      ret = 0;
+
+	instflag = "-L";
+	t0 = nowns();
+	if (inststart(&a, "lan-a", 0) < 0 ||
+	    inststart(&b, "lan-b", 0) < 0 ||
+	    befriend(&a, &b) < 0) {
+		ret = 1;
+		goto out;
+	}
+	result("lan.setup.ms", msince(t0), "ms", 0);
+	if ((t = xfer(&a, &b, xfersize, 65536, 120000)) < 0) {
+		ret = 1;
+		goto out;
+	}
+	result("lan.xfer.ms", t, "ms", 0);
+	result("lan.xfer.kibps", xfersize / 1024.0 / (t / 1000), "KiB/s", 1);
+out:
+	instflag = NULL;
+	inststop(&a);
+	inststop(&b);
+	return ret;
+}
+
+/* Two friends over the public route, straight through test/netem, then
+ * over a ratox relay with UDP off at both ends, through it twice: the
+ * time from starting them to both being online and a transfer.  The
+ * relay leg needs a ratox-mock built with relays[] holding RELAYKEY on
+ * 127.0.0.1. */
+static int
+relaysuite(void)
+{
+	static char *routes[] = { "public", "relay" };
+	struct inst r = { .pid = -1 }, a = { .pid = -1 }, b = { .pid = -1 };
+	char     name[128], an[32], bn[32];
+	uint64_t t0;
+	uint16_t port;
+	double   t;
+	size_t   i;
+	int      ret = 0;
+
+	netemstart("-d 10 -b 4096");
+	for (i = 0; i < LEN(routes); i++) {
+		if (i) {
+			port = nextport;
+			nextport = RELAYPORT;
+			instflag = "-R";
+			ret = inststart(&r, "relay", NETEMPORT) < 0;
+			nextport = port;
+			instflag = "-T";
+			if (ret)
+				goto out;
+		}
+		snprintf(an, sizeof(an), "relay-%s-a", routes[i]);
+		snprintf(bn, sizeof(bn), "relay-%s-b", routes[i]);
+		t0 = nowns();
+		if (inststart(&a, an, NETEMPORT) < 0 ||
+		    inststart(&b, bn, NETEMPORT) < 0 ||
+		    befriend(&a, &b) < 0) {
+			if (i)
+				weprintf("relay: %s needs relays[] set to %s\n",
+				         ratoxbin, RELAYKEY);
+			ret = 1;
+			goto out;
+		}
+		snprintf(name, sizeof(name), "relay.%s.setup.ms", routes[i]);
+		result(name, msince(t0), "ms", 0);
+		if ((t = xfer(&a, &b, xfersize, 65536, 120000)) < 0) {
+			ret = 1;
+			goto out;
+		}
+		snprintf(name, sizeof(name), "relay.%s.xfer.ms", routes[i]);
+		result(name, t, "ms", 0);
+		snprintf(name, sizeof(name), "relay.%s.xfer.kibps", routes[i]);
+		result(name, xfersize / 1024.0 / (t / 1000), "KiB/s", 1);
+		inststop(&a);
+		inststop(&b);
+	}
+out:
+	instflag = NULL;
+	inststop(&r);
+	inststop(&a);
+	inststop(&b);
+	stop(&netempid);
+	return ret;
+}
+
+/* Share of transfers that complete while the link keeps going down,
+ * for outages shorter than mocktox's timeout, which only stall, and
+ * longer ones, which take the friend offline and cancel the transfer */
+static int
+flapsuite(void)
+{
+	static const struct {
+		char *point, *flags;
+	} points[] = {
+		{ "stall",   "-d 10 -o 1500:1000" },
+		{ "offline", "-d 10 -o 4000:5000" },
+	};
+	struct inst a = { .pid = -1 }, b = { .pid = -1 };
+	char   name[128];
+	double t, ms;
+	size_t i, j, ndone;
+	int    ret = 0;
+
+	netemstart("");
+	if (inststart(&a, "flap-a", NETEMPORT) < 0 ||
+	    inststart(&b, "flap-b", NETEMPORT) < 0 ||
+	    befriend(&a, &b) < 0) {
+		ret = 1;
+		goto out;
+	}
+	for (i = 0; i < LEN(points); i++) {
+		stop(&netempid);
+		netemstart(points[i].flags);
+		ndone = 0;
+		ms = 0;
+		for (j = 0; j < NFLAP; j++) {
+			if (online(&a, &b, 20000) < 0 || online(&b, &a, 20000) < 0) {
+				weprintf("flap %s: friends offline\n", points[i].point);
+				ret = 1;
+				break;
+			}
+			t = xfer(&a, &b, FLAPSIZE, 4096, 20000);
+			if (t < 0) {
+				/* Let both sides give up on it */
+				waitfor(ipath(&b, "%s/file_pending", a.pk), "\n", 1, 10000);
+				continue;
+			}
+			ndone++;
+			ms += t;
+		}
+		snprintf(name, sizeof(name), "flap.%s.completed", points[i].point);
+		result(name, 100.0 * ndone / NFLAP, "%", 1);
+		if (ndone) {
+			snprintf(name, sizeof(name), "flap.%s.ms", points[i].point);
+			result(name, ms / ndone, "ms", 0);
+		}
+	}
+out:
+	inststop(&a);
+	inststop(&b);
+	stop(&netempid);
+	return ret;
+}
+
+/* Fill the file at `path' with `size' bytes of the pattern from `off' */
+static int
+patfile(const char *path, size_t size, size_t off)
+{
+	uint8_t buf[65536];
+	size_t  i, n;
+	int     fd;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		weprintf("open %s:", path);
+		return -1;
+	}
+	while (size) {
+		n = MIN(size, sizeof(buf));
+		for (i = 0; i < n; i++)
+			buf[i] = patbyte(off + i);
+		if (write(fd, buf, n) != (ssize_t)n) {
+			weprintf("write %s:", path);
+			close(fd);
+			return -1;
+		}
+		off += n;
+		size -= n;
+	}
+	close(fd);
+	return 0;
+}
+
+/* Time to download one file through the swarm slot from 1, 2, 4 and 8
+ * friends holding it, behind test/netem's delay so each friend is
+ * limited by its window.  Needs a ratox-mock built with syncfolder set. */
+static int
+swarmsuite(void)
+{
+	struct inst dl = { .pid = -1 }, src[NSWARMSRC];
+	uint8_t *buf, h[crypto_generichash_BYTES];
+	char     line[PIPE_BUF], name[128], hash[2 * sizeof(h) + 1];
+	double   t;
+	size_t   i, n, len;
+	uint64_t t0;
+	int      ret = 0;
+
+	for (i = 0; i < NSWARMSRC; i++)
+		src[i].pid = -1;
+	if (!(buf = malloc(SWARMSIZE)))
+		eprintf("malloc:");
+	for (i = 0; i < SWARMSIZE; i++)
+		buf[i] = patbyte(i);
+	crypto_generichash(h, sizeof(h), buf, SWARMSIZE, NULL, 0);
+	free(buf);
+	hex(h, sizeof(h), hash);
+
+	netemstart("-d 25");
+	if (inststart(&dl, "swarm-dl", NETEMPORT) < 0) {
+		ret = 1;
+		goto out;
+	}
+	if (access(ipath(&dl, "sync"), F_OK) < 0) {
+		weprintf("swarm: %s is not built with syncfolder set\n", ratoxbin);
+		ret = 1;
+		goto out;
+	}
+	for (i = 0; i < NSWARMSRC; i++) {
+		snprintf(name, sizeof(name), "swarm-%zu", i);
+		if (inststart(&src[i], name, NETEMPORT) < 0 ||
+		    befriend(&dl, &src[i]) < 0 ||
+		    patfile(ipath(&src[i], "sync/swarm.bin"), SWARMSIZE, 0) < 0 ||
+		    fifowrite(ipath(&src[i], "%s/sync_in", dl.pk), "1\n", 5000) < 0) {
+			ret = 1;
+			goto out;
+		}
+	}
+	for (n = 1; n <= NSWARMSRC; n *= 2) {
+		len = snprintf(line, sizeof(line), "%s ", hash);
+		for (i = 0; i < n; i++)
+			len += snprintf(line + len, sizeof(line) - len, "%s%s",
+			                i ? "," : "", src[i].pk);
+		snprintf(line + len, sizeof(line) - len, " swarm.bin\n");
+		unlink(ipath(&dl, "swarm/out/swarm.bin"));
+		t0 = nowns();
+		if (fifowrite(ipath(&dl, "swarm/in"), line, 5000) < 0 ||
+		    waitfor(ipath(&dl, "swarm/out/swarm.bin"), "", 0, 120000) < 0) {
+			weprintf("swarm from %zu friends did not finish\n", n);
+			ret = 1;
+			continue;
+		}
+		t = msince(t0);
+		snprintf(name, sizeof(name), "swarm.src.%zu.ms", n);
+		result(name, t, "ms", 0);
+		snprintf(name, sizeof(name), "swarm.src.%zu.kibps", n);
+		result(name, SWARMSIZE / 1024.0 / (t / 1000), "KiB/s", 1);
+	}
+out:
+	inststop(&dl);
+	for (i = 0; i < NSWARMSRC; i++)
+		inststop(&src[i]);
+	stop(&netempid);
+	return ret;
+}
+
+/* The value of `key' in the instance's stats file, -1 if it is not there */
+static double
+statval(struct inst *r, const char *key)
+{
+	FILE  *fp;
+	char   line[256];
+	size_t len = strlen(key);
+	double v = -1;
+
+	if (!(fp = fopen(ipath(r, "stats"), "r")))
+		return -1;
+	while (fgets(line, sizeof(line), fp)) {
+		if (!strncmp(line, key, len) && line[len] == ' ') {
+			v = strtod(line + len + 1, NULL);
+			break;
+		}
+	}
+	fclose(fp);
+	return v;
+}
+
+/* Regular files below the instance's sync/ */
+static size_t
+synccount(struct inst *r)
+{
+	struct dirent *e;
+	DIR   *d;
+	size_t i, n = 0;
+
+	for (i = 0; i < NSYNCDIR; i++) {
+		if (!(d = opendir(ipath(r, "sync/d%02zu", i))))
+			continue;
+		while ((e = readdir(d)))
+			n += e->d_name[0] != '.';
+		closedir(d);
+	}
+	return n;
+}
+
+/* Mirror NSYNCFILE new files from one instance's sync/ to another's:
+ * the time until all of them are there, the bandwidth that makes and
+ * the sender's mean time from a change to the receiver confirming it.
+ * Needs a ratox-mock built with syncfolder set. */
+static int
+syncsuite(void)
+{
+	struct inst a = { .pid = -1 }, b = { .pid = -1 };
+	uint64_t t0;
+	double   t, n, sum;
+	size_t   i;
+	int      ret = 0;
+
+	netemstart("");
+	if (inststart(&a, "sync-a", NETEMPORT) < 0 ||
+	    inststart(&b, "sync-b", NETEMPORT) < 0 ||
+	    befriend(&a, &b) < 0) {
+		ret = 1;
+		goto out;
+	}
+	if (access(ipath(&a, "sync"), F_OK) < 0) {
+		weprintf("sync: %s is not built with syncfolder set\n", ratoxbin);
+		ret = 1;
+		goto out;
+	}
+	if (fifowrite(ipath(&a, "%s/sync_in", b.pk), "1\n", 5000) < 0 ||
+	    fifowrite(ipath(&b, "%s/sync_in", a.pk), "1\n", 5000) < 0 ||
+	    waitfor(ipath(&b, "%s/sync", a.pk), "1", 0, 5000) < 0) {
+		weprintf("sync: subscribing failed\n");
+		ret = 1;
+		goto out;
+	}
+	t0 = nowns();
+	for (i = 0; i < NSYNCDIR; i++)
+		mkdir(ipath(&a, "sync/d%02zu", i), 0755);
+	for (i = 0; i < NSYNCFILE; i++) {
+		if (patfile(ipath(&a, "sync/d%02zu/f%05zu", i % NSYNCDIR, i),
+		            SYNCSIZE, i * SYNCSIZE) < 0) {
+			ret = 1;
+			goto out;
+		}
+	}
+	while ((n = synccount(&b)) < NSYNCFILE) {
+		if (msince(t0) > 600000) {
+			weprintf("sync: %.0f of %d files mirrored\n", n, NSYNCFILE);
+			ret = 1;
+			goto out;
+		}
+		usleep(100000);
+	}
+	t = msince(t0);
+	result("sync.files.10000.ms", t, "ms", 0);
+	result("sync.files.10000.kibps", (double)NSYNCFILE * SYNCSIZE / 1024 / (t / 1000),
+	       "KiB/s", 1);
+	/* The sender's stats catch up within STATSDELAY */
+	t0 = nowns();
+	while ((n = statval(&a, "sync.lag.count")) < NSYNCFILE && msince(t0) < 15000)
+		usleep(100000);
+	sum = statval(&a, "sync.lag.sum_us");
+	if (n > 0 && sum >= 0)
+		result("sync.files.10000.lag_ms", sum / n / 1000, "ms", 0);
+out:
+	inststop(&a);
+	inststop(&b);
+	stop(&netempid);
+	return ret;
+}
+
+/* Lines of the instance's log containing `needle' */
+static size_t
+logcount(struct inst *r, const char *needle)
+{
+	FILE  *fp;
+	char   line[512];
+	size_t n = 0;
+
+	if (!(fp = fopen(ipath(r, "log"), "r")))
+		return 0;
+	while (fgets(line, sizeof(line), fp))
+		n += !!strstr(line, needle);
+	fclose(fp);
+	return n;
+}
+
+/* A transfer spanning tens of thousands of loop iterations while the DHT
+ * connection keeps dropping for a moment on both ends.  Fails if it did
+ * not complete, if either end cancelled anything or logged the DHT as
+ * connected more than once. */
+static int
+longsuite(void)
+{
+	struct inst a = { .pid = -1 }, b = { .pid = -1 };
+	char   buf[16];
+	double t;
+	int    ret = 0;
+
+	netemstart("-d 10 -b 8192");
+	snprintf(buf, sizeof(buf), "%d", LONGFLAP);
+	setenv("MOCKTOX_SELFFLAP", buf, 1);
+	if (inststart(&a, "long-a", NETEMPORT) < 0 ||
+	    inststart(&b, "long-b", NETEMPORT) < 0 ||
+	    befriend(&a, &b) < 0) {
+		ret = 1;
+		goto out;
+	}
+	if ((t = xfer(&a, &b, LONGSIZE, 65536, 600000)) < 0) {
+		ret = 1;
+		goto out;
+	}
+	result("long.xfer.ms", t, "ms", 0);
+	result("long.xfer.kibps", LONGSIZE / 1024.0 / (t / 1000), "KiB/s", 1);
+	if (statval(&a, "dht.changes") < 2 || statval(&b, "dht.changes") < 2) {
+		weprintf("long: the DHT connection never dropped\n");
+		ret = 1;
+	}
+	/* "Cancelled by Sender" is how a transfer ends */
+	if (logcount(&a, "Cancelling") || logcount(&b, "Cancelling") ||
+	    logcount(&a, "Rejected")) {
+		weprintf("long: a transfer was cancelled\n");
+		ret = 1;
+	}
+	if (logcount(&a, "DHT > Connected") != 1 || logcount(&b, "DHT > Connected") != 1) {
+		weprintf("long: the DHT was reported connected more than once\n");
+		ret = 1;
+	}
+out:
+	unsetenv("MOCKTOX_SELFFLAP");
+	inststop(&a);
+	inststop(&b);
+	stop(&netempid);
+	return ret;
+}
+
+/* Bytes sent as literals by the instance's last delta transfer, -1 if
+ * there was none */
+static double
+deltalit(struct inst *r)
+{
+	FILE  *fp;
+	char   line[512], *p;
+	unsigned long long lit;
+	double v = -1;
+
+	if (!(fp = fopen(ipath(r, "log"), "r")))
+		return -1;
+	while (fgets(line, sizeof(line), fp))
+		if ((p = strstr(line, "Delta > Sent ")) &&
+		    sscanf(p, "Delta > Sent %*s %llu literal", &lit) == 1)
+			v = lit;
+	fclose(fp);
+	return v;
+}
+
+/* Whether the file at `path' holds the `len' bytes at `buf' */
+static int
+samefile(const char *path, const uint8_t *buf, size_t len)
+{
+	uint8_t rbuf[65536];
+	size_t  off = 0;
+	ssize_t n;
+	int     fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return 0;
+	while ((n = read(fd, rbuf, sizeof(rbuf))) > 0) {
+		if (off + n > len || memcmp(rbuf, buf + off, n))
+			break;
+		off += n;
+	}
+	close(fd);
+	return n == 0 && off == len;
+}
+
+/* Send a DELTASIZE file through delta_in, then again after each of a
+ * series of synthetic edits, each on top of the one before: the time
+ * until the friend has the new version, the file size over that time
+ * and the literal bytes it took */
+static int
+deltasuite(void)
+{
+	static const struct {
+		char  *name;
+		int    kind;
+		size_t off, len;
+	} edits[] = {
+		{ "full",    'w', 0, DELTASIZE },	/* nothing to reuse yet */
+		{ "none",    'w', 0, 0 },
+		{ "block",   'w', DELTASIZE / 2, 4096 },
+		{ "scatter", 's', 0, 16 },
+		{ "insert",  'i', DELTASIZE / 3, 100 },
+		{ "append",  'i', 0, 256 << 10 },	/* at the end */
+		{ "rewrite", 'w', 0, DELTASIZE },
+	};
+	struct inst a = { .pid = -1 }, b = { .pid = -1 };
+	uint8_t *cur = NULL;
+	uint64_t t0;
+	char     name[128], line[PATH_MAX + 2], path[PATH_MAX];
+	size_t   len = 0, i, j, off, ndone, nsent;
+	double   t, lit;
+	int      fd, ret = 0;
+
+	netemstart("-d 10 -b 8192");
+	if (inststart(&a, "delta-a", NETEMPORT) < 0 ||
+	    inststart(&b, "delta-b", NETEMPORT) < 0 ||
+	    befriend(&a, &b) < 0) {
+		ret = 1;
+		goto out;
+	}
+	if (!(cur = malloc(DELTASIZE + (256 << 10) + 100)))
+		eprintf("malloc:");
+	snprintf(path, sizeof(path), "%s", ipath(&a, "dfile"));
+	snprintf(line, sizeof(line), "%s\n", path);
+	for (i = 0; i < LEN(edits); i++) {
+		off = edits[i].off;
+		switch (edits[i].kind) {
+		case 'w':
+			if (off + edits[i].len > len)
+				len = off + edits[i].len;
+			for (j = 0; j < edits[i].len; j++)
+				cur[off + j] = patbyte((i << 24) + j);
+			break;
+		case 's':
+			for (j = 0; j < edits[i].len; j++)
+				cur[len / edits[i].len * j + 17] ^= 0xff;
+			break;
+		case 'i':
+			if (!off)
+				off = len;
+			memmove(cur + off + edits[i].len, cur + off, len - off);
+			for (j = 0; j < edits[i].len; j++)
+				cur[off + j] = patbyte((i << 24) + j);
+			len += edits[i].len;
+			break;
+		}
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 ||
+		    write(fd, cur, len) != (ssize_t)len)
+			eprintf("write %s:", path);
+		close(fd);
+
+		ndone = logcount(&b, "Delta > Received dfile");
+		nsent = logcount(&a, "Delta > Sent ");
+		t0 = nowns();
+		if (fifowrite(ipath(&a, "%s/delta_in", b.pk), line, 5000) < 0) {
+			weprintf("delta: writing delta_in failed\n");
+			ret = 1;
+			goto out;
+		}
+		while (logcount(&b, "Delta > Received dfile") == ndone) {
+			if (msince(t0) > 120000) {
+				weprintf("delta %s: timed out\n", edits[i].name);
+				ret = 1;
+				goto out;
+			}
+			usleep(10000);
+		}
+		t = msince(t0);
+		if (!samefile(ipath(&b, "%s/delta/dfile", a.pk), cur, len)) {
+			weprintf("delta %s: the copies differ\n", edits[i].name);
+			ret = 1;
+			goto out;
+		}
+		snprintf(name, sizeof(name), "delta.%s.ms", edits[i].name);
+		result(name, t, "ms", 0);
+		snprintf(name, sizeof(name), "delta.%s.kibps", edits[i].name);
+		result(name, len / 1024.0 / (t / 1000), "KiB/s", 1);
+		/* The sender logs it once the friend confirmed */
+		for (t0 = nowns(); logcount(&a, "Delta > Sent ") == nsent &&
+		     msince(t0) < 5000; )
+			usleep(10000);
+		if ((lit = deltalit(&a)) < 0) {
+			weprintf("delta %s: not logged as sent\n", edits[i].name);
+			ret = 1;
+			continue;
+		}
+		snprintf(name, sizeof(name), "delta.%s.literal_kib", edits[i].name);
+		result(name, lit / 1024, "KiB", 0);
+	}
+out:
+	free(cur);
+	inststop(&a);
+	inststop(&b);
+	stop(&netempid);
+	return ret;
+}
+
+/* Report the results that got worse than in the run stored at `path' by
+ * more than the threshold */
+static int
+compare(const char *path)
+{
+	struct result *r;
+	FILE  *fp;
+	char   line[512], name[128];
+	double base, worse;
+	size_t i;
+	int    ret = 0;
+
+	if (!(fp = fopen(path, "r")))
+		eprintf("fopen %s:", path);
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "{\"name\":\"%127[^\"]\",\"value\":%lf", name, &base) != 2)
+			continue;
+		for (i = 0; i < nresults; i++)
+			if (!strcmp(results[i].name, name))
+				break;
+		if (i == nresults || base == 0)
+			continue;
+		r = &results[i];
+		worse = (r->higher ? base - r->value : r->value - base) / base * 100;
+		if (worse > threshold) {
+			fprintf(stderr, "%s: %s regressed %.1f%%, %.3f -> %.3f\n",
+			        argv0, name, worse, base, r->value);
+			ret = 1;
+		}
+	}
+	fclose(fp);
+	return ret;
+}
+
+static void
+cleanup(void)
+{
+	size_t i;
+
+	stop(&netempid);
+	for (i = 0; i < LEN(pids); i++)
+		stop(&pids[i]);
+	if (keep) {
+		fprintf(stderr, "%s: kept %s\n", argv0, tmpdir);
+	} else if (tmpdir[strlen(tmpdir) - 1] != 'X') {
+		char *argv[] = { "/bin/rm", "-rf", tmpdir, NULL };
+		pid_t pid = run(argv, NULL, "/dev/null");
+
+		waitpid(pid, NULL, 0);
+	}
+}
+
+static void
+sigexit(int sig)
+{
+	exit(1);
+}
+
+static void
+usage(void)
+{
+	eprintf("usage: %s [-k] [-c baseline] [-t percent] [-r ratox] [-n netem] [-s size] "
+	        "[-T seconds] [suite ...]\n", argv0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char   path[PATH_MAX], *base = NULL;
+	size_t i, j;
+	int    ret = 0;
+
+	ARGBEGIN {
+	case 'c':
+		base = EARGF(usage());
+		break;
+	case 't':
+		threshold = strtod(EARGF(usage()), NULL);
+		break;
+	case 'k':
+		keep = 1;
+		break;
+	case 'n':
+		snprintf(netembin, sizeof(netembin), "%s", EARGF(usage()));
+		break;
+	case 'r':
+		snprintf(ratoxbin, sizeof(ratoxbin), "%s", EARGF(usage()));
+		break;
+	case 's':
+		xfersize = strtoull(EARGF(usage()), NULL, 0);
+		break;
+	case 'T':
+		soaktime = atoi(EARGF(usage()));
+		break;
+	default:
+		usage();
+	} ARGEND;
+
+	/* Instances run in directories of their own */
+	if (!realpath(ratoxbin, path))
+		eprintf("%s:", ratoxbin);
+	snprintf(ratoxbin, sizeof(ratoxbin), "%s", path);
+	if (!realpath(netembin, path))
+		eprintf("%s:", netembin);
+	snprintf(netembin, sizeof(netembin), "%s", path);
+	if (!mkdtemp(tmpdir))
+		eprintf("mkdtemp:");
+	atexit(cleanup);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, sigexit);
+	signal(SIGTERM, sigexit);
+
+	pat = malloc(PATSZ);
+	if (!pat)
+		eprintf("malloc:");
+	srand48(1);
+	for (i = 0; i < PATSZ; i++)
+		pat[i] = lrand48();
+
+	for (i = 0; i < LEN(suites); i++) {
+		if (argc) {
+			for (j = 0; j < (size_t)argc; j++)
+				if (!strcmp(argv[j], suites[i].name))
+					break;
+			if (j == (size_t)argc)
+				continue;
+		} else if (!suites[i].dflt) {
+			continue;
+		}
+		fprintf(stderr, "%s: %s\n", argv0, suites[i].name);
+		if (suites[i].run())
+			ret = 1;
+	}
+	if (base && compare(base))
+		ret = 1;
+	return ret;
+}
@@ -0,0 +1,326 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Checks of the parts of ratox that need no instances, run by `make
+ * check'.  utf8clean() is fed random inputs and compared against a plain
+ * reference that decodes code points instead of matching byte ranges,
+ * then timed against it on ASCII, mixed UTF-8 and binary input.  Prints
+ * one JSON object per measurement as bench does, exits 1 on the first
+ * input the two disagree on. */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../arg.h"
+#include "../utf8.h"
+#include "../util.h"
+
+#define MAXLEN  2048	/* above TOX_MAX_MESSAGE_LENGTH */
+#define GUARD   16
+#define BENCHSZ (1 << 20)
+#define BENCHMS 200
+
+static uint64_t
+nowns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Encode code point `cp' at `p', returns its length */
+static size_t
+encode(uint8_t *p, uint32_t cp)
+{
+	if (cp < 0x80) {
+		p[0] = cp;
+		return 1;
+	} else if (cp < 0x800) {
+		p[0] = 0xc0 | cp >> 6;
+		p[1] = 0x80 | (cp & 0x3f);
+		return 2;
+	} else if (cp < 0x10000) {
+		p[0] = 0xe0 | cp >> 12;
+		p[1] = 0x80 | (cp >> 6 & 0x3f);
+		p[2] = 0x80 | (cp & 0x3f);
+		return 3;
+	}
+	p[0] = 0xf0 | cp >> 18;
+	p[1] = 0x80 | (cp >> 12 & 0x3f);
+	p[2] = 0x80 | (cp >> 6 & 0x3f);
+	p[3] = 0x80 | (cp & 0x3f);
+	return 4;
+}
+
+/* utf8clean() done the slow way: decode, then check the code point */
+static size_t
+refclean(char *dst, const uint8_t *src, size_t len)
+{
+	static const uint32_t min[] = { 0, 0, 0x80, 0x800, 0x10000 };
+	uint32_t cp;
+	size_t   i = 0, o = 0, n, j;
+	uint8_t  c;
+
+	while (i < len) {
+		c = src[i];
+		if (c < 0x80) {
+			if (c >= 0x20 && c != 0x7f && c != '\\')
+				dst[o++] = c;
+			else if (c == '\\')
+				o += sprintf(dst + o, "\\\\");
+			else if (c == '\n')
+				o += sprintf(dst + o, "\\n");
+			else if (c == '\r')
+				o += sprintf(dst + o, "\\r");
+			else if (c == '\t')
+				o += sprintf(dst + o, "\\t");
+			else
+				o += sprintf(dst + o, "\\x%02x", c);
+			i++;
+			continue;
+		}
+		if ((c & 0xe0) == 0xc0) {
+			n = 2;
+			cp = c & 0x1f;
+		} else if ((c & 0xf0) == 0xe0) {
+			n = 3;
+			cp = c & 0x0f;
+		} else if ((c & 0xf8) == 0xf0) {
+			n = 4;
+			cp = c & 0x07;
+		} else {
+			n = 0;
+			cp = 0;
+		}
+		for (j = 1; n && j < n; j++) {
+			if (i + j >= len || (src[i + j] & 0xc0) != 0x80)
+				n = 0;
+			else
+				cp = cp << 6 | (src[i + j] & 0x3f);
+		}
+		if (n && cp >= min[n] && cp <= 0x10ffff &&
+		    (cp < 0xd800 || cp > 0xdfff)) {
+			memcpy(dst + o, src + i, n);
+			i += n;
+			o += n;
+		} else {
+			o += encode((uint8_t *)dst + o, 0xfffd);
+			i++;
+		}
+	}
+	dst[o] = '\0';
+	return o;
+}
+
+/* Random code point, edges of the encoding lengths more often than not */
+static uint32_t
+randcp(void)
+{
+	static const uint32_t edge[] = {
+		0x7f, 0x80, 0x7ff, 0x800, 0xd7ff, 0xe000, 0xfffd, 0xffff,
+		0x10000, 0x10ffff
+	};
+	uint32_t cp;
+
+	if (lrand48() % 2)
+		return edge[lrand48() % LEN(edge)];
+	do
+		cp = lrand48() % 0x110000;
+	while (cp >= 0xd800 && cp <= 0xdfff);
+	return cp;
+}
+
+/* Fill `p' with `len' bytes of one of the kinds of input peers send */
+static void
+randtext(uint8_t *p, size_t len)
+{
+	static const uint8_t odd[] = {
+		0x00, '\t', '\n', '\r', '\\', 0x1b, 0x7f, 0x80, 0xbf, 0xc0,
+		0xc1, 0xe0, 0xed, 0xf0, 0xf4, 0xf5, 0xff
+	};
+	uint8_t buf[4];
+	size_t  i, n;
+	int     kind = lrand48() % 3;
+
+	for (i = 0; i < len; ) {
+		switch (kind) {
+		case 0:	/* garbage */
+			p[i++] = lrand48();
+			break;
+		case 1:	/* text with the odd byte */
+			p[i++] = lrand48() % 16 ? 0x20 + lrand48() % 0x5f :
+			         odd[lrand48() % LEN(odd)];
+			break;
+		default:	/* valid UTF-8, now and then broken */
+			n = encode(buf, randcp());
+			if (!(lrand48() % 32))
+				buf[lrand48() % n] ^= 1 << lrand48() % 8;
+			if (!(lrand48() % 32) && n > 1)
+				n--;
+			if (n > len - i)
+				n = len - i;
+			memcpy(p + i, buf, n);
+			i += n;
+			break;
+		}
+	}
+}
+
+static void
+dump(const char *what, const void *p, size_t len)
+{
+	const uint8_t *b = p;
+	size_t i;
+
+	fprintf(stderr, "%s:", what);
+	for (i = 0; i < len; i++)
+		fprintf(stderr, " %02x", b[i]);
+	fputc('\n', stderr);
+}
+
+/* Run utf8clean() and the reference on `n' random inputs */
+static int
+fuzz(unsigned long n)
+{
+	static char out[UTF8CLEANSZ(MAXLEN) + GUARD], ref[UTF8CLEANSZ(MAXLEN)];
+	uint8_t *in;
+	size_t   len, olen, rlen, i, j;
+	unsigned long k;
+
+	for (k = 0; k < n; k++) {
+		len = lrand48() % 8 ? lrand48() % 100 : lrand48() % (MAXLEN + 1);
+		/* Exactly as long as the input, for valgrind or ASan to see
+		 * reads past its end */
+		if (!(in = malloc(len ? len : 1)))
+			eprintf("malloc:");
+		randtext(in, len);
+		memset(out, 0xa5, sizeof(out));
+		olen = utf8clean(out, in, len);
+		rlen = refclean(ref, in, len);
+		for (j = UTF8CLEANSZ(len); j < UTF8CLEANSZ(len) + GUARD; j++)
+			if ((uint8_t)out[j] != 0xa5)
+				break;
+		if (olen != rlen || memcmp(out, ref, rlen + 1) ||
+		    j < UTF8CLEANSZ(len) + GUARD || (olen == len && memcmp(out, in, len))) {
+			weprintf("utf8clean: input %lu differs from the reference\n", k);
+			dump("in", in, len);
+			dump("out", out, olen + 1);
+			dump("ref", ref, rlen + 1);
+			free(in);
+			return -1;
+		}
+		for (i = 0; i < olen; i++) {
+			if ((uint8_t)out[i] < 0x20 || out[i] == 0x7f) {
+				weprintf("utf8clean: input %lu left a control byte\n", k);
+				dump("in", in, len);
+				free(in);
+				return -1;
+			}
+		}
+		free(in);
+	}
+	fprintf(stderr, "utf8clean: %lu inputs agree with the reference\n", n);
+	return 0;
+}
+
+/* MiB/s `clean' turns `in' into `out' at, over BENCHMS */
+static double
+rate(size_t (*clean)(char *, const uint8_t *, size_t), char *out,
+     const uint8_t *in, size_t len)
+{
+	uint64_t t0 = nowns(), t;
+	size_t   n = 0;
+
+	do {
+		clean(out, in, len);
+		n++;
+	} while ((t = nowns() - t0) < BENCHMS * 1000000ULL);
+	return (double)n * len / (1 << 20) / (t / 1E9);
+}
+
+static void
+bench(void)
+{
+	static const char *kinds[] = { "ascii", "mixed", "binary" };
+	static const char *words[] = {
+		"hello, world ", "\xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82 ",
+		"\xe2\x82\xac" "5 ", "\xf0\x9f\x98\x80\n"
+	};
+	const char *w;
+	uint8_t *in;
+	char    *out;
+	size_t   i, k, n;
+
+	in = malloc(BENCHSZ);
+	out = malloc(UTF8CLEANSZ(BENCHSZ));
+	if (!in || !out)
+		eprintf("malloc:");
+	for (k = 0; k < LEN(kinds); k++) {
+		for (i = 0; i < BENCHSZ; i++) {
+			switch (k) {
+			case 0:
+				in[i] = "The quick brown fox jumps over the lazy dog. "[i % 45];
+				break;
+			case 1:
+				/* Whole words only, spaces where none fits */
+				w = words[lrand48() % LEN(words)];
+				n = strlen(w);
+				if (n > BENCHSZ - i) {
+					memset(in + i, ' ', BENCHSZ - i);
+					i = BENCHSZ;
+				} else {
+					memcpy(in + i, w, n);
+					i += n - 1;
+				}
+				break;
+			default:
+				in[i] = lrand48();
+				break;
+			}
+		}
+		printf("{\"name\":\"utf8clean.%s.mibps\",\"value\":%.1f,"
+		       "\"unit\":\"MiB/s\",\"better\":\"higher\"}\n",
+		       kinds[k], rate(utf8clean, out, in, BENCHSZ));
+		printf("{\"name\":\"utf8clean.%s.ref.mibps\",\"value\":%.1f,"
+		       "\"unit\":\"MiB/s\",\"better\":\"higher\"}\n",
+		       kinds[k], rate(refclean, out, in, BENCHSZ));
+	}
+	free(in);
+	free(out);
+}
+
+static void
+usage(void)
+{
+	eprintf("usage: %s [-n inputs] [-s seed]\n", argv0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long n = 1000000;
+	long seed = time(NULL);
+
+	ARGBEGIN {
+	case 'n':
+		n = strtoul(EARGF(usage()), NULL, 0);
+		break;
+	case 's':
+		seed = atol(EARGF(usage()));
+		break;
+	default:
+		usage();
+	} ARGEND;
+
+	if (argc)
+		usage();
+	/* Say which seed to pass to -s to see a failure again */
+	fprintf(stderr, "%s: seed %ld\n", argv0, seed);
+	srand48(seed);
+	if (fuzz(n) < 0)
+		return 1;
+	bench();
+	return 0;
+}
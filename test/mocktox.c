@@ -0,0 +1,1380 @@
+/* See LICENSE file for copyright and license details. */
+
+/* A stand-in for toxcore over loopback UDP, so that ratox instances and
+ * the harness can talk to each other without a network, a DHT or
+ * crypto.  Only the calls ratox makes are provided.
+ *
+ * An instance binds 127.0.0.1:$MOCKTOX_PORT (any port if unset), its
+ * public key is derived from that port.  With $MOCKTOX_VIA set every
+ * datagram goes through the impairment proxy on that port instead.
+ * Friends go offline after $MOCKTOX_TIMEOUT ms of silence.  With
+ * $MOCKTOX_SELFFLAP set our own connection drops for one iteration
+ * every that many ms.
+ *
+ * An instance with a tcp_port forwards what other instances wrap for
+ * it, one with UDP disabled wraps everything for the first relay it was
+ * given the DHT key of and has no way out without one.  Unlike toxcore's,
+ * the DHT key is 'M', 'D' and the port, the same on every start.
+ *
+ * Messages, custom lossless packets and file traffic share one reliable
+ * stream per friend with up to MOCKWINDOW packets in flight, fewer while
+ * the congestion window is small; a full window fails the send like a
+ * full toxcore send queue does.  The first
+ * tox_file_send() of a transfer is the offer, seen by the peer's
+ * file_chunk_request callback, the ones after it carry data, seen by
+ * file_recv, which is how ratox drives files.  There is one transfer
+ * each way at a time.  Outgoing files are numbered 0-255 in turn and
+ * incoming ones (n + 1) << 16, as with toxcore, so controls for a
+ * transfer that is gone fail or are dropped.
+ *
+ * Nothing is encrypted, save file "encryption" only adds the header. */
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tox/tox.h>
+#include <tox/toxencryptsave.h>
+
+#define MOCKMAGIC   'M'
+#define MOCKHDR     30		/* magic, type, ports, epochs, ack, seq */
+#define MOCKRLYHDR  6		/* magic, PRELAY, ports, then the packet */
+#define MOCKMAX     2048
+#define MOCKWINDOW  64
+#define MOCKCWND    4		/* initial congestion window */
+#define MOCKPING    250		/* ms between keepalives */
+#define MOCKREQ     1000	/* ms between friend request resends */
+#define MOCKTIMEOUT 4000
+#define INFILE(n)   (((n) + 1) << 16)
+
+#define SAVEMAGIC   "mocktox1"
+#define ENCMAGIC    "toxEsave"
+
+enum { PREQ = 1, PPING, PDATA, PLOSSY, PRELAY };
+enum { KMSG = 1, KNAME, KSTATUSMSG, KSTATUS, KLOSSLESS, KFOFFER, KFDATA, KFCTL };
+
+#define SETERR(e, v) do { if (e) *(e) = (v); } while (0)
+
+struct slot {
+	uint8_t *buf;
+	size_t   len;
+	uint64_t sentat;
+	int      rexmit;
+};
+
+struct mfriend {
+	int      used;
+	uint16_t port;
+	uint8_t  name[TOX_MAX_NAME_LENGTH];
+	size_t   namelen;
+	uint8_t  smsg[TOX_MAX_STATUS_MESSAGE_LENGTH];
+	size_t   smsglen;
+	TOX_USER_STATUS status;
+	TOX_CONNECTION conn;
+	uint8_t *req;		/* friend request to resend until online */
+	size_t   reqlen;
+	uint64_t reqat;
+	uint64_t lepoch;	/* our incarnation towards them */
+	uint64_t repoch;	/* theirs as last seen */
+	uint64_t lastrx;
+	uint64_t lastping;
+	int      ackdue;
+	uint32_t txnext;	/* next sequence number to use */
+	uint32_t txuna;		/* oldest unacknowledged */
+	struct slot tx[MOCKWINDOW];
+	uint32_t rxnext;	/* next sequence number to deliver */
+	struct slot rx[MOCKWINDOW];
+	uint64_t srtt;
+	double   cwnd;		/* congestion window, in packets */
+	double   ssthresh;
+	uint32_t recover;	/* no further cut until this is acknowledged */
+	int      dupacks;
+	int      infodue;	/* 1 << KNAME etc. still to be sent */
+	uint32_t xferout;	/* file number + 1 of the transfers, 0 if none */
+	uint32_t xferin;
+	uint8_t  nextfile;
+};
+
+struct Tox {
+	int      sock;
+	uint16_t port;
+	uint16_t via;
+	uint16_t relay;		/* port of the relay to go through */
+	int      udp;
+	int      server;	/* relaying for others */
+	uint64_t fwdat;		/* last time we did */
+	uint64_t timeout;
+	uint64_t selfflap;
+	uint64_t selfat;
+	uint32_t nospam;
+	uint8_t  name[TOX_MAX_NAME_LENGTH];
+	size_t   namelen;
+	uint8_t  smsg[TOX_MAX_STATUS_MESSAGE_LENGTH];
+	size_t   smsglen;
+	TOX_USER_STATUS status;
+	TOX_CONNECTION conn;
+	struct mfriend *f;
+	uint32_t nf;
+
+	tox_self_connection_status_cb *cbself;
+	tox_friend_name_cb *cbname;
+	tox_friend_status_message_cb *cbsmsg;
+	tox_friend_status_cb *cbstatus;
+	tox_friend_connection_status_cb *cbconn;
+	tox_friend_request_cb *cbreq;
+	tox_friend_message_cb *cbmsg;
+	tox_file_recv_control_cb *cbfctl;
+	tox_file_chunk_request_cb *cbfchunk;
+	tox_file_recv_cb *cbfrecv;
+	tox_friend_lossy_packet_cb *cblossy;
+	tox_friend_lossless_packet_cb *cblossless;
+	void *ud[12];
+};
+
+static uint64_t
+nowns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void
+put32(uint8_t *p, uint32_t v)
+{
+	put16(p, v >> 16);
+	put16(p + 2, v);
+}
+
+static void
+put64(uint8_t *p, uint64_t v)
+{
+	put32(p, v >> 32);
+	put32(p + 4, v);
+}
+
+static uint16_t
+get16(const uint8_t *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+static uint32_t
+get32(const uint8_t *p)
+{
+	return (uint32_t)get16(p) << 16 | get16(p + 2);
+}
+
+static uint64_t
+get64(const uint8_t *p)
+{
+	return (uint64_t)get32(p) << 32 | get32(p + 4);
+}
+
+/* The public key is 'M', 'K' and the port, zero padded */
+static void
+port2pk(uint16_t port, uint8_t *pk)
+{
+	memset(pk, 0, TOX_PUBLIC_KEY_SIZE);
+	pk[0] = 'M';
+	pk[1] = 'K';
+	put16(pk + 2, port);
+}
+
+static int
+pk2port(const uint8_t *pk, uint16_t *port)
+{
+	uint8_t want[TOX_PUBLIC_KEY_SIZE];
+
+	*port = get16(pk + 2);
+	port2pk(*port, want);
+	return memcmp(pk, want, sizeof(want)) ? -1 : 0;
+}
+
+static struct mfriend *
+fget(const Tox *t, uint32_t n)
+{
+	if (n >= t->nf || !t->f[n].used)
+		return NULL;
+	return &t->f[n];
+}
+
+static uint32_t
+fbyport(const Tox *t, uint16_t port)
+{
+	uint32_t i;
+
+	for (i = 0; i < t->nf; i++)
+		if (t->f[i].used && t->f[i].port == port)
+			return i;
+	return UINT32_MAX;
+}
+
+static void
+mxmit(Tox *t, uint16_t dst, const uint8_t *buf, size_t len)
+{
+	struct sockaddr_in sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sa.sin_port = htons(t->via ? t->via : dst);
+	/* A full socket buffer is just another loss */
+	sendto(t->sock, buf, len, 0, (struct sockaddr *)&sa, sizeof(sa));
+}
+
+static void
+msend(Tox *t, struct mfriend *f, int type, uint32_t seq, const uint8_t *p, size_t len)
+{
+	uint8_t  buf[MOCKRLYHDR + MOCKMAX], *pkt = buf + MOCKRLYHDR;
+	uint16_t dst = f->port;
+
+	if (MOCKHDR + len > MOCKMAX)
+		return;
+	pkt[0] = MOCKMAGIC;
+	pkt[1] = type;
+	put16(pkt + 2, t->port);
+	put16(pkt + 4, f->port);
+	put64(pkt + 6, f->lepoch);
+	put64(pkt + 14, f->repoch);
+	put32(pkt + 22, f->rxnext);
+	put32(pkt + 26, seq);
+	memcpy(pkt + MOCKHDR, p, len);
+	len += MOCKHDR;
+	if (!t->udp) {
+		if (!t->relay)
+			return;
+		buf[0] = MOCKMAGIC;
+		buf[1] = PRELAY;
+		put16(buf + 2, t->port);
+		put16(buf + 4, t->relay);
+		pkt = buf;
+		len += MOCKRLYHDR;
+		dst = t->relay;
+	}
+	mxmit(t, dst, pkt, len);
+	f->ackdue = 0;
+}
+
+static void
+slotfree(struct slot *s)
+{
+	free(s->buf);
+	memset(s, 0, sizeof(*s));
+}
+
+/* Drop the stream state, both ends start over at sequence 0 */
+static void
+mreset(struct mfriend *f)
+{
+	int i;
+
+	for (i = 0; i < MOCKWINDOW; i++) {
+		slotfree(&f->tx[i]);
+		slotfree(&f->rx[i]);
+	}
+	f->txnext = f->txuna = f->rxnext = 0;
+	f->cwnd = MOCKCWND;
+	f->ssthresh = MOCKWINDOW;
+	f->recover = 0;
+	f->dupacks = 0;
+	f->xferout = f->xferin = 0;
+	f->ackdue = 0;
+}
+
+/* Queue `kind' followed by `a' and `b' on the reliable stream */
+static int
+mqueue(Tox *t, struct mfriend *f, int kind, const void *a, size_t alen,
+       const void *b, size_t blen)
+{
+	struct slot *s;
+
+	if (f->conn == TOX_CONNECTION_NONE || !f->repoch)
+		return -1;
+	if (f->txnext - f->txuna >= (uint32_t)f->cwnd)
+		return -1;
+	if (MOCKHDR + 1 + alen + blen > MOCKMAX)
+		return -1;
+	s = &f->tx[f->txnext % MOCKWINDOW];
+	s->buf = malloc(1 + alen + blen);
+	if (!s->buf)
+		return -1;
+	s->buf[0] = kind;
+	if (alen)
+		memcpy(s->buf + 1, a, alen);
+	if (blen)
+		memcpy(s->buf + 1 + alen, b, blen);
+	s->len = 1 + alen + blen;
+	s->sentat = nowns();
+	s->rexmit = 0;
+	msend(t, f, PDATA, f->txnext, s->buf, s->len);
+	f->txnext++;
+	return 0;
+}
+
+static uint64_t
+rto(struct mfriend *f)
+{
+	uint64_t r = f->srtt ? 2 * f->srtt + 10000000ULL : 200000000ULL;
+
+	if (r < 20000000ULL)
+		r = 20000000ULL;
+	if (r > 4000000000ULL)
+		r = 4000000000ULL;
+	return r;
+}
+
+/* Halve the congestion window, once per round trip, after a loss */
+static void
+mcut(struct mfriend *f, double floor)
+{
+	if ((int32_t)(f->txuna - f->recover) < 0)
+		return;
+	f->ssthresh = f->cwnd / 2 > 2 ? f->cwnd / 2 : 2;
+	f->cwnd = floor ? floor : f->ssthresh;
+	f->recover = f->txnext;
+}
+
+static void
+mresend(Tox *t, struct mfriend *f, uint32_t seq)
+{
+	struct slot *s = &f->tx[seq % MOCKWINDOW];
+
+	s->sentat = nowns();
+	s->rexmit = 1;
+	msend(t, f, PDATA, seq, s->buf, s->len);
+}
+
+static void
+mack(Tox *t, struct mfriend *f, uint32_t ack)
+{
+	struct slot *s;
+	uint64_t rtt;
+
+	/* Ignore acks for data that was never sent */
+	if (ack - f->txuna > f->txnext - f->txuna)
+		return;
+	/* Repeated acks while data is out mean the oldest got lost */
+	if (ack == f->txuna) {
+		if (f->txnext != f->txuna && ++f->dupacks == 3) {
+			mcut(f, 0);
+			mresend(t, f, f->txuna);
+		}
+		return;
+	}
+	f->dupacks = 0;
+	while (f->txuna != ack) {
+		s = &f->tx[f->txuna % MOCKWINDOW];
+		if (!s->rexmit) {
+			rtt = nowns() - s->sentat;
+			f->srtt = f->srtt ? (7 * f->srtt + rtt) / 8 : rtt;
+		}
+		slotfree(s);
+		f->txuna++;
+		f->cwnd += f->cwnd < f->ssthresh ? 1 : 1 / f->cwnd;
+		if (f->cwnd > MOCKWINDOW)
+			f->cwnd = MOCKWINDOW;
+	}
+}
+
+/* Send what changed of name, status message and status, as far as the
+ * window allows; the rest goes from tox_iterate() as toxcore keeps
+ * retrying these until they are through */
+static void
+minfo(Tox *t, struct mfriend *f)
+{
+	uint8_t st = t->status;
+
+	if (f->infodue & 1 << KNAME &&
+	    !mqueue(t, f, KNAME, t->name, t->namelen, NULL, 0))
+		f->infodue &= ~(1 << KNAME);
+	if (f->infodue & 1 << KSTATUSMSG &&
+	    !mqueue(t, f, KSTATUSMSG, t->smsg, t->smsglen, NULL, 0))
+		f->infodue &= ~(1 << KSTATUSMSG);
+	if (f->infodue & 1 << KSTATUS &&
+	    !mqueue(t, f, KSTATUS, &st, 1, NULL, 0))
+		f->infodue &= ~(1 << KSTATUS);
+}
+
+static void
+mgoonline(Tox *t, uint32_t n, struct mfriend *f)
+{
+	f->conn = t->udp ? TOX_CONNECTION_UDP : TOX_CONNECTION_TCP;
+	free(f->req);
+	f->req = NULL;
+	if (t->cbconn)
+		t->cbconn(t, n, f->conn, t->ud[4]);
+	/* Tell them who we are, as toxcore does on connect */
+	f->infodue = 1 << KNAME | 1 << KSTATUSMSG | 1 << KSTATUS;
+	minfo(t, f);
+}
+
+static void
+mgooffline(Tox *t, uint32_t n, struct mfriend *f)
+{
+	mreset(f);
+	f->lepoch++;
+	f->conn = TOX_CONNECTION_NONE;
+	if (t->cbconn)
+		t->cbconn(t, n, f->conn, t->ud[4]);
+}
+
+static void
+mdeliver(Tox *t, uint32_t n, struct mfriend *f, const uint8_t *p, size_t len)
+{
+	uint64_t sz;
+	uint32_t kind;
+	int      dir;
+
+	if (len < 1)
+		return;
+	switch (p[0]) {
+	case KMSG:
+		if (len >= 2 && t->cbmsg)
+			t->cbmsg(t, n, p[1], p + 2, len - 2, t->ud[6]);
+		break;
+	case KNAME:
+		f->namelen = len - 1 > sizeof(f->name) ? sizeof(f->name) : len - 1;
+		memcpy(f->name, p + 1, f->namelen);
+		if (t->cbname)
+			t->cbname(t, n, f->name, f->namelen, t->ud[1]);
+		break;
+	case KSTATUSMSG:
+		f->smsglen = len - 1 > sizeof(f->smsg) ? sizeof(f->smsg) : len - 1;
+		memcpy(f->smsg, p + 1, f->smsglen);
+		if (t->cbsmsg)
+			t->cbsmsg(t, n, f->smsg, f->smsglen, t->ud[2]);
+		break;
+	case KSTATUS:
+		if (len < 2)
+			break;
+		f->status = p[1];
+		if (t->cbstatus)
+			t->cbstatus(t, n, f->status, t->ud[3]);
+		break;
+	case KLOSSLESS:
+		if (t->cblossless)
+			t->cblossless(t, n, p + 1, len - 1, t->ud[11]);
+		break;
+	case KFOFFER:
+		if (len < 14)
+			break;
+		kind = get32(p + 2);
+		sz = get64(p + 6);
+		(void)kind;
+		f->xferin = p[1] + 1;
+		if (t->cbfchunk)
+			t->cbfchunk(t, n, INFILE(p[1]), sz, len - 14, t->ud[8]);
+		break;
+	case KFDATA:
+		if (len < 2 || f->xferin != p[1] + 1u)
+			break;
+		if (t->cbfrecv)
+			t->cbfrecv(t, n, INFILE(p[1]), TOX_FILE_KIND_DATA, UINT64_MAX,
+				   p + 2, len - 2, t->ud[9]);
+		break;
+	case KFCTL:
+		if (len < 4)
+			break;
+		/* `dir' is set when it is about the sender's own file */
+		dir = p[1];
+		if ((dir ? f->xferin : f->xferout) != p[2] + 1u)
+			break;
+		if (p[3] == TOX_FILE_CONTROL_CANCEL) {
+			if (dir)
+				f->xferin = 0;
+			else
+				f->xferout = 0;
+		}
+		if (t->cbfctl)
+			t->cbfctl(t, n, dir ? INFILE(p[2]) : p[2], p[3], t->ud[7]);
+		break;
+	}
+}
+
+static void
+mrecv(Tox *t, const uint8_t *buf, size_t len)
+{
+	struct mfriend *f;
+	struct slot *s, pay;
+	uint64_t e, p;
+	uint32_t n, seq, ack;
+	uint8_t  pk[TOX_PUBLIC_KEY_SIZE];
+	uint16_t sport;
+
+	if (len < MOCKHDR || buf[0] != MOCKMAGIC || get16(buf + 4) != t->port)
+		return;
+	if (buf[1] == PRELAY) {
+		/* Pass it on as it is, the way back is the sender's */
+		if (t->server && len >= MOCKRLYHDR + MOCKHDR) {
+			mxmit(t, get16(buf + MOCKRLYHDR + 4), buf + MOCKRLYHDR,
+			      len - MOCKRLYHDR);
+			t->fwdat = nowns();
+		}
+		return;
+	}
+	sport = get16(buf + 2);
+	n = fbyport(t, sport);
+	if (buf[1] == PREQ) {
+		if (n != UINT32_MAX || !t->cbreq)
+			return;
+		port2pk(sport, pk);
+		t->cbreq(t, pk, buf + MOCKHDR, len - MOCKHDR, t->ud[5]);
+		return;
+	}
+	if (n == UINT32_MAX)
+		return;
+	f = &t->f[n];
+	e = get64(buf + 6);
+	p = get64(buf + 14);
+	ack = get32(buf + 22);
+	seq = get32(buf + 26);
+
+	/* A newer incarnation of theirs lost what we had in flight */
+	if (e < f->repoch)
+		return;
+	if (e > f->repoch) {
+		if (f->repoch)
+			mreset(f);
+		f->repoch = e;
+	}
+	f->lastrx = nowns();
+	/* Callbacks may add friends and move t->f */
+	if (f->conn == TOX_CONNECTION_NONE) {
+		mgoonline(t, n, f);
+		f = &t->f[n];
+	}
+	if (p != f->lepoch)
+		return;
+	mack(t, f, ack);
+
+	switch (buf[1]) {
+	case PDATA:
+		f->ackdue = 1;
+		if (seq - f->rxnext >= MOCKWINDOW)
+			break;
+		s = &f->rx[seq % MOCKWINDOW];
+		if (!s->buf) {
+			s->buf = malloc(len - MOCKHDR);
+			if (!s->buf)
+				break;
+			memcpy(s->buf, buf + MOCKHDR, len - MOCKHDR);
+			s->len = len - MOCKHDR;
+		}
+		/* Callbacks may move t->f or drop the friend, the
+		 * payload is detached before handing it over */
+		while (f->rx[f->rxnext % MOCKWINDOW].buf) {
+			s = &f->rx[f->rxnext % MOCKWINDOW];
+			pay = *s;
+			memset(s, 0, sizeof(*s));
+			f->rxnext++;
+			mdeliver(t, n, f, pay.buf, pay.len);
+			free(pay.buf);
+			f = &t->f[n];
+			if (!f->used || f->conn == TOX_CONNECTION_NONE)
+				break;
+		}
+		break;
+	case PLOSSY:
+		if (t->cblossy)
+			t->cblossy(t, n, buf + MOCKHDR, len - MOCKHDR, t->ud[10]);
+		break;
+	}
+}
+
+static void
+fclear(struct mfriend *f)
+{
+	mreset(f);
+	free(f->req);
+	memset(f, 0, sizeof(*f));
+}
+
+static uint32_t
+fadd(Tox *t, const uint8_t *pk, TOX_ERR_FRIEND_ADD *err)
+{
+	struct mfriend *nf;
+	uint16_t port;
+	uint32_t i;
+
+	if (pk2port(pk, &port) < 0) {
+		SETERR(err, TOX_ERR_FRIEND_ADD_BAD_CHECKSUM);
+		return UINT32_MAX;
+	}
+	if (port == t->port) {
+		SETERR(err, TOX_ERR_FRIEND_ADD_OWN_KEY);
+		return UINT32_MAX;
+	}
+	if (fbyport(t, port) != UINT32_MAX) {
+		SETERR(err, TOX_ERR_FRIEND_ADD_ALREADY_SENT);
+		return UINT32_MAX;
+	}
+	for (i = 0; i < t->nf; i++)
+		if (!t->f[i].used)
+			break;
+	if (i == t->nf) {
+		nf = realloc(t->f, (t->nf + 1) * sizeof(*t->f));
+		if (!nf) {
+			SETERR(err, TOX_ERR_FRIEND_ADD_MALLOC);
+			return UINT32_MAX;
+		}
+		t->f = nf;
+		memset(&t->f[t->nf++], 0, sizeof(*t->f));
+	}
+	t->f[i].used = 1;
+	t->f[i].port = port;
+	mreset(&t->f[i]);
+	t->f[i].lepoch = nowns() / 1000;
+	SETERR(err, TOX_ERR_FRIEND_ADD_OK);
+	return i;
+}
+
+/* Save file: magic, port, nospam, status, name, status message and the
+ * friends' keys, names and status messages */
+static size_t
+savesize(const Tox *t)
+{
+	size_t sz = 8 + 2 + 4 + 1 + 2 + t->namelen + 2 + t->smsglen + 4;
+	uint32_t i;
+
+	for (i = 0; i < t->nf; i++)
+		if (t->f[i].used)
+			sz += TOX_PUBLIC_KEY_SIZE + 2 + t->f[i].namelen +
+			      2 + t->f[i].smsglen;
+	return sz;
+}
+
+static int
+load(Tox *t, const uint8_t *p, size_t len)
+{
+	const uint8_t *end = p + len;
+	uint32_t i, n, fn;
+	size_t   l;
+
+#define NEED(x) do { if ((size_t)(end - p) < (size_t)(x)) return -1; } while (0)
+	NEED(8 + 2 + 4 + 1 + 2);
+	if (memcmp(p, SAVEMAGIC, 8))
+		return -1;
+	p += 8;
+	if (!t->port)
+		t->port = get16(p);
+	t->nospam = get32(p + 2);
+	t->status = p[6];
+	l = get16(p + 7);
+	p += 9;
+	NEED(l + 2);
+	t->namelen = l > sizeof(t->name) ? sizeof(t->name) : l;
+	memcpy(t->name, p, t->namelen);
+	p += l;
+	l = get16(p);
+	p += 2;
+	NEED(l + 4);
+	t->smsglen = l > sizeof(t->smsg) ? sizeof(t->smsg) : l;
+	memcpy(t->smsg, p, t->smsglen);
+	p += l;
+	n = get32(p);
+	p += 4;
+	for (i = 0; i < n; i++) {
+		NEED(TOX_PUBLIC_KEY_SIZE + 2);
+		fn = fadd(t, p, NULL);
+		p += TOX_PUBLIC_KEY_SIZE;
+		l = get16(p);
+		p += 2;
+		NEED(l + 2);
+		if (fn != UINT32_MAX) {
+			t->f[fn].namelen = l > TOX_MAX_NAME_LENGTH ? TOX_MAX_NAME_LENGTH : l;
+			memcpy(t->f[fn].name, p, t->f[fn].namelen);
+		}
+		p += l;
+		l = get16(p);
+		p += 2;
+		NEED(l);
+		if (fn != UINT32_MAX) {
+			t->f[fn].smsglen = l > TOX_MAX_STATUS_MESSAGE_LENGTH ?
+					   TOX_MAX_STATUS_MESSAGE_LENGTH : l;
+			memcpy(t->f[fn].smsg, p, t->f[fn].smsglen);
+		}
+		p += l;
+	}
+#undef NEED
+	return 0;
+}
+
+Tox *
+tox_new(const struct Tox_Options *o, TOX_ERR_NEW *err)
+{
+	struct sockaddr_in sa;
+	socklen_t salen = sizeof(sa);
+	const char *e;
+	Tox *t;
+	int  bufsz = 4 << 20;
+
+	t = calloc(1, sizeof(*t));
+	if (!t) {
+		SETERR(err, TOX_ERR_NEW_MALLOC);
+		return NULL;
+	}
+	if ((e = getenv("MOCKTOX_PORT")))
+		t->port = atoi(e);
+	if ((e = getenv("MOCKTOX_VIA")))
+		t->via = atoi(e);
+	t->timeout = ((e = getenv("MOCKTOX_TIMEOUT")) ? atoi(e) : MOCKTIMEOUT) * 1000000ULL;
+	if ((e = getenv("MOCKTOX_SELFFLAP")))
+		t->selfflap = atoi(e) * 1000000ULL;
+	t->udp = !o || o->udp_enabled;
+	t->server = o && o->tcp_port;
+	if (o && o->savedata_type == TOX_SAVEDATA_TYPE_TOX_SAVE &&
+	    load(t, o->savedata_data, o->savedata_length) < 0) {
+		tox_kill(t);
+		SETERR(err, TOX_ERR_NEW_LOAD_BAD_FORMAT);
+		return NULL;
+	}
+
+	t->sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (t->sock < 0) {
+		free(t);
+		SETERR(err, TOX_ERR_NEW_PORT_ALLOC);
+		return NULL;
+	}
+	setsockopt(t->sock, SOL_SOCKET, SO_RCVBUF, &bufsz, sizeof(bufsz));
+	setsockopt(t->sock, SOL_SOCKET, SO_SNDBUF, &bufsz, sizeof(bufsz));
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sa.sin_port = htons(t->port);
+	if (bind(t->sock, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+	    getsockname(t->sock, (struct sockaddr *)&sa, &salen) < 0) {
+		tox_kill(t);
+		SETERR(err, TOX_ERR_NEW_PORT_ALLOC);
+		return NULL;
+	}
+	t->port = ntohs(sa.sin_port);
+	fcntl(t->sock, F_SETFL, fcntl(t->sock, F_GETFL) | O_NONBLOCK);
+	SETERR(err, TOX_ERR_NEW_OK);
+	return t;
+}
+
+void
+tox_kill(Tox *t)
+{
+	uint32_t i;
+
+	if (!t)
+		return;
+	for (i = 0; i < t->nf; i++)
+		fclear(&t->f[i]);
+	free(t->f);
+	if (t->sock > 0)
+		close(t->sock);
+	free(t);
+}
+
+size_t
+tox_get_savedata_size(const Tox *t)
+{
+	return savesize(t);
+}
+
+void
+tox_get_savedata(const Tox *t, uint8_t *p)
+{
+	uint32_t i, n = 0;
+
+	memcpy(p, SAVEMAGIC, 8);
+	put16(p + 8, t->port);
+	put32(p + 10, t->nospam);
+	p[14] = t->status;
+	put16(p + 15, t->namelen);
+	p += 17;
+	memcpy(p, t->name, t->namelen);
+	p += t->namelen;
+	put16(p, t->smsglen);
+	memcpy(p + 2, t->smsg, t->smsglen);
+	p += 2 + t->smsglen;
+	for (i = 0; i < t->nf; i++)
+		n += t->f[i].used;
+	put32(p, n);
+	p += 4;
+	for (i = 0; i < t->nf; i++) {
+		if (!t->f[i].used)
+			continue;
+		port2pk(t->f[i].port, p);
+		p += TOX_PUBLIC_KEY_SIZE;
+		put16(p, t->f[i].namelen);
+		memcpy(p + 2, t->f[i].name, t->f[i].namelen);
+		p += 2 + t->f[i].namelen;
+		put16(p, t->f[i].smsglen);
+		memcpy(p + 2, t->f[i].smsg, t->f[i].smsglen);
+		p += 2 + t->f[i].smsglen;
+	}
+}
+
+/* There is no DHT, loopback is reachable once tox_iterate() runs */
+bool
+tox_bootstrap(Tox *t, const char *host, uint16_t port, const uint8_t *pk,
+	      TOX_ERR_BOOTSTRAP *err)
+{
+	SETERR(err, TOX_ERR_BOOTSTRAP_OK);
+	return true;
+}
+
+bool
+tox_add_tcp_relay(Tox *t, const char *host, uint16_t port, const uint8_t *pk,
+		  TOX_ERR_BOOTSTRAP *err)
+{
+	/* A stale key names no one, as with toxcore */
+	if (!t->relay && pk[0] == MOCKMAGIC && pk[1] == 'D')
+		t->relay = get16(pk + 2);
+	SETERR(err, TOX_ERR_BOOTSTRAP_OK);
+	return true;
+}
+
+TOX_CONNECTION
+tox_self_get_connection_status(const Tox *t)
+{
+	return t->conn;
+}
+
+uint32_t
+tox_iteration_interval(const Tox *t)
+{
+	uint32_t i;
+
+	for (i = 0; i < t->nf; i++)
+		if (t->f[i].used && t->f[i].txnext != t->f[i].txuna)
+			return 5;
+	/* Keep up with what is being relayed */
+	if (t->fwdat && nowns() - t->fwdat < MOCKPING * 1000000ULL)
+		return 5;
+	return 50;
+}
+
+void
+tox_iterate(Tox *t)
+{
+	struct mfriend *f;
+	struct slot *s;
+	uint8_t  buf[MOCKRLYHDR + MOCKMAX];
+	uint64_t now;
+	uint32_t i, seq;
+	ssize_t  n;
+
+	if (t->conn == TOX_CONNECTION_NONE && (t->udp || t->relay)) {
+		t->conn = t->udp ? TOX_CONNECTION_UDP : TOX_CONNECTION_TCP;
+		if (t->cbself)
+			t->cbself(t, t->conn, t->ud[0]);
+	}
+	while ((n = recv(t->sock, buf, sizeof(buf), 0)) >= 0)
+		mrecv(t, buf, n);
+
+	now = nowns();
+	/* Back up on the next call, friends stay connected meanwhile */
+	if (t->selfflap && t->conn != TOX_CONNECTION_NONE) {
+		if (!t->selfat)
+			t->selfat = now;
+		if (now - t->selfat >= t->selfflap) {
+			t->selfat = now;
+			t->conn = TOX_CONNECTION_NONE;
+			if (t->cbself)
+				t->cbself(t, t->conn, t->ud[0]);
+		}
+	}
+	for (i = 0; i < t->nf; i++) {
+		f = &t->f[i];
+		if (!f->used)
+			continue;
+		if (f->conn != TOX_CONNECTION_NONE && now - f->lastrx > t->timeout) {
+			mgooffline(t, i, f);
+			continue;
+		}
+		if (f->req && now - f->reqat >= MOCKREQ * 1000000ULL) {
+			f->reqat = now;
+			msend(t, f, PREQ, 0, f->req, f->reqlen);
+		}
+		/* Timed out packets go again, as far as the shrunk
+		 * window allows */
+		for (seq = f->txuna; seq != f->txnext; seq++) {
+			s = &f->tx[seq % MOCKWINDOW];
+			if (now - s->sentat < rto(f))
+				continue;
+			mcut(f, MOCKCWND);
+			if (seq - f->txuna >= (uint32_t)f->cwnd)
+				break;
+			mresend(t, f, seq);
+		}
+		if (f->infodue && f->conn != TOX_CONNECTION_NONE)
+			minfo(t, f);
+		if (f->ackdue || now - f->lastping >= MOCKPING * 1000000ULL) {
+			f->lastping = now;
+			msend(t, f, PPING, 0, NULL, 0);
+		}
+	}
+}
+
+void
+tox_self_get_address(const Tox *t, uint8_t *addr)
+{
+	port2pk(t->port, addr);
+	put32(addr + TOX_PUBLIC_KEY_SIZE, t->nospam);
+	put16(addr + TOX_PUBLIC_KEY_SIZE + 4, 0);
+}
+
+void
+tox_self_set_nospam(Tox *t, uint32_t nospam)
+{
+	t->nospam = nospam;
+}
+
+uint32_t
+tox_self_get_nospam(const Tox *t)
+{
+	return t->nospam;
+}
+
+void
+tox_self_get_public_key(const Tox *t, uint8_t *pk)
+{
+	port2pk(t->port, pk);
+}
+
+void
+tox_self_get_dht_id(const Tox *t, uint8_t *pk)
+{
+	port2pk(t->port, pk);
+	pk[1] = 'D';
+}
+
+static void
+broadcast(Tox *t, int kind)
+{
+	uint32_t i;
+
+	for (i = 0; i < t->nf; i++) {
+		if (t->f[i].used) {
+			t->f[i].infodue |= 1 << kind;
+			minfo(t, &t->f[i]);
+		}
+	}
+}
+
+bool
+tox_self_set_name(Tox *t, const uint8_t *name, size_t len, TOX_ERR_SET_INFO *err)
+{
+	if (len > sizeof(t->name)) {
+		SETERR(err, TOX_ERR_SET_INFO_TOO_LONG);
+		return false;
+	}
+	memcpy(t->name, name, len);
+	t->namelen = len;
+	broadcast(t, KNAME);
+	SETERR(err, TOX_ERR_SET_INFO_OK);
+	return true;
+}
+
+size_t
+tox_self_get_name_size(const Tox *t)
+{
+	return t->namelen;
+}
+
+void
+tox_self_get_name(const Tox *t, uint8_t *name)
+{
+	memcpy(name, t->name, t->namelen);
+}
+
+bool
+tox_self_set_status_message(Tox *t, const uint8_t *msg, size_t len, TOX_ERR_SET_INFO *err)
+{
+	if (len > sizeof(t->smsg)) {
+		SETERR(err, TOX_ERR_SET_INFO_TOO_LONG);
+		return false;
+	}
+	memcpy(t->smsg, msg, len);
+	t->smsglen = len;
+	broadcast(t, KSTATUSMSG);
+	SETERR(err, TOX_ERR_SET_INFO_OK);
+	return true;
+}
+
+size_t
+tox_self_get_status_message_size(const Tox *t)
+{
+	return t->smsglen;
+}
+
+void
+tox_self_get_status_message(const Tox *t, uint8_t *msg)
+{
+	memcpy(msg, t->smsg, t->smsglen);
+}
+
+void
+tox_self_set_status(Tox *t, TOX_USER_STATUS status)
+{
+	t->status = status;
+	broadcast(t, KSTATUS);
+}
+
+TOX_USER_STATUS
+tox_self_get_status(const Tox *t)
+{
+	return t->status;
+}
+
+uint32_t
+tox_friend_add(Tox *t, const uint8_t *addr, const uint8_t *msg, size_t len,
+	       TOX_ERR_FRIEND_ADD *err)
+{
+	struct mfriend *f;
+	uint32_t n;
+
+	if (!len) {
+		SETERR(err, TOX_ERR_FRIEND_ADD_NO_MESSAGE);
+		return UINT32_MAX;
+	}
+	n = fadd(t, addr, err);
+	if (n == UINT32_MAX)
+		return n;
+	f = &t->f[n];
+	f->req = malloc(len);
+	if (f->req) {
+		memcpy(f->req, msg, len);
+		f->reqlen = len;
+	}
+	return n;
+}
+
+uint32_t
+tox_friend_add_norequest(Tox *t, const uint8_t *pk, TOX_ERR_FRIEND_ADD *err)
+{
+	return fadd(t, pk, err);
+}
+
+bool
+tox_friend_delete(Tox *t, uint32_t n, TOX_ERR_FRIEND_DELETE *err)
+{
+	struct mfriend *f = fget(t, n);
+
+	if (!f) {
+		SETERR(err, TOX_ERR_FRIEND_DELETE_FRIEND_NOT_FOUND);
+		return false;
+	}
+	fclear(f);
+	SETERR(err, TOX_ERR_FRIEND_DELETE_OK);
+	return true;
+}
+
+bool
+tox_friend_get_public_key(const Tox *t, uint32_t n, uint8_t *pk,
+			  TOX_ERR_FRIEND_GET_PUBLIC_KEY *err)
+{
+	struct mfriend *f = fget(t, n);
+
+	if (!f) {
+		SETERR(err, TOX_ERR_FRIEND_GET_PUBLIC_KEY_FRIEND_NOT_FOUND);
+		return false;
+	}
+	port2pk(f->port, pk);
+	SETERR(err, TOX_ERR_FRIEND_GET_PUBLIC_KEY_OK);
+	return true;
+}
+
+size_t
+tox_self_get_friend_list_size(const Tox *t)
+{
+	uint32_t i;
+	size_t   n = 0;
+
+	for (i = 0; i < t->nf; i++)
+		n += t->f[i].used;
+	return n;
+}
+
+void
+tox_self_get_friend_list(const Tox *t, uint32_t *list)
+{
+	uint32_t i;
+
+	for (i = 0; i < t->nf; i++)
+		if (t->f[i].used)
+			*list++ = i;
+}
+
+#define QUERY(t, n, err, fail) do {					\
+	if (!fget((t), (n))) {						\
+		SETERR((err), TOX_ERR_FRIEND_QUERY_FRIEND_NOT_FOUND);	\
+		return (fail);						\
+	}								\
+	SETERR((err), TOX_ERR_FRIEND_QUERY_OK);				\
+} while (0)
+
+size_t
+tox_friend_get_name_size(const Tox *t, uint32_t n, TOX_ERR_FRIEND_QUERY *err)
+{
+	QUERY(t, n, err, SIZE_MAX);
+	return t->f[n].namelen;
+}
+
+bool
+tox_friend_get_name(const Tox *t, uint32_t n, uint8_t *name, TOX_ERR_FRIEND_QUERY *err)
+{
+	QUERY(t, n, err, false);
+	memcpy(name, t->f[n].name, t->f[n].namelen);
+	return true;
+}
+
+size_t
+tox_friend_get_status_message_size(const Tox *t, uint32_t n, TOX_ERR_FRIEND_QUERY *err)
+{
+	QUERY(t, n, err, SIZE_MAX);
+	return t->f[n].smsglen;
+}
+
+bool
+tox_friend_get_status_message(const Tox *t, uint32_t n, uint8_t *msg,
+			      TOX_ERR_FRIEND_QUERY *err)
+{
+	QUERY(t, n, err, false);
+	memcpy(msg, t->f[n].smsg, t->f[n].smsglen);
+	return true;
+}
+
+TOX_USER_STATUS
+tox_friend_get_status(const Tox *t, uint32_t n, TOX_ERR_FRIEND_QUERY *err)
+{
+	QUERY(t, n, err, TOX_USER_STATUS_NONE);
+	return t->f[n].status;
+}
+
+TOX_CONNECTION
+tox_friend_get_connection_status(const Tox *t, uint32_t n, TOX_ERR_FRIEND_QUERY *err)
+{
+	QUERY(t, n, err, TOX_CONNECTION_NONE);
+	return t->f[n].conn;
+}
+
+uint32_t
+tox_friend_send_message(Tox *t, uint32_t n, TOX_MESSAGE_TYPE type, const uint8_t *msg,
+			size_t len, TOX_ERR_FRIEND_SEND_MESSAGE *err)
+{
+	struct mfriend *f = fget(t, n);
+	uint8_t ty = type;
+
+	if (!f) {
+		SETERR(err, TOX_ERR_FRIEND_SEND_MESSAGE_FRIEND_NOT_FOUND);
+		return 0;
+	}
+	if (!len) {
+		SETERR(err, TOX_ERR_FRIEND_SEND_MESSAGE_EMPTY);
+		return 0;
+	}
+	if (len > TOX_MAX_MESSAGE_LENGTH) {
+		SETERR(err, TOX_ERR_FRIEND_SEND_MESSAGE_TOO_LONG);
+		return 0;
+	}
+	if (f->conn == TOX_CONNECTION_NONE) {
+		SETERR(err, TOX_ERR_FRIEND_SEND_MESSAGE_FRIEND_NOT_CONNECTED);
+		return 0;
+	}
+	if (mqueue(t, f, KMSG, &ty, 1, msg, len) < 0) {
+		SETERR(err, TOX_ERR_FRIEND_SEND_MESSAGE_SENDQ);
+		return 0;
+	}
+	SETERR(err, TOX_ERR_FRIEND_SEND_MESSAGE_OK);
+	return f->txnext;
+}
+
+bool
+tox_file_control(Tox *t, uint32_t n, uint32_t fnum, TOX_FILE_CONTROL ctrl,
+		 TOX_ERR_FILE_CONTROL *err)
+{
+	struct mfriend *f = fget(t, n);
+	uint32_t *x;
+	uint8_t  c[3];
+
+	if (!f) {
+		SETERR(err, TOX_ERR_FILE_CONTROL_FRIEND_NOT_FOUND);
+		return false;
+	}
+	if (f->conn == TOX_CONNECTION_NONE) {
+		SETERR(err, TOX_ERR_FILE_CONTROL_FRIEND_NOT_CONNECTED);
+		return false;
+	}
+	c[0] = fnum < INFILE(0);
+	c[1] = c[0] ? fnum : (fnum >> 16) - 1;
+	c[2] = ctrl;
+	x = c[0] ? &f->xferout : &f->xferin;
+	if (*x != c[1] + 1u) {
+		SETERR(err, TOX_ERR_FILE_CONTROL_NOT_FOUND);
+		return false;
+	}
+	if (mqueue(t, f, KFCTL, c, sizeof(c), NULL, 0) < 0) {
+		SETERR(err, TOX_ERR_FILE_CONTROL_SENDQ);
+		return false;
+	}
+	if (ctrl == TOX_FILE_CONTROL_CANCEL)
+		*x = 0;
+	SETERR(err, TOX_ERR_FILE_CONTROL_OK);
+	return true;
+}
+
+uint32_t
+tox_file_send(Tox *t, uint32_t n, uint32_t kind, uint64_t sz, const uint8_t *id,
+	      const uint8_t *name, size_t len, TOX_ERR_FILE_SEND *err)
+{
+	struct mfriend *f = fget(t, n);
+	uint8_t hdr[13];
+
+	if (!f) {
+		SETERR(err, TOX_ERR_FILE_SEND_FRIEND_NOT_FOUND);
+		return UINT32_MAX;
+	}
+	if (f->conn == TOX_CONNECTION_NONE) {
+		SETERR(err, TOX_ERR_FILE_SEND_FRIEND_NOT_CONNECTED);
+		return UINT32_MAX;
+	}
+	if (len && !name) {
+		SETERR(err, TOX_ERR_FILE_SEND_NULL);
+		return UINT32_MAX;
+	}
+	if (f->xferout) {
+		hdr[0] = f->xferout - 1;
+		if (mqueue(t, f, KFDATA, hdr, 1, name, len) < 0) {
+			SETERR(err, TOX_ERR_FILE_SEND_TOO_MANY);
+			return UINT32_MAX;
+		}
+		SETERR(err, TOX_ERR_FILE_SEND_OK);
+		return f->xferout - 1;
+	}
+	hdr[0] = f->nextfile;
+	put32(hdr + 1, kind);
+	put64(hdr + 5, sz);
+	if (mqueue(t, f, KFOFFER, hdr, sizeof(hdr), name, len) < 0) {
+		SETERR(err, TOX_ERR_FILE_SEND_TOO_MANY);
+		return UINT32_MAX;
+	}
+	f->xferout = f->nextfile++ + 1u;
+	SETERR(err, TOX_ERR_FILE_SEND_OK);
+	return f->xferout - 1;
+}
+
+static bool
+custom(Tox *t, uint32_t n, const uint8_t *p, size_t len, int lossy,
+       TOX_ERR_FRIEND_CUSTOM_PACKET *err)
+{
+	struct mfriend *f = fget(t, n);
+
+	if (!f) {
+		SETERR(err, TOX_ERR_FRIEND_CUSTOM_PACKET_FRIEND_NOT_FOUND);
+		return false;
+	}
+	if (!len) {
+		SETERR(err, TOX_ERR_FRIEND_CUSTOM_PACKET_EMPTY);
+		return false;
+	}
+	if (len > TOX_MAX_CUSTOM_PACKET_SIZE) {
+		SETERR(err, TOX_ERR_FRIEND_CUSTOM_PACKET_TOO_LONG);
+		return false;
+	}
+	if (f->conn == TOX_CONNECTION_NONE) {
+		SETERR(err, TOX_ERR_FRIEND_CUSTOM_PACKET_FRIEND_NOT_CONNECTED);
+		return false;
+	}
+	if (lossy) {
+		msend(t, f, PLOSSY, 0, p, len);
+	} else if (mqueue(t, f, KLOSSLESS, p, len, NULL, 0) < 0) {
+		SETERR(err, TOX_ERR_FRIEND_CUSTOM_PACKET_SENDQ);
+		return false;
+	}
+	SETERR(err, TOX_ERR_FRIEND_CUSTOM_PACKET_OK);
+	return true;
+}
+
+bool
+tox_friend_send_lossy_packet(Tox *t, uint32_t n, const uint8_t *p, size_t len,
+			     TOX_ERR_FRIEND_CUSTOM_PACKET *err)
+{
+	return custom(t, n, p, len, 1, err);
+}
+
+bool
+tox_friend_send_lossless_packet(Tox *t, uint32_t n, const uint8_t *p, size_t len,
+				TOX_ERR_FRIEND_CUSTOM_PACKET *err)
+{
+	return custom(t, n, p, len, 0, err);
+}
+
+#define CALLBACK(name, type, field, slot)			\
+void								\
+tox_callback_##name(Tox *t, type *cb, void *ud)			\
+{								\
+	t->field = cb;						\
+	t->ud[slot] = ud;					\
+}
+
+CALLBACK(self_connection_status, tox_self_connection_status_cb, cbself, 0)
+CALLBACK(friend_name, tox_friend_name_cb, cbname, 1)
+CALLBACK(friend_status_message, tox_friend_status_message_cb, cbsmsg, 2)
+CALLBACK(friend_status, tox_friend_status_cb, cbstatus, 3)
+CALLBACK(friend_connection_status, tox_friend_connection_status_cb, cbconn, 4)
+CALLBACK(friend_request, tox_friend_request_cb, cbreq, 5)
+CALLBACK(friend_message, tox_friend_message_cb, cbmsg, 6)
+CALLBACK(file_recv_control, tox_file_recv_control_cb, cbfctl, 7)
+CALLBACK(file_chunk_request, tox_file_chunk_request_cb, cbfchunk, 8)
+CALLBACK(file_recv, tox_file_recv_cb, cbfrecv, 9)
+CALLBACK(friend_lossy_packet, tox_friend_lossy_packet_cb, cblossy, 10)
+CALLBACK(friend_lossless_packet, tox_friend_lossless_packet_cb, cblossless, 11)
+
+bool
+tox_pass_encrypt(const uint8_t *in, size_t len, const uint8_t *pass, size_t passlen,
+		 uint8_t *out, TOX_ERR_ENCRYPTION *err)
+{
+	memset(out, 0, TOX_PASS_ENCRYPTION_EXTRA_LENGTH);
+	memcpy(out, ENCMAGIC, 8);
+	memmove(out + TOX_PASS_ENCRYPTION_EXTRA_LENGTH, in, len);
+	SETERR(err, TOX_ERR_ENCRYPTION_OK);
+	return true;
+}
+
+bool
+tox_pass_decrypt(const uint8_t *in, size_t len, const uint8_t *pass, size_t passlen,
+		 uint8_t *out, TOX_ERR_DECRYPTION *err)
+{
+	if (len < TOX_PASS_ENCRYPTION_EXTRA_LENGTH) {
+		SETERR(err, TOX_ERR_DECRYPTION_INVALID_LENGTH);
+		return false;
+	}
+	if (!tox_is_data_encrypted(in)) {
+		SETERR(err, TOX_ERR_DECRYPTION_BAD_FORMAT);
+		return false;
+	}
+	memmove(out, in + TOX_PASS_ENCRYPTION_EXTRA_LENGTH,
+		len - TOX_PASS_ENCRYPTION_EXTRA_LENGTH);
+	SETERR(err, TOX_ERR_DECRYPTION_OK);
+	return true;
+}
+
+bool
+tox_is_data_encrypted(const uint8_t *p)
+{
+	return !memcmp(p, ENCMAGIC, 8);
+}
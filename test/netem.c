@@ -0,0 +1,261 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Userspace network impairment for mocktox instances started with
+ * MOCKTOX_VIA set to our port: each datagram is dropped with the given
+ * loss, queued behind the ones before it at the given bandwidth, then
+ * held back for the delay plus a uniform jitter, which reorders.  With
+ * -o, the link also goes down for `down' ms every `up' + `down' ms. */
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../arg.h"
+#include "../util.h"
+
+#define MAXPKT  2048
+#define MAXDST  64
+
+struct pkt {
+	uint64_t at;
+	uint16_t dst;
+	uint16_t len;
+	uint8_t  buf[MAXPKT];
+};
+
+/* Each destination port is a link of its own */
+struct link {
+	uint16_t port;
+	uint64_t busy;
+};
+
+static struct pkt **heap;
+static size_t nheap, heapsz;
+static struct link links[MAXDST];
+static size_t nlinks;
+
+static double   delay, jitter, loss, bw, qmax = 1000;
+static uint64_t up, down;
+static uint64_t nfwd, nloss, nqdrop, noutage;
+static volatile sig_atomic_t running = 1;
+
+static uint64_t
+nowns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+heappush(struct pkt *p)
+{
+	size_t i, parent;
+
+	if (nheap == heapsz) {
+		heapsz = heapsz ? 2 * heapsz : 1024;
+		heap = realloc(heap, heapsz * sizeof(*heap));
+		if (!heap)
+			eprintf("realloc:");
+	}
+	for (i = nheap++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (heap[parent]->at <= p->at)
+			break;
+		heap[i] = heap[parent];
+	}
+	heap[i] = p;
+}
+
+static struct pkt *
+heappop(void)
+{
+	struct pkt *top = heap[0], *last = heap[--nheap];
+	size_t i = 0, c;
+
+	for (;;) {
+		c = 2 * i + 1;
+		if (c >= nheap)
+			break;
+		if (c + 1 < nheap && heap[c + 1]->at < heap[c]->at)
+			c++;
+		if (last->at <= heap[c]->at)
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	if (nheap)
+		heap[i] = last;
+	return top;
+}
+
+static struct link *
+linkget(uint16_t port)
+{
+	size_t i;
+
+	for (i = 0; i < nlinks; i++)
+		if (links[i].port == port)
+			return &links[i];
+	if (nlinks == MAXDST)
+		return NULL;
+	links[nlinks].port = port;
+	links[nlinks].busy = 0;
+	return &links[nlinks++];
+}
+
+/* Schedule a datagram or account why it was dropped */
+static void
+impair(const uint8_t *buf, size_t len, uint64_t now, uint64_t start)
+{
+	struct link *l;
+	struct pkt *p;
+	uint64_t at, ser;
+	double   j;
+
+	if (len < 6 || buf[0] != 'M' || !(l = linkget(buf[4] << 8 | buf[5])))
+		return;
+	if (down && (now - start) % ((up + down) * 1000000) >= up * 1000000) {
+		noutage++;
+		return;
+	}
+	if (loss > 0 && drand48() * 100 < loss) {
+		nloss++;
+		return;
+	}
+	at = now;
+	if (bw > 0) {
+		ser = len * 8 * 1E9 / (bw * 1000);
+		if (l->busy > now && l->busy - now > qmax * 1E6) {
+			nqdrop++;
+			return;
+		}
+		l->busy = (l->busy > now ? l->busy : now) + ser;
+		at = l->busy;
+	}
+	j = jitter > 0 ? (drand48() * 2 - 1) * jitter : 0;
+	if (delay + j > 0)
+		at += (delay + j) * 1E6;
+	p = malloc(sizeof(*p));
+	if (!p)
+		eprintf("malloc:");
+	p->at = at;
+	p->dst = l->port;
+	p->len = len;
+	memcpy(p->buf, buf, len);
+	heappush(p);
+}
+
+static void
+stop(int sig)
+{
+	running = 0;
+}
+
+static void
+usage(void)
+{
+	eprintf("usage: %s [-d delay] [-j jitter] [-l loss%%] [-b kbit/s] [-q queue]\n"
+		"       [-o up:down] [-s seed] port\n", argv0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_in sa;
+	struct pollfd pfd;
+	struct pkt *p;
+	uint8_t  buf[MAXPKT];
+	uint64_t now, start;
+	ssize_t  n;
+	long     seed = 1;
+	int      s, timeout;
+
+	ARGBEGIN {
+	case 'd':
+		delay = atof(EARGF(usage()));
+		break;
+	case 'j':
+		jitter = atof(EARGF(usage()));
+		break;
+	case 'l':
+		loss = atof(EARGF(usage()));
+		break;
+	case 'b':
+		bw = atof(EARGF(usage()));
+		break;
+	case 'q':
+		qmax = atof(EARGF(usage()));
+		break;
+	case 'o':
+		if (sscanf(EARGF(usage()), "%llu:%llu",
+			   (unsigned long long *)&up, (unsigned long long *)&down) != 2)
+			usage();
+		break;
+	case 's':
+		seed = atol(EARGF(usage()));
+		break;
+	default:
+		usage();
+	} ARGEND;
+
+	if (argc != 1)
+		usage();
+	srand48(seed);
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	if (s < 0)
+		eprintf("socket:");
+	n = 4 << 20;
+	setsockopt(s, SOL_SOCKET, SO_RCVBUF, &n, sizeof(int));
+	setsockopt(s, SOL_SOCKET, SO_SNDBUF, &n, sizeof(int));
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sa.sin_port = htons(atoi(argv[0]));
+	if (bind(s, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+		eprintf("bind %s:", argv[0]);
+
+	start = nowns();
+	pfd.fd = s;
+	pfd.events = POLLIN;
+	while (running) {
+		now = nowns();
+		while (nheap && heap[0]->at <= now) {
+			p = heappop();
+			sa.sin_port = htons(p->dst);
+			sendto(s, p->buf, p->len, 0, (struct sockaddr *)&sa, sizeof(sa));
+			nfwd++;
+			free(p);
+		}
+		timeout = 100;
+		if (nheap)
+			timeout = (heap[0]->at - now) / 1000000;
+		if (poll(&pfd, 1, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			eprintf("poll:");
+		}
+		now = nowns();
+		while ((n = recv(s, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+			impair(buf, n, now, start);
+	}
+	fprintf(stderr, "forwarded %llu lost %llu queue_drops %llu outage_drops %llu\n",
+		(unsigned long long)nfwd, (unsigned long long)nloss,
+		(unsigned long long)nqdrop, (unsigned long long)noutage);
+	return 0;
+}
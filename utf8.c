@@ -0,0 +1,111 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "utf8.h"
+
+/* Length of the valid UTF-8 sequence at `p', 0 if there is none */
+static size_t
+seqlen(const uint8_t *p, size_t len)
+{
+	uint8_t c = p[0], lo = 0x80, hi = 0xbf;
+	size_t  n, i;
+
+	if (c >= 0xc2 && c <= 0xdf)
+		n = 2;
+	else if (c >= 0xe0 && c <= 0xef)
+		n = 3;
+	else if (c >= 0xf0 && c <= 0xf4)
+		n = 4;
+	else
+		return 0;
+	/* No overlong forms, surrogates or code points above U+10FFFF */
+	if (c == 0xe0)
+		lo = 0xa0;
+	else if (c == 0xed)
+		hi = 0x9f;
+	else if (c == 0xf0)
+		lo = 0x90;
+	else if (c == 0xf4)
+		hi = 0x8f;
+	if (len < n || p[1] < lo || p[1] > hi)
+		return 0;
+	for (i = 2; i < n; i++)
+		if ((p[i] & 0xc0) != 0x80)
+			return 0;
+	return n;
+}
+
+/* Copy `len' bytes of peer supplied text to `dst' as one line of valid
+ * UTF-8: backslashes, newlines, tabs and other control characters are
+ * escaped, invalid bytes become U+FFFD.  `dst' needs UTF8CLEANSZ(len)
+ * bytes.  Returns the length written, which equals `len' only if the
+ * text was left as is. */
+size_t
+utf8clean(char *dst, const uint8_t *src, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t i = 0, o = 0, n;
+	uint8_t c;
+#ifdef __SSE2__
+	__m128i v, sp = _mm_set1_epi8(0x20), del = _mm_set1_epi8(0x7f);
+	__m128i bs = _mm_set1_epi8('\\');
+	int     m;
+#endif
+
+	while (i < len) {
+#ifdef __SSE2__
+		/* Runs of printable ASCII are copied 16 bytes at a time,
+		 * bytes at or above 0x80 are negative for the signed compare.
+		 * Not worth a load when this byte already ends the run. */
+		if (i + 16 <= len && src[i] >= 0x20 && src[i] < 0x7f) {
+			v = _mm_loadu_si128((const __m128i *)(src + i));
+			m = _mm_movemask_epi8(_mm_or_si128(
+				_mm_or_si128(_mm_cmplt_epi8(v, sp), _mm_cmpeq_epi8(v, del)),
+				_mm_cmpeq_epi8(v, bs)));
+			if (!m) {
+				_mm_storeu_si128((__m128i *)(dst + o), v);
+				i += 16;
+				o += 16;
+				continue;
+			}
+			n = __builtin_ctz(m);
+			memcpy(dst + o, src + i, n);
+			i += n;
+			o += n;
+		}
+#endif
+		c = src[i];
+		if (c >= 0x20 && c < 0x7f && c != '\\') {
+			dst[o++] = c;
+			i++;
+		} else if (c < 0x80 || c == '\\') {
+			dst[o++] = '\\';
+			switch (c) {
+			case '\\': dst[o++] = '\\'; break;
+			case '\n': dst[o++] = 'n';  break;
+			case '\r': dst[o++] = 'r';  break;
+			case '\t': dst[o++] = 't';  break;
+			default:
+				dst[o++] = 'x';
+				dst[o++] = hex[c >> 4];
+				dst[o++] = hex[c & 0xf];
+				break;
+			}
+			i++;
+		} else if ((n = seqlen(src + i, len - i))) {
+			memcpy(dst + o, src + i, n);
+			i += n;
+			o += n;
+		} else {
+			memcpy(dst + o, "\xef\xbf\xbd", 3);
+			i++;
+			o += 3;
+		}
+	}
+	dst[o] = '\0';
+	return o;
+}
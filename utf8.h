@@ -0,0 +1,6 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Room utf8clean() needs for `n' input bytes, including the NUL */
+#define UTF8CLEANSZ(n) (4 * (n) + 1)
+
+size_t utf8clean(char *, const uint8_t *, size_t);